@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Compare the results of microbench against a baseline
+#
+# Both files are the JSON output of "microbench -j".  A benchmark has
+# regressed if its time per operation grew by more than the threshold, or
+# if it allocates more often than it did.  Benchmarks that only appear in
+# one of the files are listed but not judged.  The exit code is 1 if
+# anything regressed.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import argparse
+import json
+import sys
+import os
+
+
+def load(path):
+    with open(path) as f:
+        return {(res['bench'], res['subject']): res for res in json.load(f)}
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Compare microbench results')
+    parser.add_argument('baseline', help='results to compare against')
+    parser.add_argument('results', help='results of the current build')
+    parser.add_argument('-t', '--threshold', type=float, default=10,
+                        help='percent by which ns/op may grow')
+
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+
+    if not os.path.exists(args.baseline):
+        print('No baseline in {}, run "make bench-baseline" to create one'.format(
+              args.baseline))
+        return 0
+
+    baseline = load(args.baseline)
+    results = load(args.results)
+    regressed = 0
+
+    print('{:<6} {:<40} {:>12} {:>12} {:>8} {:>10} {:>10}  {}'.format(
+          'bench', 'subject', 'base ns/op', 'ns/op', 'delta', 'base alloc',
+          'allocs', ''))
+
+    for key in sorted(set(baseline) | set(results)):
+        base = baseline.get(key)
+        res = results.get(key)
+
+        if not base or not res:
+            print('{:<6} {:<40} {}'.format(key[0], key[1],
+                  'new' if res else 'missing'))
+            continue
+
+        delta = (res['ns_per_op'] / base['ns_per_op'] - 1) * 100
+        verdict = ''
+        # allow for rounding of the average over the last batch
+        if delta > args.threshold or \
+           res['allocs_per_op'] > base['allocs_per_op'] + 0.01:
+            verdict = 'REGRESSED'
+            regressed += 1
+
+        print('{:<6} {:<40} {:>12.1f} {:>12.1f} {:>+7.1f}% {:>10.2f} {:>10.2f}  {}'.format(
+              key[0], key[1], base['ns_per_op'], res['ns_per_op'], delta,
+              base['allocs_per_op'], res['allocs_per_op'], verdict))
+
+    if regressed:
+        print('{} benchmarks regressed'.format(regressed))
+        return 1
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
+
+# vim: set et ts=4 sw=4:
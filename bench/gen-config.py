@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Generate a synthetic belayd config for benchmarking
+#
+# Every rule gets its own meminfo causes, each with a distinct value so
+# that no two causes are shared, and none of them ever trips.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import argparse
+import json
+import sys
+
+FIELDS = ['MemTotal', 'MemFree', 'MemAvailable', 'Cached', 'SwapTotal']
+
+# larger than any /proc/meminfo value, in kB
+NEVER = 1 << 60
+
+
+def cause(idx):
+    return {
+        'name': 'meminfo',
+        'args': {
+            'field': FIELDS[idx % len(FIELDS)],
+            'operator': 'greaterthan',
+            'value': str(NEVER + idx)
+        }
+    }
+
+
+def effect(idx):
+    return {
+        'name': 'print',
+        'args': {
+            'file': 'stderr'
+        }
+    }
+
+
+def write_config(out, rules, causes, effects):
+    # stream the rules so that huge configs are not built in memory
+    out.write('{\n\t"rules": [\n')
+
+    for r in range(rules):
+        rule = {
+            'name': 'Generated rule {}'.format(r),
+            'causes': [cause(r * causes + c) for c in range(causes)],
+            'effects': [effect(r * effects + e) for e in range(effects)]
+        }
+
+        out.write('\t\t')
+        out.write(json.dumps(rule))
+        out.write(',\n' if r + 1 < rules else '\n')
+
+    out.write('\t]\n}\n')
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Generate a belayd config')
+    parser.add_argument('-r', '--rules', type=int, default=1000,
+                        help='number of rules')
+    parser.add_argument('-c', '--causes', type=int, default=2,
+                        help='causes per rule')
+    parser.add_argument('-e', '--effects', type=int, default=1,
+                        help='effects per rule')
+    parser.add_argument('-o', '--output', default='-',
+                        help='output file, or - for stdout')
+
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+
+    if args.output == '-':
+        write_config(sys.stdout, args.rules, args.causes, args.effects)
+    else:
+        with open(args.output, 'w') as out:
+            write_config(out, args.rules, args.causes, args.effects)
+
+
+if __name__ == '__main__':
+    main()
+
+# vim: set et ts=4 sw=4:
@@ -0,0 +1,465 @@
+// LICENSE TBD
+/**
+ * Microbenchmarks for belayd
+ *
+ * Each benchmark repeats one operation until a batch of them takes at
+ * least the minimum time, and reports the last batch:
+ *
+ *	parse	parse_config() of the config, and freeing the rule set
+ *	tick	one tick of the main loop in which every rule of the config
+ *		is due.  The ticks are driven by loop_tick() on a virtual
+ *		clock that advances by the polling interval, so the causes
+ *		are evaluated as often as they would be, without sleeping.
+ *	cause	main() of one instance of each cause, with a new cause_ctx
+ *		per call, so that samples shared within a tick are re-read
+ *
+ * For each, the time per operation, the heap allocations per operation
+ * and the peak RSS of the process so far are printed, as a table or as
+ * JSON.  The allocations are counted by wrapping glibc's malloc().
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "belayd-internal.h"
+#include "defines.h"
+
+#define BENCH_MAX_OPS		100000000ULL
+#define BENCH_DEFAULT_MIN_MS	1000
+
+struct bench_result {
+	const char *name;
+	const char *subject;
+	unsigned long long ops;
+	double ns_per_op;
+	double allocs_per_op;
+	long max_rss_kb;
+};
+
+/* run one operation of a benchmark */
+typedef int (*bench_fn)(void *arg);
+
+static struct {
+	uint64_t min_ns;
+	bool json;
+	int results;
+} bench = {
+	.min_ns = BENCH_DEFAULT_MIN_MS * 1000000ULL,
+};
+
+static unsigned long long alloc_cnt;
+
+#ifdef __GLIBC__
+/*
+ * Count every allocation, including those of json-c and of glibc itself,
+ * which glibc routes through these as well
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+	__atomic_fetch_add(&alloc_cnt, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_fetch_add(&alloc_cnt, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_fetch_add(&alloc_cnt, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	__atomic_fetch_add(&alloc_cnt, 1, __ATOMIC_RELAXED);
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	__atomic_fetch_add(&alloc_cnt, 1, __ATOMIC_RELAXED);
+	*memptr = __libc_memalign(alignment, size);
+
+	return *memptr ? 0 : ENOMEM;
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#endif /* __GLIBC__ */
+
+static uint64_t bench_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void bench_report(const struct bench_result * const res)
+{
+	if (bench.json) {
+		printf("%s{\"bench\": \"%s\", \"subject\": \"%s\", \"ops\": %llu, "
+		       "\"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, \"max_rss_kb\": %ld}",
+		       bench.results ? ",\n\t" : "[\n\t", res->name, res->subject, res->ops,
+		       res->ns_per_op, res->allocs_per_op, res->max_rss_kb);
+	} else {
+		if (!bench.results)
+			printf("%-6s %-40s %12s %14s %12s %12s\n", "bench", "subject", "ops",
+			       "ns/op", "allocs/op", "max RSS kB");
+		printf("%-6s %-40s %12llu %14.1f %12.2f %12ld\n", res->name, res->subject,
+		       res->ops, res->ns_per_op, res->allocs_per_op, res->max_rss_kb);
+	}
+
+	bench.results++;
+	fflush(stdout);
+}
+
+/*
+ * Run fn in batches that grow until one takes at least the minimum time,
+ * and report that batch
+ */
+static int bench_run(const char * const name, const char * const subject, bench_fn fn,
+		     void *arg)
+{
+	unsigned long long ops = 1, next, allocs, i;
+	struct bench_result res;
+	uint64_t start, elapsed;
+	struct rusage usage;
+	int ret;
+
+	while (1) {
+		allocs = __atomic_load_n(&alloc_cnt, __ATOMIC_RELAXED);
+		start = bench_ns();
+
+		for (i = 0; i < ops; i++) {
+			ret = (*fn)(arg);
+			if (ret) {
+				fprintf(stderr, "%s of %s failed: %d\n", name, subject, ret);
+				return ret;
+			}
+		}
+
+		elapsed = bench_ns() - start;
+		allocs = __atomic_load_n(&alloc_cnt, __ATOMIC_RELAXED) - allocs;
+
+		if (elapsed >= bench.min_ns || ops >= BENCH_MAX_OPS)
+			break;
+
+		/* aim 20% past the minimum, growing by at most 100x per batch */
+		next = elapsed ? (unsigned long long)(ops * 1.2 * bench.min_ns / elapsed) : ops * 100;
+		if (next > ops * 100)
+			next = ops * 100;
+		if (next <= ops)
+			next = ops + 1;
+		ops = next < BENCH_MAX_OPS ? next : BENCH_MAX_OPS;
+	}
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	res.name = name;
+	res.subject = subject;
+	res.ops = ops;
+	res.ns_per_op = (double)elapsed / ops;
+#ifdef __GLIBC__
+	res.allocs_per_op = (double)allocs / ops;
+#else
+	res.allocs_per_op = -1;
+#endif
+	res.max_rss_kb = usage.ru_maxrss;
+	bench_report(&res);
+
+	return 0;
+}
+
+static void bench_opts_init(struct belayd_opts * const opts, const char * const config)
+{
+	memset(opts, 0, sizeof(struct belayd_opts));
+	snprintf(opts->config, sizeof(opts->config), "%s", config);
+	opts->interval = 5000;
+	opts->workers = 1;
+	opts->queue_depth = 256;
+
+	/* always parse the JSON, even if the config has been compiled */
+	opts->compile = true;
+}
+
+static int parse_op(void *arg)
+{
+	struct belayd_opts *opts = arg;
+	int ret;
+
+	ret = parse_config(opts);
+	rule_set_free(&opts->set);
+
+	return ret;
+}
+
+static int bench_parse(const char * const config)
+{
+	struct belayd_opts opts;
+
+	bench_opts_init(&opts, config);
+
+	return bench_run("parse", config, parse_op, &opts);
+}
+
+struct tick_arg {
+	struct belayd_opts *opts;
+	uint64_t now;
+};
+
+static int tick_op(void *arg)
+{
+	struct tick_arg *tick = arg;
+
+	tick->now += tick->opts->interval;
+
+	return loop_tick(tick->opts, tick->now);
+}
+
+static int bench_tick(const char * const config, int workers)
+{
+	struct tick_arg tick;
+	struct belayd_opts opts;
+	int ret;
+
+	bench_opts_init(&opts, config);
+	opts.workers = workers;
+
+	ret = loop_init();
+	if (ret)
+		goto out;
+
+	ret = parse_config(&opts);
+	if (ret)
+		goto out;
+
+	/* the virtual clock starts at an arbitrary, nonzero time */
+	tick.opts = &opts;
+	tick.now = opts.interval;
+
+	ret = loop_start(&opts, tick.now);
+	if (ret)
+		goto out;
+
+	ret = bench_run("tick", config, tick_op, &tick);
+
+out:
+	executor_exit();
+	metrics_exit();
+	rule_set_free(&opts.set);
+	loop_exit();
+
+	return ret;
+}
+
+/* one rule per cause plugin.  %s is replaced by a scratch directory */
+static const char * const cause_configs[][2] = {
+	{"time_of_day",
+	 "{\"rules\": [{\"name\": \"bench\", \"causes\": [{\"name\": \"time_of_day\", "
+	 "\"args\": {\"time\": \"23:59:59\", \"operator\": \"greaterthan\"}}], "
+	 "\"effects\": [{\"name\": \"validate\", \"args\": {\"return_value\": \"1\"}}]}]}"},
+	{"days_of_the_week",
+	 "{\"rules\": [{\"name\": \"bench\", \"causes\": [{\"name\": \"days_of_the_week\", "
+	 "\"args\": {\"days\": [{\"day\": \"monday\"}, {\"day\": \"friday\"}]}}], "
+	 "\"effects\": [{\"name\": \"validate\", \"args\": {\"return_value\": \"1\"}}]}]}"},
+	{"meminfo",
+	 "{\"rules\": [{\"name\": \"bench\", \"causes\": [{\"name\": \"meminfo\", "
+	 "\"args\": {\"field\": \"MemAvailable\", \"operator\": \"lessthan\", \"value\": \"1\"}}], "
+	 "\"effects\": [{\"name\": \"validate\", \"args\": {\"return_value\": \"1\"}}]}]}"},
+	{"psi",
+	 "{\"rules\": [{\"name\": \"bench\", \"causes\": [{\"name\": \"psi\", "
+	 "\"args\": {\"resource\": \"memory\", \"type\": \"some\", \"stall\": \"150ms\", "
+	 "\"window\": \"1s\"}}], "
+	 "\"effects\": [{\"name\": \"validate\", \"args\": {\"return_value\": \"1\"}}]}]}"},
+	{"cgroup_stat",
+	 "{\"rules\": [{\"name\": \"bench\", \"causes\": [{\"name\": \"cgroup_stat\", "
+	 "\"args\": {\"cgroup\": \"%s\", \"file\": \"memory.current\", "
+	 "\"operator\": \"greaterthan\", \"value\": \"1000000\"}}], "
+	 "\"effects\": [{\"name\": \"validate\", \"args\": {\"return_value\": \"1\"}}]}]}"},
+};
+
+struct cause_arg {
+	struct cause *cse;
+	uint64_t now;
+};
+
+static int cause_op(void *arg)
+{
+	struct cause_arg *c = arg;
+	struct cause_ctx ctx;
+	int ret;
+
+	c->now += 1000;
+	cause_ctx_init(&ctx, c->now);
+
+	ret = (*c->cse->fns->main)(c->cse, &ctx, 1000);
+
+	return ret < 0 ? ret : 0;
+}
+
+static int bench_causes(const char * const dir)
+{
+	char path[FILENAME_MAX];
+	struct belayd_opts opts;
+	struct cause_arg c;
+	FILE *f;
+	int ret, i;
+
+	/* cgroup_stat reads this instead of a real cgroup */
+	snprintf(path, sizeof(path), "%s/memory.current", dir);
+	f = fopen(path, "w");
+	if (!f)
+		return -errno;
+	fprintf(f, "4096\n");
+	fclose(f);
+
+	ret = loop_init();
+	if (ret)
+		return ret;
+
+	for (i = 0; i < ARRAY_SIZE(cause_configs); i++) {
+		snprintf(path, sizeof(path), "%s/%s.json", dir, cause_configs[i][0]);
+		f = fopen(path, "w");
+		if (!f) {
+			ret = -errno;
+			break;
+		}
+		fprintf(f, cause_configs[i][1], dir);
+		fclose(f);
+
+		bench_opts_init(&opts, path);
+
+		ret = parse_config(&opts);
+		if (ret) {
+			/* e.g. psi on a kernel without pressure stall information */
+			fprintf(stderr, "Skipping %s, which failed to initialize: %d\n",
+				cause_configs[i][0], ret);
+			rule_set_free(&opts.set);
+			unlink(path);
+			ret = 0;
+			continue;
+		}
+
+		c.cse = &opts.set.causes[0];
+		c.now = 1000;
+		ret = bench_run("cause", cause_configs[i][0], cause_op, &c);
+
+		rule_set_free(&opts.set);
+		unlink(path);
+		if (ret)
+			break;
+	}
+
+	snprintf(path, sizeof(path), "%s/memory.current", dir);
+	unlink(path);
+	loop_exit();
+
+	return ret;
+}
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "\nUsage: microbench [options] [CONFIG...]\n\n");
+	fprintf(fd, "Benchmarks parse_config() and one tick of each CONFIG, and the\n");
+	fprintf(fd, "main() of each cause.\n\n");
+	fprintf(fd, "Optional arguments:\n");
+	fprintf(fd, "  -b --bench=LIST       Comma-separated benchmarks to run "
+						 "(default: parse,tick,cause)\n");
+	fprintf(fd, "  -h --help             Show this help message\n");
+	fprintf(fd, "  -j --json             Print the results as JSON\n");
+	fprintf(fd, "  -t --time=MS          Minimum time per benchmark (default: %d)\n",
+		BENCH_DEFAULT_MIN_MS);
+	fprintf(fd, "  -w --workers=COUNT    Threads that evaluate causes in the tick "
+						 "benchmark (default: 1)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct option long_options[] = {
+		{"bench",	required_argument, NULL, 'b'},
+		{"help",	      no_argument, NULL, 'h'},
+		{"json",	      no_argument, NULL, 'j'},
+		{"time",	required_argument, NULL, 't'},
+		{"workers",	required_argument, NULL, 'w'},
+		{NULL, 0, NULL, 0}
+	};
+	const char *benches = "parse,tick,cause";
+	char dir[] = "/tmp/belayd-bench-XXXXXX";
+	int workers = 1;
+	int ret = 0, i;
+
+	while (1) {
+		int c;
+
+		c = getopt_long(argc, argv, "b:hjt:w:", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'b':
+			benches = optarg;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		case 'j':
+			bench.json = true;
+			break;
+		case 't':
+			bench.min_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			break;
+		default:
+			usage(stderr);
+			return 1;
+		}
+	}
+
+	for (i = optind; i < argc && !ret; i++) {
+		if (strstr(benches, "parse"))
+			ret = bench_parse(argv[i]);
+		if (!ret && strstr(benches, "tick"))
+			ret = bench_tick(argv[i], workers);
+	}
+
+	if (!ret && strstr(benches, "cause")) {
+		if (!mkdtemp(dir)) {
+			ret = -errno;
+		} else {
+			ret = bench_causes(dir);
+			rmdir(dir);
+		}
+	}
+
+	if (bench.json && bench.results)
+		printf("\n]\n");
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Benchmark belayd's startup time and memory for large configs
+#
+# For each rule count, a config is generated with gen-config.py, and
+# belayd is run with it until it has evaluated every rule once.  The
+# wall-clock and CPU time of the whole run, which is dominated by loading
+# the config, and the peak RSS are reported.  With --compile, the config
+# is compiled first, and belayd loads the compiled image instead.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import subprocess
+import argparse
+import json
+import time
+import sys
+import os
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_BELAYD = os.path.join(BENCH_DIR, '..', 'src', 'belayd')
+DEFAULT_RULES = '1000,10000,100000'
+
+# belayd exits with ETIME once max_loops has been reached
+EXPECTED_RET = 62
+
+
+def gen_config(args, rules):
+    path = os.path.join(args.dir, 'startup-{}r-{}c-{}e.json'.format(
+                        rules, args.causes, args.effects))
+
+    if not os.path.exists(path):
+        subprocess.run([sys.executable, os.path.join(BENCH_DIR, 'gen-config.py'),
+                        '-r', str(rules), '-c', str(args.causes),
+                        '-e', str(args.effects), '-o', path], check=True)
+
+    return path
+
+
+def run_once(args, config):
+    # every rule first runs one interval after startup, all in the first loop
+    cmd = [args.belayd, '-c', config, '-i', '1ms', '-m', '1', '-l', '3']
+
+    start = time.monotonic()
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.monotonic() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+
+    if proc.returncode != EXPECTED_RET:
+        raise RuntimeError('{} returned {}, expected {}'.format(
+                           ' '.join(cmd), proc.returncode, EXPECTED_RET))
+
+    return {
+        'wall_ms': wall * 1000,
+        'cpu_ms': (usage.ru_utime + usage.ru_stime) * 1000,
+        'max_rss_kb': usage.ru_maxrss,
+    }
+
+
+def compile_config(args, config):
+    image = config + '.img'
+
+    if args.compile:
+        subprocess.run([args.belayd, '-c', config, '-C', '-l', '3'],
+                       stdout=subprocess.DEVNULL, check=True)
+    elif os.path.exists(image):
+        # belayd would otherwise load the image left by an earlier run
+        os.remove(image)
+
+
+def bench(args, rules):
+    config = gen_config(args, rules)
+    compile_config(args, config)
+    runs = [run_once(args, config) for _ in range(args.iterations)]
+
+    # report the best run, which is the least disturbed by the rest of the system
+    return {
+        'rules': rules,
+        'causes': rules * args.causes,
+        'effects': rules * args.effects,
+        'config_mb': os.path.getsize(config) / (1024 * 1024),
+        'wall_ms': min(run['wall_ms'] for run in runs),
+        'cpu_ms': min(run['cpu_ms'] for run in runs),
+        'max_rss_kb': min(run['max_rss_kb'] for run in runs),
+    }
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Benchmark belayd startup')
+    parser.add_argument('-b', '--belayd', default=DEFAULT_BELAYD,
+                        help='belayd binary to benchmark')
+    parser.add_argument('-r', '--rules', default=DEFAULT_RULES,
+                        help='comma-separated rule counts')
+    parser.add_argument('-c', '--causes', type=int, default=2,
+                        help='causes per rule')
+    parser.add_argument('-e', '--effects', type=int, default=1,
+                        help='effects per rule')
+    parser.add_argument('-n', '--iterations', type=int, default=3,
+                        help='runs per rule count')
+    parser.add_argument('-d', '--dir', default='.',
+                        help='directory for the generated configs')
+    parser.add_argument('-C', '--compile', action='store_true',
+                        help='load the compiled image of each config')
+    parser.add_argument('-j', '--json', action='store_true',
+                        help='print the results as JSON')
+
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    results = [bench(args, int(rules)) for rules in args.rules.split(',')]
+
+    if args.json:
+        print(json.dumps(results, indent=4))
+        return
+
+    print('{:>8} {:>9} {:>10} {:>10} {:>10} {:>12}'.format(
+          'rules', 'causes', 'config MB', 'wall ms', 'cpu ms', 'max RSS kB'))
+    for res in results:
+        print('{:>8} {:>9} {:>10.1f} {:>10.1f} {:>10.1f} {:>12}'.format(
+              res['rules'], res['causes'], res['config_mb'], res['wall_ms'],
+              res['cpu_ms'], res['max_rss_kb']))
+
+
+if __name__ == '__main__':
+    main()
+
+# vim: set et ts=4 sw=4:
@@ -0,0 +1,129 @@
+// LICENSE TBD
+/**
+ * belayd arena allocator
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN		alignof(max_align_t)
+#define ARENA_ROUND(size)	(((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;		/* bytes of data[] */
+	size_t used;
+	alignas(max_align_t) char data[];
+};
+
+static struct arena_block *arena_block_new(size_t size)
+{
+	struct arena_block *block;
+
+	/* calloc() so that every allocation starts out zeroed */
+	block = calloc(1, sizeof(struct arena_block) + size);
+	if (!block)
+		return NULL;
+
+	block->size = size;
+
+	return block;
+}
+
+void *arena_alloc(struct arena * const arena, size_t size)
+{
+	size_t block_size = arena->block_size ? arena->block_size : ARENA_BLOCK_SIZE;
+	struct arena_block *block = arena->blocks;
+
+	size = ARENA_ROUND(size ? size : 1);
+
+	if (size > block_size / 4) {
+		/*
+		 * keep filling the current block, and link the large
+		 * allocation in behind it
+		 */
+		block = arena_block_new(size);
+		if (!block)
+			return NULL;
+
+		if (arena->blocks) {
+			block->next = arena->blocks->next;
+			arena->blocks->next = block;
+		} else {
+			arena->blocks = block;
+		}
+	} else if (!block || block->used + size > block->size) {
+		block = arena_block_new(block_size);
+		if (!block)
+			return NULL;
+
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+
+	block->used += size;
+	arena->size += size;
+
+	return block->data + block->used - size;
+}
+
+char *arena_strdup(struct arena * const arena, const char * const str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy;
+
+	copy = arena_alloc(arena, len);
+	if (copy)
+		memcpy(copy, str, len);
+
+	return copy;
+}
+
+void arena_free(struct arena * const arena)
+{
+	struct arena_block *block, *next;
+
+	for (block = arena->blocks; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+
+	arena->blocks = NULL;
+	arena->size = 0;
+}
+
+struct arena *arena_new(size_t block_size)
+{
+	struct arena *arena;
+
+	arena = calloc(1, sizeof(struct arena));
+	if (!arena)
+		return NULL;
+
+	arena->block_size = block_size;
+	arena->refcnt = 1;
+
+	return arena;
+}
+
+struct arena *arena_get(struct arena * const arena)
+{
+	arena->refcnt++;
+
+	return arena;
+}
+
+void arena_put(struct arena * const arena)
+{
+	if (--arena->refcnt)
+		return;
+
+	arena_free(arena);
+	free(arena);
+}
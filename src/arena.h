@@ -0,0 +1,53 @@
+// LICENSE TBD
+/**
+ * belayd arena allocator header file
+ *
+ * An arena hands out memory for objects that live exactly as long as the
+ * configuration, i.e. the rule set and the private data of every cause
+ * and effect.  Allocating is a bump of a pointer within a large block,
+ * nothing is freed individually, and the whole arena is released with one
+ * call to arena_free().
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#ifndef __BELAYD_ARENA_H
+#define __BELAYD_ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE	(64 * 1024)
+
+struct arena_block;
+
+struct arena {
+	/* the block at the head of the list is the one being filled */
+	struct arena_block *blocks;
+	size_t block_size;	/* 0 means ARENA_BLOCK_SIZE */
+	size_t size;		/* bytes handed out */
+
+	/* only used by arenas from arena_new() */
+	unsigned int refcnt;
+};
+
+/*
+ * Returns zeroed memory that is suitably aligned for any type, or NULL if
+ * the system is out of memory.  Requests larger than a quarter of a block
+ * get a block of their own.
+ */
+void *arena_alloc(struct arena * const arena, size_t size);
+char *arena_strdup(struct arena * const arena, const char * const str);
+
+/* release every allocation.  The arena may then be reused */
+void arena_free(struct arena * const arena);
+
+/*
+ * A reference counted arena, for memory that may outlive the object that
+ * allocated it.  The arena and everything in it is freed by the last put.
+ */
+struct arena *arena_new(size_t block_size);
+struct arena *arena_get(struct arena * const arena);
+void arena_put(struct arena * const arena);
+
+#endif /* __BELAYD_ARENA_H */
@@ -9,11 +9,18 @@
 #ifndef __BELAYD_INTERNAL_H
 #define __BELAYD_INTERNAL_H
 
+#include <sys/types.h>
+#include <stdbool.h>
 #include <syslog.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#include "arena.h"
 #include "cause.h"
+#include "clock.h"
 #include "effect.h"
+#include "metrics.h"
+#include "wheel.h"
 
 enum log_location {
 	LOG_LOC_SYSLOG = 0,
@@ -23,24 +30,184 @@ enum log_location {
 	LOG_LOC_CNT
 };
 
+/*
+ * A rule's "when" expression, compiled by parse.c into a preorder array of
+ * AND and OR nodes.  The operands of a node that are causes are a bitmask
+ * over the rule's causes, so they are resolved a word at a time, and its
+ * other operands are the child nodes that follow it.  See eval_when() in
+ * loop.c.
+ */
+enum when_op_enum {
+	WHEN_AND = 0,
+	WHEN_OR,
+
+	WHEN_OP_CNT
+};
+
+struct when_node {
+	uint8_t op;
+	uint8_t negate;		/* the node's result is inverted */
+	uint16_t child_cnt;
+	uint32_t size;		/* the nodes in its subtree, including itself */
+};
+
+struct when {
+	struct when_node *nodes;
+	int node_cnt;
+
+	/*
+	 * word_cnt words per bitmask.  Node i's causes are at
+	 * masks[2 * i * word_cnt], followed by those of them that are negated.
+	 */
+	uint64_t *masks;
+	int word_cnt;
+
+	/* the causes that have been evaluated during this run of the rule, and which tripped */
+	uint64_t *known;
+	uint64_t *bits;
+};
+
+/*
+ * The fields that are touched every time a rule runs come first, so that
+ * they share as few cache lines as possible.  The rest is only used while
+ * parsing, logging and cleaning up.
+ */
 struct rule {
+	/* evaluation schedule, populated by belayd */
+	struct wheel_timer timer;
+	int interval;		/* milliseconds */
+
+	/*
+	 * causes in the order they are evaluated.  Unless reorder is false,
+	 * belayd periodically sorts them so that the cheapest and most
+	 * selective causes run first.
+	 */
+	struct cause *eval_causes;
+	bool reorder;
+	unsigned int runs;
+
+	/* evaluated instead of the AND of the causes, if not NULL */
+	struct when *when;
+
+	/*
+	 * the tick in which an effect was first deferred because the
+	 * executor's queue was full, or 0
+	 */
+	uint64_t deferred;
+
+	/* when the causes tripped, or 0 while they do not hold */
+	uint64_t tripped;
+
+	/* effect_cnt consecutive entries in the rule set's effects[] */
+	struct effect *effects;
+	int effect_cnt;
+
+	/* cause_cnt consecutive entries in the rule set's causes[], in config order */
+	struct cause *causes;
+	int cause_cnt;
+
 	char *name;
+	int config_interval;	/* milliseconds, or 0 if the config has none */
+	struct metrics *metrics;	/* NULL unless metrics are enabled */
+
+	/*
+	 * key is the canonical form of the rule's config.  During a reload, an
+	 * identical rule in the new config takes over this rule's schedule.
+	 * origin is then set in the new rule, and moved in this one.
+	 */
+	char *key;
+	struct rule *origin;
+	bool moved;
+};
+
+/*
+ * The compiled rule set.  Every rule, cause and effect lives in one of three
+ * contiguous arrays, in config order, so evaluating the rules walks memory
+ * linearly rather than chasing a malloc'd node per object.  The arrays and
+ * the names are allocated from arena, and the private data of the plugins
+ * from data, which stays alive for as long as a later config still uses
+ * any of it.
+ */
+struct rule_set {
+	struct rule *rules;
+	int rule_cnt;
+
 	struct cause *causes;
+	int cause_cnt;
+
 	struct effect *effects;
+	int effect_cnt;
+
+	struct arena arena;
+	struct arena *data;
+
+	/* the metrics of the rules, causes and effects, see metrics.c */
+	struct metrics *metrics;
+};
+
+/*
+ * A config file that is being read one rule at a time, see stream.c.  The
+ * counts are known once stream_open() returns.
+ */
+struct config_stream {
+	const char *path;
+	const char *map;
+	size_t size;
+	size_t released;	/* the pages before this offset have been dropped */
+	bool copied;		/* map is a buffer that the file was read into */
+
+	int rule_cnt;
+	int cause_cnt;
+	int effect_cnt;
+
+	/* the next rule to parse */
+	const char *pos;
+	int rule_idx;
+	struct json_tokener *tok;
+
+	/* every rule, if they were parsed by stream_read_all() */
+	struct json_object **rules;
 
-	struct rule *next;
+	/* why the layout of the file was rejected, if known */
+	const char *err;
 };
 
 struct belayd_opts {
 	/* options passed in on the command line */
 	char config[FILENAME_MAX];
-	int interval;
+	char image[FILENAME_MAX];	/* the compiled config, see image.c */
+	bool compile;
+	int interval;		/* milliseconds */
 	int max_loops;
+	int workers;		/* threads that evaluate causes, 0 for one per CPU */
+	int queue_depth;	/* effects that may wait for the executor */
+	char metrics_socket[FILENAME_MAX];	/* see metrics.c */
+	char metrics_file[FILENAME_MAX];
+	char replay[FILENAME_MAX];	/* recorded samples, see replay.c */
 
 	/* internal settings and structures */
-	struct rule *rules;
+	struct rule_set set;
 };
 
+/*
+ * executor.c functions
+ */
+
+int executor_init(int depth);
+int executor_submit(struct effect * const eff, const struct rule * const rule, uint64_t now,
+		    void * const snap);
+void executor_watchdog(uint64_t now);
+void executor_switch(struct rule_set * const set);
+void executor_retire(struct rule_set * const set);
+void executor_exit(void);
+
+/*
+ * image.c functions
+ */
+
+int image_write(const struct belayd_opts * const opts);
+int image_load(const struct belayd_opts * const opts, struct rule_set * const set);
+
 /*
  * log.c functions
  */
@@ -49,6 +216,8 @@ extern int log_level;
 extern enum log_location log_loc;
 
 void belayd_log(int priority, const char *fmt, ...);
+int log_init(void);
+void log_exit(void);
 
 #define belayd_err(msg...) \
 	if (log_level >= LOG_ERR) \
@@ -66,12 +235,96 @@ void belayd_log(int priority, const char *fmt, ...);
 	if (log_level >= LOG_DEBUG) \
 		belayd_log(LOG_DEBUG, "Debug: " msg)
 
+/*
+ * metrics.c functions
+ */
+
+int metrics_init(struct belayd_opts * const opts);
+void metrics_attach(struct rule_set * const set);
+void metrics_adopt(struct rule * const rule, const struct rule * const origin);
+void metrics_exit(void);
+
 /*
  * parse.c functions
  */
 
 int parse_string(struct json_object * const obj, const char * const key, const char **value);
 int parse_int(struct json_object * const obj, const char * const key, int * const value);
+int parse_bool(struct json_object * const obj, const char * const key, bool * const value,
+	       bool default_value);
+int parse_duration_str(const char * const str, int * const ms);
+int parse_config_stream(struct belayd_opts * const opts, struct config_stream * const s,
+			struct rule_set * const set, struct rule_set * const old);
 int parse_config(struct belayd_opts * const opts);
+int rule_set_alloc(struct rule_set * const set, int rule_cnt, int cause_cnt, int effect_cnt);
+int rule_when_alloc(struct rule_set * const set, struct rule * const rule,
+		    const struct when_node * const nodes, int node_cnt,
+		    const uint64_t * const masks);
+void rule_schedule(const struct belayd_opts * const opts, struct rule * const rule);
+void rule_set_free(struct rule_set * const set);
+
+/*
+ * loop.c functions
+ */
+
+/*
+ * Event handlers are invoked from the main loop when their fd is ready.
+ * Return 0 to continue, a negative value to exit belayd with an error, or a
+ * positive value to stop the main loop cleanly.
+ */
+typedef int (*event_fn)(int fd, uint32_t events, void *data);
+
+int belayd_event_add(int fd, uint32_t events, event_fn fn, void *data);
+int belayd_event_del(int fd);
+int belayd_cause_notify(const void * const data);
+
+int loop_init(void);
+int loop_start(struct belayd_opts * const opts, uint64_t now);
+int loop_tick(struct belayd_opts * const opts, uint64_t now);
+uint64_t loop_next(void);
+int loop_run(struct belayd_opts * const opts);
+int loop_switch(struct belayd_opts * const opts, struct rule_set * const set);
+void loop_exit(void);
+
+/*
+ * pool.c functions
+ */
+
+/* run task idx of the current batch */
+typedef void (*pool_fn)(int idx, struct cause_ctx * const ctx, void *data);
+
+int pool_init(int thread_cnt);
+void pool_run(int task_cnt, pool_fn fn, void *data, struct cause_ctx * const ctx);
+void pool_exit(void);
+
+/*
+ * reload.c functions
+ */
+
+int reload_init(struct belayd_opts * const opts);
+int reload_request(void);
+void reload_exit(void);
+
+/*
+ * replay.c functions
+ */
+
+bool replay_enabled(void);
+ssize_t replay_read(const char * const path, char * const buf, size_t size);
+int replay_event_add(const char * const path, event_fn fn, void *data);
+void replay_event_del(const void * const data);
+void replay_effect(const struct rule * const rule, const struct effect * const eff);
+int replay_init(struct belayd_opts * const opts);
+int replay_run(struct belayd_opts * const opts);
+void replay_exit(void);
+
+/*
+ * stream.c functions
+ */
+
+int stream_open(const char * const path, struct config_stream * const s, bool copy);
+int stream_next(struct config_stream * const s, struct json_object ** const obj);
+int stream_read_all(struct config_stream * const s);
+void stream_close(struct config_stream * const s);
 
 #endif /* __BELAYD_INTERNAL_H */
@@ -11,21 +11,70 @@
  */
 
 #include <assert.h>
+#include <string.h>
+#include <time.h>
 
 #include "defines.h"
 #include "cause.h"
+#include "clock.h"
 
 const char * const cause_names[] = {
 	"time_of_day",
 	"days_of_the_week",
+	"psi",
+	"meminfo",
+	"cgroup_stat",
 };
 static_assert(ARRAY_SIZE(cause_names) == CAUSE_CNT,
 	      "cause_names[] must be same length as CAUSE_CNT");
 
 const struct cause_functions cause_fns[] = {
-	{time_of_day_init, time_of_day_main, time_of_day_exit, time_of_day_print},
-	{days_of_the_week_init, days_of_the_week_main, days_of_the_week_exit,
-		days_of_the_week_print},
+	{time_of_day_init, time_of_day_main, NULL, time_of_day_print,
+		time_of_day_horizon, time_of_day_pack, time_of_day_unpack},
+	{days_of_the_week_init, days_of_the_week_main, NULL,
+		days_of_the_week_print, days_of_the_week_horizon,
+		days_of_the_week_pack, days_of_the_week_unpack},
+	{psi_init, psi_main, psi_exit, psi_print, psi_horizon, NULL, NULL},
+	{meminfo_init, meminfo_main, meminfo_exit, meminfo_print, NULL,
+		meminfo_pack, meminfo_unpack},
+	{cgroup_stat_init, cgroup_stat_main, cgroup_stat_exit, cgroup_stat_print, NULL,
+		NULL, NULL},
 };
 static_assert(ARRAY_SIZE(cause_fns) == CAUSE_CNT,
 	      "cause_fns[] must be same length as CAUSE_CNT");
+
+void cause_ctx_init(struct cause_ctx * const ctx, uint64_t now)
+{
+	static uint64_t seq;
+
+	memset(ctx, 0, sizeof(struct cause_ctx));
+	ctx->now = now;
+	ctx->seq = ++seq;
+
+	ctx->wall_ms = clock_wall_ms();
+	ctx->wall = ctx->wall_ms / 1000;
+}
+
+const struct tm *cause_ctx_localtime(struct cause_ctx * const ctx)
+{
+	if (!(ctx->valid & (1U << SAMPLE_LOCALTIME))) {
+		localtime_r(&ctx->wall, &ctx->local);
+		ctx->valid |= 1U << SAMPLE_LOCALTIME;
+	}
+
+	return &ctx->local;
+}
+
+/*
+ * Convert a wall-clock time into the CLOCK_MONOTONIC milliseconds at which it
+ * will occur, assuming that the wall clock is not stepped in the meantime
+ */
+uint64_t cause_ctx_wall_to_mono(const struct cause_ctx * const ctx, time_t wall)
+{
+	uint64_t wall_ms = (uint64_t)wall * 1000;
+
+	if (wall < 0 || wall_ms <= ctx->wall_ms)
+		return ctx->now;
+
+	return ctx->now + (wall_ms - ctx->wall_ms);
+}
@@ -14,52 +14,212 @@
 #define __BELAYD_CAUSE_H
 
 #include <json-c/json.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "defines.h"
+#include "arena.h"
+#include "image.h"
 
 enum cause_enum {
 	TIME_OF_DAY = 0,
 	DAYS_OF_THE_WEEK,
+	PSI,
+	MEMINFO,
+	CGROUP_STAT,
 
 	CAUSE_CNT
 };
 
 struct cause {
+	/*
+	 * evaluation schedule, populated by belayd.  Times are CLOCK_MONOTONIC
+	 * milliseconds.  The previous result is reused until next_run, which
+	 * is the later of the cause's interval and its horizon.  An interval
+	 * of 0 without a horizon evaluates the cause every time its rule runs.
+	 * These fields, fns and data are read on every evaluation, so they
+	 * are kept together at the start of the structure.
+	 */
+	uint64_t next_run;
+	uint64_t last_run;
+	int interval;
+	int result;
+	const struct cause_functions *fns;
+
+	/* private data store for each cause plugin */
+	void *data;
+
+	/*
+	 * set by init() or unpack() if the cause aggregates its readings over
+	 * a window.  It is then evaluated whenever it is due, even if its rule
+	 * is already known not to trip, so that the window misses no reading.
+	 */
+	bool windowed;
+
+	/*
+	 * identical causes in different rules share one instance, populated
+	 * by belayd.  key is the canonical form of the cause's config.  A
+	 * duplicate points at the shared instance, which holds the private
+	 * data, the schedule and the result.  seq is the tick in which the
+	 * instance's main() last ran, so it runs at most once per tick.
+	 */
+	struct cause *shared;
+	uint64_t seq;
+
+	/*
+	 * evaluation order and statistics, populated by belayd.  A rule's
+	 * causes are evaluated in eval_next order, which may differ from the
+	 * config order in next.  cost and false_rate are moving averages.
+	 */
+	struct cause *eval_next;
+	uint64_t evals;
+	double cost;		/* nanoseconds per main() */
+	double false_rate;	/* fraction of main() calls that did not trip */
+	struct metrics *metrics;	/* NULL unless metrics are enabled */
+
 	/* populated by belayd */
 	enum cause_enum idx;
 	char *name;
-	const struct cause_functions *fns;
+	char *key;
 	struct cause *next;
 
-	/* private data store for each cause plugin */
-	void *data;
+	/*
+	 * ownership of data, populated by belayd.  data was allocated from
+	 * home, which belongs to the config that first created the cause.
+	 * When a reload finds the same cause in the new config, the new
+	 * cause takes over data from its origin in the old config, and the
+	 * origin is marked as moved so that it is not exited.
+	 */
+	struct arena *home;
+	struct cause *origin;
+	bool moved;
 };
 
-typedef int (*cause_init)(struct cause * const cse, struct json_object *cse_obj);
-typedef int (*cause_main)(struct cause * const cse, int time_since_last_run);
+/*
+ * Samples that are read at most once per tick and shared by every cause
+ * that needs them.  Each sample has a bit in cause_ctx.valid that is set
+ * once it has been read during the current tick.  Each thread of the
+ * worker pool has its own copy of the ctx, so these samples must be cheap
+ * to take again.  Sources that are expensive to read, or that have too
+ * many instances for a bit each, e.g. /proc/meminfo and cgroup files,
+ * keep the cause_ctx.seq of the tick in which they were last read instead,
+ * and take their sample under a lock.
+ */
+enum sample_enum {
+	SAMPLE_LOCALTIME = 0,
+
+	SAMPLE_CNT
+};
+
+/*
+ * A snapshot of the system that is passed to every cause evaluated during
+ * one tick, so that all of them see a consistent view of the world
+ */
+struct cause_ctx {
+	uint64_t now;		/* CLOCK_MONOTONIC milliseconds */
+	time_t wall;		/* wall-clock time when the tick started */
+	uint64_t wall_ms;	/* same as wall, in milliseconds */
+	uint64_t seq;		/* unique, increasing number of this tick */
+
+	/* lazily read samples.  use the accessors below */
+	uint32_t valid;
+	struct tm local;
+};
+
+void cause_ctx_init(struct cause_ctx * const ctx, uint64_t now);
+const struct tm *cause_ctx_localtime(struct cause_ctx * const ctx);
+uint64_t cause_ctx_wall_to_mono(const struct cause_ctx * const ctx, time_t wall);
+
+/*
+ * The cause's private data should be allocated from arena, which is freed
+ * along with the configuration.  exit() is then only needed to release
+ * other resources, e.g. file descriptors.
+ */
+typedef int (*cause_init)(struct cause * const cse, struct json_object *cse_obj,
+			  struct arena * const arena);
+/* time_since_last_run is in milliseconds */
+typedef int (*cause_main)(struct cause * const cse, struct cause_ctx * const ctx,
+			  int time_since_last_run);
 typedef void (*cause_exit)(struct cause * const cse);
 typedef void (*cause_print)(const struct cause * const cse, FILE *file);
+/*
+ * Return the CLOCK_MONOTONIC time in milliseconds before which cse->result
+ * cannot change, or 0 if that is not known.  Invoked after a successful
+ * main(), so that belayd can skip evaluations until the result may flip.
+ * Event-driven causes return CAUSE_HORIZON_NEVER and wake belayd with
+ * belayd_cause_notify() instead.
+ */
+#define CAUSE_HORIZON_NEVER	UINT64_MAX
+
+typedef uint64_t (*cause_horizon)(const struct cause * const cse, struct cause_ctx * const ctx);
+/*
+ * Append the cause's parsed arguments to a compiled rule image.  When the
+ * image is loaded, unpack() is invoked with them in place of init().
+ */
+typedef int (*cause_pack)(const struct cause * const cse, struct image_buf * const ib);
+typedef int (*cause_unpack)(struct cause * const cse, const void * const data, size_t len,
+			    struct arena * const arena);
 
 struct cause_functions {
 	cause_init init;
 	cause_main main;
-	cause_exit exit;
+	cause_exit exit;	/* implementing the exit() function is optional */
 	cause_print print;	/* implementing the print() function is optional */
+	cause_horizon horizon;	/* implementing the horizon() function is optional */
+	cause_pack pack;	/* implementing pack() and unpack() is optional */
+	cause_unpack unpack;
 };
 
 extern const char * const cause_names[];
 extern const struct cause_functions cause_fns[];
 
 
-int time_of_day_init(struct cause * const cse, struct json_object *cse_obj);
-int time_of_day_main(struct cause * const cse, int time_since_last_run);
-void time_of_day_exit(struct cause * const cse);
+int time_of_day_init(struct cause * const cse, struct json_object *cse_obj,
+		     struct arena * const arena);
+int time_of_day_main(struct cause * const cse, struct cause_ctx * const ctx,
+		     int time_since_last_run);
 void time_of_day_print(const struct cause * const cse, FILE *file);
+uint64_t time_of_day_horizon(const struct cause * const cse, struct cause_ctx * const ctx);
+int time_of_day_pack(const struct cause * const cse, struct image_buf * const ib);
+int time_of_day_unpack(struct cause * const cse, const void * const data, size_t len,
+		       struct arena * const arena);
 
-int days_of_the_week_init(struct cause * const cse, struct json_object *cse_obj);
-int days_of_the_week_main(struct cause * const cse, int time_since_last_run);
-void days_of_the_week_exit(struct cause * const cse);
+int days_of_the_week_init(struct cause * const cse, struct json_object *cse_obj,
+			  struct arena * const arena);
+int days_of_the_week_main(struct cause * const cse, struct cause_ctx * const ctx,
+			  int time_since_last_run);
 void days_of_the_week_print(const struct cause * const cse, FILE *file);
+uint64_t days_of_the_week_horizon(const struct cause * const cse,
+				  struct cause_ctx * const ctx);
+int days_of_the_week_pack(const struct cause * const cse, struct image_buf * const ib);
+int days_of_the_week_unpack(struct cause * const cse, const void * const data, size_t len,
+			    struct arena * const arena);
+
+int psi_init(struct cause * const cse, struct json_object *cse_obj,
+	     struct arena * const arena);
+int psi_main(struct cause * const cse, struct cause_ctx * const ctx,
+	     int time_since_last_run);
+void psi_exit(struct cause * const cse);
+void psi_print(const struct cause * const cse, FILE *file);
+uint64_t psi_horizon(const struct cause * const cse, struct cause_ctx * const ctx);
+
+int meminfo_init(struct cause * const cse, struct json_object *cse_obj,
+		 struct arena * const arena);
+int meminfo_main(struct cause * const cse, struct cause_ctx * const ctx,
+		 int time_since_last_run);
+void meminfo_exit(struct cause * const cse);
+void meminfo_print(const struct cause * const cse, FILE *file);
+int meminfo_pack(const struct cause * const cse, struct image_buf * const ib);
+int meminfo_unpack(struct cause * const cse, const void * const data, size_t len,
+		   struct arena * const arena);
+
+int cgroup_stat_init(struct cause * const cse, struct json_object *cse_obj,
+		     struct arena * const arena);
+int cgroup_stat_main(struct cause * const cse, struct cause_ctx * const ctx,
+		     int time_since_last_run);
+void cgroup_stat_exit(struct cause * const cse);
+void cgroup_stat_print(const struct cause * const cse, FILE *file);
 
 #endif /* __BELAYD_CAUSE_H */
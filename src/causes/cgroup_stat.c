@@ -0,0 +1,684 @@
+// LICENSE TBD
+/**
+ * cgroup statistics cause
+ *
+ * This file processes cgroup v2 statistics causes, e.g. the "anon" key of
+ * memory.stat greater than 1G, or the rate of the "usage_usec" key of
+ * cpu.stat greater than 500000 per second.  The supported files are
+ * memory.current, memory.stat, cpu.stat and io.stat.  The keys of io.stat
+ * (rbytes, wios, etc.) are summed across all devices, and are 0 if no
+ * device lists them.  The value or rate may be aggregated over a sliding
+ * window, see window.h.
+ *
+ * Each cgroup directory is opened once with O_PATH and shared by every
+ * cause that references it, and each statistics file is opened once
+ * relative to it.  A file is read at most once per tick with pread(), and
+ * only the keys that some cause references are parsed out of it.  Causes
+ * on other threads of the worker pool wait for the read of a cgroup's
+ * file under the cgroup's lock, while other cgroups are read in parallel.
+ * Once a cgroup is removed, its files are no longer read, and its causes
+ * no longer trip.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "belayd-internal.h"
+#include "defines.h"
+#include "window.h"
+
+#define CGROUP_MOUNT_POINT	"/sys/fs/cgroup/"
+#define CG_BUF_SIZE		16384
+#define CG_KEY_LEN		32
+
+enum op_enum {
+	OP_GREATER_THAN = 0,
+	OP_LESS_THAN,
+
+	OP_CNT
+};
+
+static const char * const op_names[] = {
+	"greaterthan",
+	"lessthan",
+};
+static_assert(ARRAY_SIZE(op_names) == OP_CNT,
+	      "op_names[] must be same length as OP_CNT");
+
+enum cg_file_enum {
+	CG_MEMORY_CURRENT = 0,
+	CG_MEMORY_STAT,
+	CG_CPU_STAT,
+	CG_IO_STAT,
+
+	CG_FILE_CNT
+};
+
+static const char * const cg_file_names[] = {
+	"memory.current",
+	"memory.stat",
+	"cpu.stat",
+	"io.stat",
+};
+static_assert(ARRAY_SIZE(cg_file_names) == CG_FILE_CNT,
+	      "cg_file_names[] must be same length as CG_FILE_CNT");
+
+struct cg_key {
+	char name[CG_KEY_LEN];
+	int len;
+	int refcnt;
+
+	/* populated each time the file is read */
+	bool found;
+	unsigned long long value;
+};
+
+struct cg_file {
+	int fd;
+	int refcnt;
+	uint64_t seq;		/* the tick in which the file was last read */
+
+	int key_cnt;
+	struct cg_key *keys;
+};
+
+struct cg_dir {
+	char *path;
+	int dirfd;
+	int refcnt;
+
+	/* the cgroup was removed, so its files are no longer read */
+	bool removed;
+
+	/* serializes the samples of the files */
+	pthread_mutex_t lock;
+	struct cg_file files[CG_FILE_CNT];
+	struct cg_dir *next;
+};
+
+/* every cgroup directory that is referenced by a cause */
+static struct cg_dir *cg_dirs;
+
+/* files are scanned as soon as they are read, so one buffer per thread suffices */
+static __thread char cg_buf[CG_BUF_SIZE];
+
+struct cgroup_stat_opts {
+	struct cg_dir *dir;
+	enum cg_file_enum file;
+	int key;		/* index into dir->files[file].keys[] */
+
+	enum op_enum op;
+	unsigned long long value;
+
+	/* compare the per-second rate of a counter rather than its value */
+	bool rate;
+	bool have_prev;
+	unsigned long long prev;
+
+	/* aggregate the values or rates over a sliding window, or NULL */
+	struct window *win;
+
+	/* the most recently compared value, rate or aggregate */
+	unsigned long long cur;
+};
+
+static int cg_dir_get(const char * const path, struct cg_dir ** const dirp)
+{
+	struct cg_dir *dir;
+	int ret = 0;
+	int i;
+
+	for (dir = cg_dirs; dir; dir = dir->next) {
+		if (strcmp(dir->path, path) == 0) {
+			dir->refcnt++;
+			*dirp = dir;
+			return 0;
+		}
+	}
+
+	dir = malloc(sizeof(struct cg_dir));
+	if (!dir)
+		return -ENOMEM;
+
+	memset(dir, 0, sizeof(struct cg_dir));
+	for (i = 0; i < CG_FILE_CNT; i++)
+		dir->files[i].fd = -1;
+
+	dir->path = malloc(strlen(path) + 1);
+	if (!dir->path) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	strcpy(dir->path, path);
+
+	/* the replayed samples stand in for the files */
+	dir->dirfd = -1;
+	if (!replay_enabled()) {
+		dir->dirfd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (dir->dirfd < 0) {
+			ret = -errno;
+			belayd_err("Failed to open cgroup %s: %d\n", path, -ret);
+			goto error;
+		}
+	}
+
+	pthread_mutex_init(&dir->lock, NULL);
+	dir->refcnt = 1;
+	dir->next = cg_dirs;
+	cg_dirs = dir;
+
+	*dirp = dir;
+
+	return 0;
+
+error:
+	if (dir->path)
+		free(dir->path);
+
+	free(dir);
+
+	return ret;
+}
+
+static void cg_dir_put(struct cg_dir * const dir)
+{
+	struct cg_dir **prev;
+
+	if (--dir->refcnt)
+		return;
+
+	for (prev = &cg_dirs; *prev; prev = &(*prev)->next) {
+		if (*prev == dir) {
+			*prev = dir->next;
+			break;
+		}
+	}
+
+	pthread_mutex_destroy(&dir->lock);
+	if (dir->dirfd >= 0)
+		close(dir->dirfd);
+	free(dir->path);
+	free(dir);
+}
+
+static int cg_file_get(struct cg_dir * const dir, enum cg_file_enum file)
+{
+	struct cg_file *cgf = &dir->files[file];
+
+	if (cgf->fd < 0 && dir->dirfd >= 0) {
+		cgf->fd = openat(dir->dirfd, cg_file_names[file], O_RDONLY | O_CLOEXEC);
+		if (cgf->fd < 0) {
+			belayd_err("Failed to open %s/%s: %d\n", dir->path, cg_file_names[file],
+				   errno);
+			return -errno;
+		}
+	}
+
+	cgf->refcnt++;
+
+	return 0;
+}
+
+static void cg_file_put(struct cg_dir * const dir, enum cg_file_enum file)
+{
+	struct cg_file *cgf = &dir->files[file];
+
+	if (--cgf->refcnt)
+		return;
+
+	if (cgf->fd >= 0)
+		close(cgf->fd);
+	cgf->fd = -1;
+
+	free(cgf->keys);
+	cgf->keys = NULL;
+	cgf->key_cnt = 0;
+}
+
+/*
+ * memory.current has a single unnamed value, which is stored under the
+ * empty key
+ */
+static int cg_key_get(struct cg_file * const cgf, const char * const name)
+{
+	struct cg_key *keys;
+	int i, len;
+
+	len = strlen(name);
+	if (len >= CG_KEY_LEN)
+		return -EINVAL;
+
+	for (i = 0; i < cgf->key_cnt; i++) {
+		if (cgf->keys[i].len == len && memcmp(cgf->keys[i].name, name, len) == 0) {
+			cgf->keys[i].refcnt++;
+			return i;
+		}
+	}
+
+	keys = realloc(cgf->keys, sizeof(struct cg_key) * (cgf->key_cnt + 1));
+	if (!keys)
+		return -ENOMEM;
+
+	cgf->keys = keys;
+	i = cgf->key_cnt++;
+
+	memset(&cgf->keys[i], 0, sizeof(struct cg_key));
+	memcpy(cgf->keys[i].name, name, len + 1);
+	cgf->keys[i].len = len;
+	cgf->keys[i].refcnt = 1;
+
+	return i;
+}
+
+static struct cg_key *cg_key_find(struct cg_file * const cgf, const char * const name, int len)
+{
+	int i;
+
+	for (i = 0; i < cgf->key_cnt; i++) {
+		if (cgf->keys[i].refcnt && cgf->keys[i].len == len &&
+		    memcmp(cgf->keys[i].name, name, len) == 0)
+			return &cgf->keys[i];
+	}
+
+	return NULL;
+}
+
+static const char *parse_ull(const char *buf, const char * const end,
+			     unsigned long long * const value)
+{
+	*value = 0;
+
+	while (buf < end && *buf >= '0' && *buf <= '9') {
+		*value = *value * 10 + (*buf - '0');
+		buf++;
+	}
+
+	return buf;
+}
+
+/*
+ * Flat keyed files, e.g. memory.stat and cpu.stat, have one "key value"
+ * pair per line
+ */
+static void cg_scan_flat(struct cg_file * const cgf, const char *buf, const char * const end)
+{
+	unsigned long long value;
+	struct cg_key *key;
+	const char *name;
+
+	while (buf < end) {
+		name = buf;
+		while (buf < end && *buf != ' ' && *buf != '\n')
+			buf++;
+
+		key = NULL;
+		if (buf < end && *buf == ' ')
+			key = cg_key_find(cgf, name, buf - name);
+
+		if (key) {
+			parse_ull(buf + 1, end, &value);
+			key->value = value;
+			key->found = true;
+		}
+
+		while (buf < end && *buf != '\n')
+			buf++;
+		buf++;
+	}
+}
+
+/*
+ * Nested keyed files, i.e. io.stat, have one line per device, e.g.
+ * "8:0 rbytes=1459200 wbytes=314773504 rios=192 ...".  Each key is summed
+ * across all of the devices.
+ */
+static void cg_scan_nested(struct cg_file * const cgf, const char *buf, const char * const end)
+{
+	unsigned long long value;
+	struct cg_key *key;
+	const char *name;
+
+	while (buf < end) {
+		/* skip the device */
+		while (buf < end && *buf != ' ' && *buf != '\n')
+			buf++;
+
+		while (buf < end && *buf == ' ') {
+			name = ++buf;
+			while (buf < end && *buf != '=' && *buf != ' ' && *buf != '\n')
+				buf++;
+
+			if (buf == end || *buf != '=')
+				continue;
+
+			key = cg_key_find(cgf, name, buf - name);
+			buf = parse_ull(buf + 1, end, &value);
+
+			if (key) {
+				key->value += value;
+				key->found = true;
+			}
+		}
+
+		while (buf < end && *buf != '\n')
+			buf++;
+		buf++;
+	}
+}
+
+static int cg_file_sample(struct cg_dir * const dir, enum cg_file_enum file,
+			  const struct cause_ctx * const ctx)
+{
+	struct cg_file *cgf = &dir->files[file];
+	char path[FILENAME_MAX];
+	ssize_t bytes;
+	int ret = 0;
+	int i;
+
+	pthread_mutex_lock(&dir->lock);
+
+	if (cgf->seq == ctx->seq)
+		goto out;
+
+	if (dir->removed) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	if (replay_enabled()) {
+		snprintf(path, sizeof(path), "%s/%s", dir->path, cg_file_names[file]);
+		bytes = replay_read(path, cg_buf, sizeof(cg_buf));
+	} else {
+		bytes = pread(cgf->fd, cg_buf, sizeof(cg_buf), 0);
+	}
+	if (bytes < 0 && errno == ENODEV) {
+		belayd_wrn("cgroup %s was removed\n", dir->path);
+		dir->removed = true;
+		ret = -ENODEV;
+		goto out;
+	} else if (bytes < 0) {
+		belayd_err("Failed to read %s/%s: %d\n", dir->path, cg_file_names[file], errno);
+		ret = -errno;
+		goto out;
+	}
+
+	if (bytes == sizeof(cg_buf))
+		belayd_wrn("%s/%s was truncated to %zd bytes\n", dir->path,
+			   cg_file_names[file], bytes);
+
+	/*
+	 * a device leaves out the io.stat keys that it has no I/O for, and the
+	 * file is empty for a cgroup that did no I/O at all, so their sums
+	 * start out at 0
+	 */
+	for (i = 0; i < cgf->key_cnt; i++) {
+		cgf->keys[i].found = file == CG_IO_STAT;
+		cgf->keys[i].value = 0;
+	}
+
+	switch (file) {
+		case CG_MEMORY_CURRENT:
+			if (cgf->key_cnt) {
+				parse_ull(cg_buf, cg_buf + bytes, &cgf->keys[0].value);
+				cgf->keys[0].found = bytes > 0;
+			}
+			break;
+		case CG_IO_STAT:
+			cg_scan_nested(cgf, cg_buf, cg_buf + bytes);
+			break;
+		default:
+			cg_scan_flat(cgf, cg_buf, cg_buf + bytes);
+			break;
+	}
+
+	cgf->seq = ctx->seq;
+
+out:
+	pthread_mutex_unlock(&dir->lock);
+
+	return ret;
+}
+
+/*
+ * cgroup paths that begin with "/" or "." are used as is.  All others are
+ * relative to the cgroup v2 mount point.
+ */
+static int cgroup_stat_dir(struct cgroup_stat_opts * const opts, const char * const cgroup)
+{
+	char *path;
+	int ret;
+
+	if (cgroup[0] == '/' || cgroup[0] == '.')
+		return cg_dir_get(cgroup, &opts->dir);
+
+	path = malloc(strlen(CGROUP_MOUNT_POINT) + strlen(cgroup) + 1);
+	if (!path)
+		return -ENOMEM;
+
+	sprintf(path, "%s%s", CGROUP_MOUNT_POINT, cgroup);
+	ret = cg_dir_get(path, &opts->dir);
+	free(path);
+
+	return ret;
+}
+
+int cgroup_stat_init(struct cause * const cse, struct json_object *cse_obj,
+		     struct arena * const arena)
+{
+	const char *cgroup_str, *file_str, *key_str = "", *op_str, *value_str;
+	struct json_object *args_obj;
+	struct cgroup_stat_opts *opts;
+	bool found_op, found_file;
+	bool have_file = false;
+	json_bool exists;
+	int ret = 0;
+	char *end;
+	int i;
+
+	opts = arena_alloc(arena, sizeof(struct cgroup_stat_opts));
+	if (!opts)
+		return -ENOMEM;
+
+	opts->key = -1;
+
+	exists = json_object_object_get_ex(cse_obj, "args", &args_obj);
+	if (!exists || !args_obj) {
+		ret = -EINVAL;
+		goto error;
+	}
+
+	ret = parse_string(args_obj, "file", &file_str);
+	if (ret)
+		goto error;
+
+	found_file = false;
+	for (i = 0; i < CG_FILE_CNT; i++) {
+		if (strcmp(file_str, cg_file_names[i]) == 0) {
+			found_file = true;
+			opts->file = i;
+			break;
+		}
+	}
+
+	if (!found_file) {
+		belayd_err("Unsupported cgroup file: %s\n", file_str);
+		ret = -EINVAL;
+		goto error;
+	}
+
+	if (opts->file != CG_MEMORY_CURRENT) {
+		ret = parse_string(args_obj, "key", &key_str);
+		if (ret)
+			goto error;
+	}
+
+	ret = parse_string(args_obj, "operator", &op_str);
+	if (ret)
+		goto error;
+
+	found_op = false;
+	for (i = 0; i < OP_CNT; i++) {
+		if (strcmp(op_str, op_names[i]) == 0) {
+			found_op = true;
+			opts->op = i;
+			break;
+		}
+	}
+
+	if (!found_op) {
+		belayd_err("Invalid cgroup_stat operator: %s\n", op_str);
+		ret = -EINVAL;
+		goto error;
+	}
+
+	ret = parse_string(args_obj, "value", &value_str);
+	if (ret)
+		goto error;
+
+	errno = 0;
+	opts->value = strtoull(value_str, &end, 10);
+	if (errno || end == value_str || *end != '\0') {
+		belayd_err("Invalid cgroup_stat value: %s\n", value_str);
+		ret = -EINVAL;
+		goto error;
+	}
+
+	ret = parse_bool(args_obj, "rate", &opts->rate, false);
+	if (ret)
+		goto error;
+
+	ret = window_parse(args_obj, arena, &opts->win);
+	if (ret)
+		goto error;
+
+	ret = parse_string(args_obj, "cgroup", &cgroup_str);
+	if (ret)
+		goto error;
+
+	ret = cgroup_stat_dir(opts, cgroup_str);
+	if (ret)
+		goto error;
+
+	ret = cg_file_get(opts->dir, opts->file);
+	if (ret)
+		goto error;
+	have_file = true;
+
+	opts->key = cg_key_get(&opts->dir->files[opts->file], key_str);
+	if (opts->key < 0) {
+		belayd_err("Invalid cgroup_stat key: %s\n", key_str);
+		ret = opts->key;
+		goto error;
+	}
+
+	/* we have successfully setup the cgroup_stat cause */
+	cse->data = (void *)opts;
+	cse->windowed = opts->win != NULL;
+
+	return ret;
+
+error:
+	if (have_file)
+		cg_file_put(opts->dir, opts->file);
+
+	if (opts->dir)
+		cg_dir_put(opts->dir);
+
+	return ret;
+}
+
+int cgroup_stat_main(struct cause * const cse, struct cause_ctx * const ctx,
+		     int time_since_last_run)
+{
+	struct cgroup_stat_opts *opts = (struct cgroup_stat_opts *)cse->data;
+	struct cg_key *key;
+	int ret;
+
+	/* a removed cgroup never trips its causes */
+	ret = cg_file_sample(opts->dir, opts->file, ctx);
+	if (ret == -ENODEV)
+		return 0;
+	else if (ret)
+		return ret;
+
+	key = &opts->dir->files[opts->file].keys[opts->key];
+	if (!key->found) {
+		belayd_err("Failed to find %s in %s/%s\n", key->name, opts->dir->path,
+			   cg_file_names[opts->file]);
+		return -ENOENT;
+	}
+
+	if (opts->rate) {
+		if (!opts->have_prev || key->value < opts->prev || time_since_last_run <= 0) {
+			/* no baseline yet, or the counter was reset */
+			opts->have_prev = true;
+			opts->prev = key->value;
+			return 0;
+		}
+
+		opts->cur = (key->value - opts->prev) * 1000 / time_since_last_run;
+		opts->prev = key->value;
+	} else {
+		opts->cur = key->value;
+	}
+
+	if (opts->win && !window_add(opts->win, ctx->now, opts->cur, &opts->cur))
+		return 0;
+
+	switch (opts->op) {
+		case OP_GREATER_THAN:
+			if (opts->cur > opts->value) {
+				belayd_info("%s %s%s%s %llu > %llu\n", opts->dir->path, key->name,
+					    opts->win ? " " : "", opts->win ? opts->win->name : "",
+					    opts->cur, opts->value);
+				return 1;
+			}
+			break;
+		case OP_LESS_THAN:
+			if (opts->cur < opts->value) {
+				belayd_info("%s %s%s%s %llu < %llu\n", opts->dir->path, key->name,
+					    opts->win ? " " : "", opts->win ? opts->win->name : "",
+					    opts->cur, opts->value);
+				return 1;
+			}
+			break;
+		default:
+			belayd_err("Invalid cgroup_stat operation: %d\n", opts->op);
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+void cgroup_stat_exit(struct cause * const cse)
+{
+	struct cgroup_stat_opts *opts = (struct cgroup_stat_opts *)cse->data;
+
+	opts->dir->files[opts->file].keys[opts->key].refcnt--;
+	cg_file_put(opts->dir, opts->file);
+	cg_dir_put(opts->dir);
+}
+
+void cgroup_stat_print(const struct cause * const cse, FILE *file)
+{
+	struct cgroup_stat_opts *opts = (struct cgroup_stat_opts *)cse->data;
+	const struct cg_key *key = &opts->dir->files[opts->file].keys[opts->key];
+
+	fprintf(file, "\tcgroup_stat cause: %s/%s%s%s %s%s%s%llu is %s %llu\n", opts->dir->path,
+		cg_file_names[opts->file], key->len ? " " : "", key->name,
+		opts->rate ? "rate " : "", opts->win ? opts->win->name : "",
+		opts->win ? " " : "", opts->cur,
+		opts->op == OP_GREATER_THAN ? "greater than" : "less than", opts->value);
+}
@@ -30,6 +30,9 @@ struct days {
 
 struct days_of_the_week_opts {
 	struct days d;
+
+	/* the day of the week seen by the most recent main() */
+	int wday;
 };
 
 int consume_day(struct days_of_the_week_opts * const opts, const char * const day)
@@ -74,7 +77,8 @@ int consume_day(struct days_of_the_week_opts * const opts, const char * const da
 	return 0;
 }
 
-int days_of_the_week_init(struct cause * const cse, struct json_object *cse_obj)
+int days_of_the_week_init(struct cause * const cse, struct json_object *cse_obj,
+			  struct arena * const arena)
 {
 	struct json_object *args_obj, *days_obj, *day_obj;
 	struct days_of_the_week_opts *opts;
@@ -83,64 +87,48 @@ int days_of_the_week_init(struct cause * const cse, struct json_object *cse_obj)
 	int i, day_cnt;
 	int ret = 0;
 
-	opts = malloc(sizeof(struct days_of_the_week_opts));
-	if (!opts) {
-		ret = -ENOMEM;
-		goto error;
-	}
-
-	memset(opts, 0, sizeof(struct days_of_the_week_opts));
+	opts = arena_alloc(arena, sizeof(struct days_of_the_week_opts));
+	if (!opts)
+		return -ENOMEM;
 
 	exists = json_object_object_get_ex(cse_obj, "args", &args_obj);
-	if (!exists || !args_obj) {
-		ret = -EINVAL;
-		goto error;
-	}
+	if (!exists || !args_obj)
+		return -EINVAL;
 
 	exists = json_object_object_get_ex(args_obj, "days", &days_obj);
-	if (!exists || !days_obj) {
-		ret = -EINVAL;
-		goto error;
-	}
+	if (!exists || !days_obj)
+		return -EINVAL;
 
 	day_cnt = json_object_array_length(days_obj);
 
 	for (i = 0; i < day_cnt; i++) {
 		day_obj = json_object_array_get_idx(days_obj, i);
-		if (!day_obj) {
-			ret = -EINVAL;
-			goto error;
-		}
+		if (!day_obj)
+			return -EINVAL;
 
 		ret = parse_string(day_obj, "day", &day_str);
 		if (ret)
-			goto error;
+			return ret;
 
 		ret = consume_day(opts, day_str);
 		if (ret)
-			goto error;
+			return ret;
 	}
 
 	/* we have successfully setup the time_of_day cause */
 	cse->data = (void *)opts;
 
 	return ret;
-
-error:
-	if (opts)
-		free(opts);
-
-	return ret;
 }
 
-int days_of_the_week_main(struct cause * const cse, int time_since_last_run)
+int days_of_the_week_main(struct cause * const cse, struct cause_ctx * const ctx,
+			  int time_since_last_run)
 {
 	struct days_of_the_week_opts *opts = (struct days_of_the_week_opts *)cse->data;
-	struct tm *cur_tm;
-	time_t cur_time;
+	const struct tm *cur_tm;
 
-	time(&cur_time);
-	cur_tm = localtime(&cur_time);
+	cur_tm = cause_ctx_localtime(ctx);
+	opts->wday = cur_tm->tm_wday;
 
 	switch (cur_tm->tm_wday) {
 		case 0: /* Sunday */
@@ -193,23 +181,75 @@ int days_of_the_week_main(struct cause * const cse, int time_since_last_run)
 	return 0;
 }
 
-void days_of_the_week_exit(struct cause * const cse)
+void days_of_the_week_print(const struct cause * const cse, FILE *file)
 {
+	const char * const days[] = {"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday",
+		"Friday", "Saturday"};
 	struct days_of_the_week_opts *opts = (struct days_of_the_week_opts *)cse->data;
 
-	free(opts);
+	/* report the day that was evaluated rather than re-reading the clock */
+	fprintf(file, "\tDotW cause: current day, %s, matches the filter\n",
+		days[opts->wday]);
 }
 
-void days_of_the_week_print(const struct cause * const cse, FILE *file)
+/* the day of the week can only change at midnight */
+uint64_t days_of_the_week_horizon(const struct cause * const cse,
+				  struct cause_ctx * const ctx)
 {
-	const char * const days[] = {"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday",
-		"Friday", "Saturday"};
-	struct tm *cur_tm;
-	time_t cur_time;
+	struct tm next_tm;
+	time_t next;
 
-	time(&cur_time);
-	cur_tm = localtime(&cur_time);
+	memcpy(&next_tm, cause_ctx_localtime(ctx), sizeof(struct tm));
 
-	fprintf(file, "\tDotW cause: current day, %s, matches the filter\n",
-		days[cur_tm->tm_wday]);
+	next_tm.tm_mday++;
+	next_tm.tm_hour = 0;
+	next_tm.tm_min = 0;
+	next_tm.tm_sec = 0;
+	next_tm.tm_isdst = -1;
+
+	next = mktime(&next_tm);
+	if (next == (time_t)-1)
+		return 0;
+
+	return cause_ctx_wall_to_mono(ctx, next);
+}
+
+/* the days are stored in a compiled rule image as a bitmask, Sunday first */
+int days_of_the_week_pack(const struct cause * const cse, struct image_buf * const ib)
+{
+	struct days_of_the_week_opts *opts = (struct days_of_the_week_opts *)cse->data;
+	uint32_t mask;
+
+	mask = opts->d.sun | opts->d.mon << 1 | opts->d.tues << 2 | opts->d.wed << 3 |
+	       opts->d.thurs << 4 | opts->d.fri << 5 | opts->d.sat << 6;
+
+	return image_buf_append(ib, &mask, sizeof(mask));
+}
+
+int days_of_the_week_unpack(struct cause * const cse, const void * const data, size_t len,
+			    struct arena * const arena)
+{
+	struct days_of_the_week_opts *opts;
+	uint32_t mask;
+
+	if (len < sizeof(mask))
+		return -EINVAL;
+
+	memcpy(&mask, data, sizeof(mask));
+
+	opts = arena_alloc(arena, sizeof(struct days_of_the_week_opts));
+	if (!opts)
+		return -ENOMEM;
+
+	opts->d.sun = !!(mask & (1 << 0));
+	opts->d.mon = !!(mask & (1 << 1));
+	opts->d.tues = !!(mask & (1 << 2));
+	opts->d.wed = !!(mask & (1 << 3));
+	opts->d.thurs = !!(mask & (1 << 4));
+	opts->d.fri = !!(mask & (1 << 5));
+	opts->d.sat = !!(mask & (1 << 6));
+
+	cse->data = (void *)opts;
+
+	return 0;
 }
@@ -0,0 +1,474 @@
+// LICENSE TBD
+/**
+ * meminfo cause
+ *
+ * This file processes /proc/meminfo causes, e.g. MemAvailable less than
+ * 1048576 kB.  /proc/meminfo is kept open and is read at most once per
+ * tick, with pread() into a static buffer, no matter how many meminfo
+ * causes there are or how many threads evaluate them.  A single pass over
+ * the buffer then extracts only the fields that are referenced by a cause.
+ * Nothing is allocated and no stdio is used after init.  A cause may
+ * compare an aggregate of its readings over a sliding window rather than
+ * the latest one, see window.h.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "belayd-internal.h"
+#include "defines.h"
+#include "window.h"
+
+#define MEMINFO_FILE		"/proc/meminfo"
+#define MEMINFO_BUF_SIZE	8192
+#define MEMINFO_MAX_FIELDS	64
+#define MEMINFO_FIELD_LEN	32
+
+enum op_enum {
+	OP_GREATER_THAN = 0,
+	OP_LESS_THAN,
+
+	OP_CNT
+};
+
+static const char * const op_names[] = {
+	"greaterthan",
+	"lessthan",
+};
+static_assert(ARRAY_SIZE(op_names) == OP_CNT,
+	      "op_names[] must be same length as OP_CNT");
+
+struct meminfo_field {
+	char name[MEMINFO_FIELD_LEN];
+	int len;
+	int refcnt;
+
+	/* populated once per tick */
+	bool found;
+	unsigned long long value;
+};
+
+/* state shared by every meminfo cause */
+static struct {
+	int fd;
+	int refcnt;
+
+	int field_cnt;
+	struct meminfo_field fields[MEMINFO_MAX_FIELDS];
+
+	/* the sample is taken under lock by the first cause of each tick */
+	pthread_mutex_t lock;
+	uint64_t seq;
+	char buf[MEMINFO_BUF_SIZE];
+} meminfo = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+struct meminfo_opts {
+	int field;		/* index into meminfo.fields[] */
+	enum op_enum op;
+	unsigned long long value;
+
+	/* compare an aggregate of the readings rather than the latest one, or NULL */
+	struct window *win;
+	unsigned long long cur;
+};
+
+/* the cause has a window, which follows the field name */
+#define MEMINFO_IMAGE_WINDOW	0x1
+
+/* a meminfo cause in a compiled rule image, followed by the field name */
+struct meminfo_image {
+	uint32_t op;
+	uint32_t flags;
+	uint64_t value;
+};
+
+static int field_get(const char * const name)
+{
+	int i, len;
+
+	len = strlen(name);
+	if (len == 0 || len >= MEMINFO_FIELD_LEN)
+		return -EINVAL;
+
+	for (i = 0; i < meminfo.field_cnt; i++) {
+		if (meminfo.fields[i].len == len &&
+		    memcmp(meminfo.fields[i].name, name, len) == 0) {
+			meminfo.fields[i].refcnt++;
+			return i;
+		}
+	}
+
+	/* reuse a slot that was released by an earlier cause, if any */
+	for (i = 0; i < meminfo.field_cnt; i++) {
+		if (meminfo.fields[i].refcnt == 0)
+			break;
+	}
+
+	if (i == MEMINFO_MAX_FIELDS)
+		return -ENOSPC;
+	if (i == meminfo.field_cnt)
+		meminfo.field_cnt++;
+
+	memcpy(meminfo.fields[i].name, name, len + 1);
+	meminfo.fields[i].len = len;
+	meminfo.fields[i].refcnt = 1;
+
+	return i;
+}
+
+static void field_put(int field)
+{
+	meminfo.fields[field].refcnt--;
+}
+
+/* reference the field and open /proc/meminfo once the arguments are parsed */
+static int meminfo_setup(struct meminfo_opts * const opts, const char * const field_str)
+{
+	int ret;
+
+	opts->field = field_get(field_str);
+	if (opts->field < 0) {
+		belayd_err("Invalid meminfo field: %s\n", field_str);
+		ret = opts->field;
+		opts->field = -1;
+		return ret;
+	}
+
+	/* the replayed samples stand in for the file */
+	if (meminfo.fd < 0 && !replay_enabled()) {
+		meminfo.fd = open(MEMINFO_FILE, O_RDONLY | O_CLOEXEC);
+		if (meminfo.fd < 0) {
+			ret = -errno;
+			belayd_err("Failed to open %s: %d\n", MEMINFO_FILE, errno);
+			field_put(opts->field);
+			opts->field = -1;
+			return ret;
+		}
+	}
+	meminfo.refcnt++;
+
+	return 0;
+}
+
+/*
+ * Walk the buffer once, line by line, and pick out the value of each
+ * referenced field.  Lines look like "MemAvailable:    1234567 kB".
+ */
+static void meminfo_scan(const char *buf, const char * const end)
+{
+	int i, len, found = 0, wanted = 0;
+	struct meminfo_field *field;
+	unsigned long long value;
+	const char *key;
+
+	for (i = 0; i < meminfo.field_cnt; i++) {
+		meminfo.fields[i].found = false;
+		if (meminfo.fields[i].refcnt)
+			wanted++;
+	}
+
+	while (buf < end && found < wanted) {
+		key = buf;
+		while (buf < end && *buf != ':' && *buf != '\n')
+			buf++;
+
+		if (buf == end)
+			break;
+
+		len = buf - key;
+		field = NULL;
+
+		if (*buf == ':') {
+			for (i = 0; i < meminfo.field_cnt; i++) {
+				if (meminfo.fields[i].refcnt && meminfo.fields[i].len == len &&
+				    memcmp(meminfo.fields[i].name, key, len) == 0) {
+					field = &meminfo.fields[i];
+					break;
+				}
+			}
+		}
+
+		if (field) {
+			buf++;
+			while (buf < end && *buf == ' ')
+				buf++;
+
+			value = 0;
+			while (buf < end && *buf >= '0' && *buf <= '9') {
+				value = value * 10 + (*buf - '0');
+				buf++;
+			}
+
+			field->value = value;
+			field->found = true;
+			found++;
+		}
+
+		while (buf < end && *buf != '\n')
+			buf++;
+		buf++;
+	}
+}
+
+/*
+ * Read and scan /proc/meminfo unless another cause already did so
+ * during this tick
+ */
+static int meminfo_sample(const struct cause_ctx * const ctx)
+{
+	ssize_t bytes;
+	int ret = 0;
+
+	pthread_mutex_lock(&meminfo.lock);
+
+	if (meminfo.seq == ctx->seq)
+		goto out;
+
+	if (replay_enabled())
+		bytes = replay_read(MEMINFO_FILE, meminfo.buf, sizeof(meminfo.buf));
+	else
+		bytes = pread(meminfo.fd, meminfo.buf, sizeof(meminfo.buf), 0);
+	if (bytes < 0) {
+		belayd_err("Failed to read %s: %d\n", MEMINFO_FILE, errno);
+		ret = -errno;
+		goto out;
+	}
+
+	if (bytes == sizeof(meminfo.buf))
+		belayd_wrn("%s was truncated to %zd bytes\n", MEMINFO_FILE, bytes);
+
+	meminfo_scan(meminfo.buf, meminfo.buf + bytes);
+	meminfo.seq = ctx->seq;
+
+out:
+	pthread_mutex_unlock(&meminfo.lock);
+
+	return ret;
+}
+
+int meminfo_init(struct cause * const cse, struct json_object *cse_obj,
+		 struct arena * const arena)
+{
+	const char *field_str, *op_str, *value_str;
+	struct json_object *args_obj;
+	struct meminfo_opts *opts;
+	json_bool exists;
+	bool found_op;
+	int ret = 0;
+	char *end;
+	int i;
+
+	opts = arena_alloc(arena, sizeof(struct meminfo_opts));
+	if (!opts)
+		return -ENOMEM;
+
+	exists = json_object_object_get_ex(cse_obj, "args", &args_obj);
+	if (!exists || !args_obj)
+		return -EINVAL;
+
+	ret = parse_string(args_obj, "operator", &op_str);
+	if (ret)
+		return ret;
+
+	found_op = false;
+	for (i = 0; i < OP_CNT; i++) {
+		if (strcmp(op_str, op_names[i]) == 0) {
+			found_op = true;
+			opts->op = i;
+			break;
+		}
+	}
+
+	if (!found_op) {
+		belayd_err("Invalid meminfo operator: %s\n", op_str);
+		return -EINVAL;
+	}
+
+	/* the value is in the same units as /proc/meminfo, i.e. usually kB */
+	ret = parse_string(args_obj, "value", &value_str);
+	if (ret)
+		return ret;
+
+	errno = 0;
+	opts->value = strtoull(value_str, &end, 10);
+	if (errno || end == value_str || *end != '\0') {
+		belayd_err("Invalid meminfo value: %s\n", value_str);
+		return -EINVAL;
+	}
+
+	ret = parse_string(args_obj, "field", &field_str);
+	if (ret)
+		return ret;
+
+	ret = window_parse(args_obj, arena, &opts->win);
+	if (ret)
+		return ret;
+
+	ret = meminfo_setup(opts, field_str);
+	if (ret)
+		return ret;
+
+	/* we have successfully setup the meminfo cause */
+	cse->data = (void *)opts;
+	cse->windowed = opts->win != NULL;
+
+	return ret;
+}
+
+int meminfo_main(struct cause * const cse, struct cause_ctx * const ctx,
+		 int time_since_last_run)
+{
+	struct meminfo_opts *opts = (struct meminfo_opts *)cse->data;
+	struct meminfo_field *field = &meminfo.fields[opts->field];
+	int ret;
+
+	ret = meminfo_sample(ctx);
+	if (ret)
+		return ret;
+
+	if (!field->found) {
+		belayd_err("Failed to find %s in %s\n", field->name, MEMINFO_FILE);
+		return -ENOENT;
+	}
+
+	opts->cur = field->value;
+	if (opts->win && !window_add(opts->win, ctx->now, field->value, &opts->cur))
+		return 0;
+
+	switch (opts->op) {
+		case OP_GREATER_THAN:
+			if (opts->cur > opts->value) {
+				belayd_info("%s%s%s %llu > %llu\n", field->name,
+					    opts->win ? " " : "", opts->win ? opts->win->name : "",
+					    opts->cur, opts->value);
+				return 1;
+			}
+			break;
+		case OP_LESS_THAN:
+			if (opts->cur < opts->value) {
+				belayd_info("%s%s%s %llu < %llu\n", field->name,
+					    opts->win ? " " : "", opts->win ? opts->win->name : "",
+					    opts->cur, opts->value);
+				return 1;
+			}
+			break;
+		default:
+			belayd_err("Invalid meminfo operation: %d\n", opts->op);
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+void meminfo_exit(struct cause * const cse)
+{
+	struct meminfo_opts *opts = (struct meminfo_opts *)cse->data;
+
+	field_put(opts->field);
+
+	if (--meminfo.refcnt == 0) {
+		if (meminfo.fd >= 0)
+			close(meminfo.fd);
+		meminfo.fd = -1;
+		meminfo.field_cnt = 0;
+	}
+}
+
+void meminfo_print(const struct cause * const cse, FILE *file)
+{
+	struct meminfo_opts *opts = (struct meminfo_opts *)cse->data;
+	const struct meminfo_field *field = &meminfo.fields[opts->field];
+
+	switch (opts->op) {
+		case OP_GREATER_THAN:
+			fprintf(file, "\tmeminfo cause: %s%s%s %llu is greater than %llu\n",
+				field->name, opts->win ? " " : "", opts->win ? opts->win->name : "",
+				opts->cur, opts->value);
+			break;
+		case OP_LESS_THAN:
+			fprintf(file, "\tmeminfo cause: %s%s%s %llu is less than %llu\n",
+				field->name, opts->win ? " " : "", opts->win ? opts->win->name : "",
+				opts->cur, opts->value);
+			break;
+		default:
+			fprintf(file, "Invalid meminfo op\n");
+			break;
+	}
+}
+
+int meminfo_pack(const struct cause * const cse, struct image_buf * const ib)
+{
+	struct meminfo_opts *opts = (struct meminfo_opts *)cse->data;
+	struct meminfo_image img = {
+		.op = opts->op,
+		.flags = opts->win ? MEMINFO_IMAGE_WINDOW : 0,
+		.value = opts->value,
+	};
+	int ret;
+
+	ret = image_buf_append(ib, &img, sizeof(img));
+	if (ret)
+		return ret;
+
+	ret = image_buf_append_str(ib, meminfo.fields[opts->field].name);
+	if (ret)
+		return ret;
+
+	if (opts->win)
+		ret = window_pack(opts->win, ib);
+
+	return ret;
+}
+
+int meminfo_unpack(struct cause * const cse, const void * const data, size_t len,
+		   struct arena * const arena)
+{
+	struct meminfo_opts *opts;
+	struct meminfo_image img;
+	size_t off = sizeof(img);
+	const char *field_str;
+	int ret;
+
+	if (len < sizeof(img))
+		return -EINVAL;
+
+	memcpy(&img, data, sizeof(img));
+
+	field_str = image_str(data, len, &off);
+	if (!field_str || img.op >= OP_CNT)
+		return -EINVAL;
+
+	opts = arena_alloc(arena, sizeof(struct meminfo_opts));
+	if (!opts)
+		return -ENOMEM;
+
+	opts->op = img.op;
+	opts->value = img.value;
+
+	if (img.flags & MEMINFO_IMAGE_WINDOW) {
+		ret = window_unpack(data, len, &off, arena, &opts->win);
+		if (ret)
+			return ret;
+	}
+
+	ret = meminfo_setup(opts, field_str);
+	if (ret)
+		return ret;
+
+	cse->data = (void *)opts;
+	cse->windowed = opts->win != NULL;
+
+	return 0;
+}
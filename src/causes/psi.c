@@ -0,0 +1,319 @@
+// LICENSE TBD
+/**
+ * pressure stall information (PSI) cause
+ *
+ * This file processes PSI causes.  Rather than sampling the pressure
+ * files every tick, the cause registers a PSI trigger with the kernel,
+ * e.g. "some 150000 1000000", and waits in the main loop for the kernel
+ * to signal the trigger via POLLPRI.  The cause trips for one window after
+ * each trigger event.
+ *
+ * The kernel limits the window to between 500ms and 10s, and without
+ * CAP_SYS_RESOURCE the window must be a multiple of 2s.
+ *
+ * A FIFO may stand in for the pressure file, e.g. for testing.  Every
+ * write to the FIFO is then treated as a trigger event.  In replay mode
+ * (see replay.c), the trigger events come from the recorded samples.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "belayd-internal.h"
+#include "defines.h"
+
+#define PSI_PRESSURE_DIR "/proc/pressure/"
+#define USEC_PER_MSEC 1000
+
+enum psi_type_enum {
+	PSI_SOME = 0,
+	PSI_FULL,
+
+	PSI_TYPE_CNT
+};
+
+static const char * const psi_type_names[] = {
+	"some",
+	"full",
+};
+static_assert(ARRAY_SIZE(psi_type_names) == PSI_TYPE_CNT,
+	      "psi_type_names[] must be same length as PSI_TYPE_CNT");
+
+struct psi_opts {
+	char *file;
+	enum psi_type_enum type;
+	int stall;		/* milliseconds */
+	int window;		/* milliseconds */
+
+	int fd;
+	bool fifo;
+
+	/* CLOCK_MONOTONIC milliseconds of the most recent trigger event */
+	uint64_t last_event;
+};
+
+static void psi_drain(int fd)
+{
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static int psi_event(int fd, uint32_t events, void *data)
+{
+	struct psi_opts *opts = (struct psi_opts *)data;
+
+	if (events & EPOLLERR) {
+		/* e.g. the cgroup was removed.  this trigger will never fire again */
+		belayd_wrn("PSI trigger on %s failed, disabling it\n", opts->file);
+		belayd_event_del(fd);
+		return 0;
+	}
+
+	if (opts->fifo)
+		psi_drain(fd);
+
+	belayd_dbg("PSI trigger on %s fired\n", opts->file);
+	opts->last_event = clock_mono_ms();
+
+	return belayd_cause_notify(opts);
+}
+
+static int psi_register(struct psi_opts * const opts)
+{
+	char trigger[64];
+	struct stat st;
+	uint32_t events;
+	ssize_t bytes;
+	int len, ret;
+
+	opts->fd = open(opts->file, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (opts->fd < 0) {
+		belayd_err("Failed to open %s: %d\n", opts->file, errno);
+		return -errno;
+	}
+
+	ret = fstat(opts->fd, &st);
+	if (ret)
+		return -errno;
+
+	opts->fifo = S_ISFIFO(st.st_mode);
+
+	len = snprintf(trigger, sizeof(trigger), "%s %lld %lld", psi_type_names[opts->type],
+		       (long long)opts->stall * USEC_PER_MSEC,
+		       (long long)opts->window * USEC_PER_MSEC);
+
+	/* the kernel requires the trigger to be written, NUL included, in one write */
+	bytes = write(opts->fd, trigger, len + 1);
+	if (bytes != len + 1) {
+		belayd_err("Failed to write PSI trigger \"%s\" to %s: %d\n", trigger,
+			   opts->file, errno);
+		return -errno;
+	}
+
+	if (opts->fifo) {
+		/* discard the trigger we just wrote so it is not seen as an event */
+		psi_drain(opts->fd);
+		events = EPOLLIN;
+	} else {
+		events = EPOLLPRI;
+	}
+
+	return events;
+}
+
+int psi_init(struct cause * const cse, struct json_object *cse_obj,
+	     struct arena * const arena)
+{
+	const char *resource_str, *file_str, *type_str, *dur_str;
+	struct json_object *args_obj;
+	struct psi_opts *opts;
+	json_bool exists;
+	bool found_type;
+	int ret = 0;
+	int events;
+	int i;
+
+	opts = arena_alloc(arena, sizeof(struct psi_opts));
+	if (!opts)
+		return -ENOMEM;
+
+	opts->fd = -1;
+
+	exists = json_object_object_get_ex(cse_obj, "args", &args_obj);
+	if (!exists || !args_obj) {
+		ret = -EINVAL;
+		goto error;
+	}
+
+	/*
+	 * Either a system-wide resource, e.g. "memory", or a path to a
+	 * pressure file, e.g. "/sys/fs/cgroup/foo/memory.pressure"
+	 */
+	exists = json_object_object_get_ex(args_obj, "file", NULL);
+	if (exists) {
+		ret = parse_string(args_obj, "file", &file_str);
+		if (ret)
+			goto error;
+
+		opts->file = arena_strdup(arena, file_str);
+		if (!opts->file) {
+			ret = -ENOMEM;
+			goto error;
+		}
+	} else {
+		ret = parse_string(args_obj, "resource", &resource_str);
+		if (ret)
+			goto error;
+
+		if (strcmp(resource_str, "cpu") != 0 && strcmp(resource_str, "memory") != 0 &&
+		    strcmp(resource_str, "io") != 0) {
+			belayd_err("Invalid PSI resource: %s\n", resource_str);
+			ret = -EINVAL;
+			goto error;
+		}
+
+		opts->file = arena_alloc(arena, strlen(PSI_PRESSURE_DIR) + strlen(resource_str) + 1);
+		if (!opts->file) {
+			ret = -ENOMEM;
+			goto error;
+		}
+
+		sprintf(opts->file, "%s%s", PSI_PRESSURE_DIR, resource_str);
+	}
+
+	ret = parse_string(args_obj, "type", &type_str);
+	if (ret)
+		goto error;
+
+	found_type = false;
+	for (i = 0; i < PSI_TYPE_CNT; i++) {
+		if (strcmp(type_str, psi_type_names[i]) == 0) {
+			found_type = true;
+			opts->type = i;
+			break;
+		}
+	}
+
+	if (!found_type) {
+		belayd_err("Invalid PSI type: %s\n", type_str);
+		ret = -EINVAL;
+		goto error;
+	}
+
+	ret = parse_string(args_obj, "stall", &dur_str);
+	if (ret)
+		goto error;
+
+	ret = parse_duration_str(dur_str, &opts->stall);
+	if (ret) {
+		belayd_err("Invalid PSI stall: %s\n", dur_str);
+		goto error;
+	}
+
+	ret = parse_string(args_obj, "window", &dur_str);
+	if (ret)
+		goto error;
+
+	ret = parse_duration_str(dur_str, &opts->window);
+	if (ret || opts->stall > opts->window) {
+		belayd_err("Invalid PSI window: %s\n", dur_str);
+		ret = -EINVAL;
+		goto error;
+	}
+
+	if (replay_enabled()) {
+		/* the trigger events are replayed from the samples instead */
+		ret = replay_event_add(opts->file, psi_event, opts);
+		if (ret)
+			goto error;
+
+		cse->data = (void *)opts;
+
+		return 0;
+	}
+
+	events = psi_register(opts);
+	if (events < 0) {
+		ret = events;
+		goto error;
+	}
+
+	/* register opts rather than cse, which does not survive a reload */
+	ret = belayd_event_add(opts->fd, events, psi_event, opts);
+	if (ret)
+		goto error;
+
+	/* we have successfully setup the psi cause */
+	cse->data = (void *)opts;
+
+	return ret;
+
+error:
+	if (opts->fd >= 0)
+		close(opts->fd);
+
+	return ret;
+}
+
+int psi_main(struct cause * const cse, struct cause_ctx * const ctx,
+	     int time_since_last_run)
+{
+	struct psi_opts *opts = (struct psi_opts *)cse->data;
+
+	if (opts->last_event && opts->last_event + opts->window > ctx->now) {
+		belayd_info("PSI trigger on %s fired %llu ms ago\n", opts->file,
+			    (unsigned long long)(ctx->now - opts->last_event));
+		return 1;
+	}
+
+	return 0;
+}
+
+void psi_exit(struct cause * const cse)
+{
+	struct psi_opts *opts = (struct psi_opts *)cse->data;
+
+	if (opts->fd < 0) {
+		replay_event_del(opts);
+		return;
+	}
+
+	belayd_event_del(opts->fd);
+	close(opts->fd);
+}
+
+void psi_print(const struct cause * const cse, FILE *file)
+{
+	struct psi_opts *opts = (struct psi_opts *)cse->data;
+
+	fprintf(file, "\tPSI cause: %s stalled for %d ms within %d ms in %s\n",
+		psi_type_names[opts->type], opts->stall, opts->window, opts->file);
+}
+
+/*
+ * Once tripped, the cause clears when the window after the event ends.
+ * Otherwise only a trigger event can change the result, and that wakes
+ * belayd via belayd_cause_notify().
+ */
+uint64_t psi_horizon(const struct cause * const cse, struct cause_ctx * const ctx)
+{
+	struct psi_opts *opts = (struct psi_opts *)cse->data;
+
+	if (cse->result > 0)
+		return opts->last_event + opts->window;
+
+	return CAUSE_HORIZON_NEVER;
+}
@@ -36,7 +36,16 @@ struct time_of_day_opts {
 	struct tm time;
 };
 
-int time_of_day_init(struct cause * const cse, struct json_object *cse_obj)
+/* a time_of_day cause in a compiled rule image, followed by time_str */
+struct time_of_day_image {
+	int32_t op;
+	int32_t hour;
+	int32_t min;
+	int32_t sec;
+};
+
+int time_of_day_init(struct cause * const cse, struct json_object *cse_obj,
+		     struct arena * const arena)
 {
 	struct json_object *args_obj;
 	struct time_of_day_opts *opts;
@@ -48,31 +57,21 @@ int time_of_day_init(struct cause * const cse, struct json_object *cse_obj)
 	char *tret;
 	int i;
 
-	opts = malloc(sizeof(struct time_of_day_opts));
-	if (!opts) {
-		ret = -ENOMEM;
-		goto error;
-	}
-
-	memset(opts, 0, sizeof(struct time_of_day_opts));
+	opts = arena_alloc(arena, sizeof(struct time_of_day_opts));
+	if (!opts)
+		return -ENOMEM;
 
 	exists = json_object_object_get_ex(cse_obj, "args", &args_obj);
-	if (!exists || !args_obj) {
-		ret = -EINVAL;
-		goto error;
-	}
+	if (!exists || !args_obj)
+		return -EINVAL;
 
 	ret = parse_string(args_obj, "time", &time_str);
 	if (ret)
-		goto error;
+		return ret;
 
-	opts->time_str = malloc(sizeof(char) * strlen(time_str));
-	if (!opts->time_str) {
-		ret = -ENOMEM;
-		goto error;
-	}
-
-	strcpy(opts->time_str, time_str);
+	opts->time_str = arena_strdup(arena, time_str);
+	if (!opts->time_str)
+		return -ENOMEM;
 
 	tret = strptime(time_str, "%H:%M:%S", &time);
 	if (!tret) {
@@ -80,15 +79,14 @@ int time_of_day_init(struct cause * const cse, struct json_object *cse_obj)
 		 * We were unable to process all of the characters in the
 		 * string.  Fail and notify the user
 		 */
-		ret = -EINVAL;
-		goto error;
+		return -EINVAL;
 	}
 
 	memcpy(&opts->time, &time, sizeof(struct tm));
 
 	ret = parse_string(args_obj, "operator", &op_str);
 	if (ret)
-		goto error;
+		return ret;
 
 	found_op = false;
 	for (i = 0; i < OP_CNT; i++) {
@@ -99,35 +97,23 @@ int time_of_day_init(struct cause * const cse, struct json_object *cse_obj)
 		}
 	}
 
-	if (!found_op) {
-		ret = -EINVAL;
-		goto error;
-	}
+	if (!found_op)
+		return -EINVAL;
 
 	/* we have successfully setup the time_of_day cause */
 	cse->data = (void *)opts;
 
 	return ret;
-
-error:
-	if (opts && opts->time_str)
-		free(opts->time_str);
-
-	if (opts)
-		free(opts);
-
-	return ret;
 }
 
-int time_of_day_main(struct cause * const cse, int time_since_last_run)
+int time_of_day_main(struct cause * const cse, struct cause_ctx * const ctx,
+		     int time_since_last_run)
 {
 	struct time_of_day_opts *opts = (struct time_of_day_opts *)cse->data;
-	struct tm *cur_tm;
-	time_t cur_time;
+	const struct tm *cur_tm;
 	int ret = 0;
 
-	time(&cur_time);
-	cur_tm = localtime(&cur_time);
+	cur_tm = cause_ctx_localtime(ctx);
 
 	switch (opts->op) {
 		case OP_GREATER_THAN:
@@ -159,14 +145,37 @@ int time_of_day_main(struct cause * const cse, int time_since_last_run)
 	return ret;
 }
 
-void time_of_day_exit(struct cause * const cse)
+/*
+ * The result can next change one second after the trigger time if the
+ * cause has not tripped yet, or at midnight if it has
+ */
+uint64_t time_of_day_horizon(const struct cause * const cse, struct cause_ctx * const ctx)
 {
 	struct time_of_day_opts *opts = (struct time_of_day_opts *)cse->data;
+	struct tm next_tm;
+	time_t next;
+
+	memcpy(&next_tm, cause_ctx_localtime(ctx), sizeof(struct tm));
+
+	if (cse->result > 0) {
+		next_tm.tm_mday++;
+		next_tm.tm_hour = 0;
+		next_tm.tm_min = 0;
+		next_tm.tm_sec = 0;
+	} else {
+		next_tm.tm_hour = opts->time.tm_hour;
+		next_tm.tm_min = opts->time.tm_min;
+		next_tm.tm_sec = opts->time.tm_sec + 1;
+	}
+
+	/* let mktime() normalize the fields and work out daylight saving */
+	next_tm.tm_isdst = -1;
 
-	if (opts->time_str)
-		free(opts->time_str);
+	next = mktime(&next_tm);
+	if (next == (time_t)-1)
+		return 0;
 
-	free(opts);
+	return cause_ctx_wall_to_mono(ctx, next);
 }
 
 void time_of_day_print(const struct cause * const cse, FILE *file)
@@ -182,3 +191,56 @@ void time_of_day_print(const struct cause * const cse, FILE *file)
 			break;
 	}
 }
+
+int time_of_day_pack(const struct cause * const cse, struct image_buf * const ib)
+{
+	struct time_of_day_opts *opts = (struct time_of_day_opts *)cse->data;
+	struct time_of_day_image img = {
+		.op = opts->op,
+		.hour = opts->time.tm_hour,
+		.min = opts->time.tm_min,
+		.sec = opts->time.tm_sec,
+	};
+	int ret;
+
+	ret = image_buf_append(ib, &img, sizeof(img));
+	if (ret)
+		return ret;
+
+	return image_buf_append_str(ib, opts->time_str);
+}
+
+int time_of_day_unpack(struct cause * const cse, const void * const data, size_t len,
+		       struct arena * const arena)
+{
+	struct time_of_day_image img;
+	struct time_of_day_opts *opts;
+	size_t off = sizeof(img);
+	const char *time_str;
+
+	if (len < sizeof(img))
+		return -EINVAL;
+
+	memcpy(&img, data, sizeof(img));
+
+	time_str = image_str(data, len, &off);
+	if (!time_str || img.op < 0 || img.op >= OP_CNT)
+		return -EINVAL;
+
+	opts = arena_alloc(arena, sizeof(struct time_of_day_opts));
+	if (!opts)
+		return -ENOMEM;
+
+	opts->time_str = arena_strdup(arena, time_str);
+	if (!opts->time_str)
+		return -ENOMEM;
+
+	opts->op = img.op;
+	opts->time.tm_hour = img.hour;
+	opts->time.tm_min = img.min;
+	opts->time.tm_sec = img.sec;
+
+	cse->data = (void *)opts;
+
+	return 0;
+}
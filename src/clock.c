@@ -0,0 +1,65 @@
+// LICENSE TBD
+/**
+ * Clocks for belayd, see clock.h
+ *
+ * The virtual clock has no epoch of its own.  Its monotonic and wall-clock
+ * times are the same number, so converting between them, e.g. in
+ * cause_ctx_wall_to_mono(), is exact.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "clock.h"
+
+/* set by the main thread between ticks, and read by any thread */
+static struct {
+	bool enabled;
+	uint64_t now;		/* milliseconds */
+} virt;
+
+static uint64_t clock_read_ms(clockid_t clk)
+{
+	struct timespec now;
+
+	if (__atomic_load_n(&virt.enabled, __ATOMIC_ACQUIRE))
+		return __atomic_load_n(&virt.now, __ATOMIC_RELAXED);
+
+	clock_gettime(clk, &now);
+
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t clock_mono_ms(void)
+{
+	return clock_read_ms(CLOCK_MONOTONIC);
+}
+
+uint64_t clock_wall_ms(void)
+{
+	return clock_read_ms(CLOCK_REALTIME);
+}
+
+uint64_t clock_real_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void clock_set(uint64_t wall_ms)
+{
+	__atomic_store_n(&virt.now, wall_ms, __ATOMIC_RELAXED);
+	__atomic_store_n(&virt.enabled, true, __ATOMIC_RELEASE);
+}
+
+bool clock_is_virtual(void)
+{
+	return __atomic_load_n(&virt.enabled, __ATOMIC_ACQUIRE);
+}
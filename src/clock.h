@@ -0,0 +1,33 @@
+// LICENSE TBD
+/**
+ * belayd clock header file
+ *
+ * belayd reads the time through these functions rather than through
+ * clock_gettime(), so that it can run on a virtual clock.  Normally they
+ * return CLOCK_MONOTONIC and CLOCK_REALTIME.  Once clock_set() has been
+ * called, e.g. by the replay mode (see replay.c), both return the virtual
+ * time, which only moves when clock_set() is called again.  The time that
+ * work takes, e.g. for the metrics, is always measured on the real clock.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#ifndef __BELAYD_CLOCK_H
+#define __BELAYD_CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* CLOCK_MONOTONIC milliseconds */
+uint64_t clock_mono_ms(void);
+/* CLOCK_REALTIME milliseconds */
+uint64_t clock_wall_ms(void);
+/* CLOCK_MONOTONIC nanoseconds on the real clock, for the time that work takes */
+uint64_t clock_real_ns(void);
+
+/* switch to the virtual clock, or advance it, to wall_ms */
+void clock_set(uint64_t wall_ms);
+bool clock_is_virtual(void);
+
+#endif /* __BELAYD_CLOCK_H */
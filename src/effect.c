@@ -18,13 +18,15 @@
 const char * const effect_names[] = {
 	"print",
 	"validate",
+	"cgroup_setting",
 };
 static_assert(ARRAY_SIZE(effect_names) == EFFECT_CNT,
 	      "effect_names[] must be same length as EFFECT_CNT");
 
 const struct effect_functions effect_fns[] = {
-	{print_init, print_main, print_exit},
-	{validate_init, validate_main, validate_exit},
+	{print_init, NULL, NULL, print_pack, print_unpack, print_snapshot, print_apply},
+	{validate_init, validate_main, NULL, validate_pack, validate_unpack, NULL, NULL},
+	{cgroup_setting_init, cgroup_setting_main, cgroup_setting_exit, NULL, NULL, NULL, NULL},
 };
 static_assert(ARRAY_SIZE(effect_fns) == EFFECT_CNT,
 	      "effect_fns[] must be same length as EFFECT_CNT");
@@ -14,37 +14,100 @@
 #define __BELAYD_EFFECT_H
 
 #include <json-c/json.h>
+#include <stdbool.h>
 
 #include "defines.h"
 #include "cause.h"
+#include "arena.h"
+#include "image.h"
 
 enum effect_enum {
 	EFFECT_PRINT = 0,
 	EFFECT_VALIDATE,
+	EFFECT_CGROUP_SETTING,
 
 	EFFECT_CNT
 };
 
 struct effect {
 	/* populated by belayd */
-	enum effect_enum idx;
-	char *name;
 	const struct effect_functions *fns;
-	struct effect *next;
 
 	/* private data store for each effect plugin */
 	void *data;
+
+	enum effect_enum idx;
+	char *name;
+
+	/*
+	 * milliseconds that the effect may wait in the executor's queue and
+	 * then run for, or 0 for no limit.  pending is set while it is queued.
+	 */
+	int timeout;
+	bool pending;
+
+	/*
+	 * limits on how often the effect runs while its rule stays tripped,
+	 * or 0 for none, see effect_limited() in loop.c.  All are milliseconds,
+	 * but for rate_cnt, which is the number of runs allowed per
+	 * rate_period.
+	 */
+	int cooldown;		/* since the effect last ran */
+	int dwell;		/* that the rule must have been tripped for */
+	int rate_cnt;
+	int rate_period;
+
+	/* when the effect last ran, and the token bucket of max_rate */
+	uint64_t last_run;
+	uint64_t credit;
+	uint64_t refilled;
+
+	struct metrics *metrics;	/* NULL unless metrics are enabled */
+
+	/* canonical form of the effect's config, and ownership of data, see struct cause */
+	char *key;
+	struct arena *home;
+	struct effect *origin;
+	bool moved;
+
+	/* set in the origin while a reload switches over, see executor_switch() */
+	struct effect *successor;
 };
 
+/* see cause_init() for the use of arena */
 typedef int (*effect_init)(struct effect * const eff, struct json_object *eff_obj,
-			   const struct cause * const cse);
-typedef int (*effect_main)(struct effect * const eff);
+			   const struct cause * const cse, struct arena * const arena);
+/*
+ * cse is the list of the rule's causes.  It is passed to main() rather than
+ * kept from init(), so that an effect that is carried over by a reload does
+ * not point into the old config.
+ */
+typedef int (*effect_main)(struct effect * const eff, const struct cause * const cse);
 typedef void (*effect_exit)(struct effect * const eff);
+/*
+ * An effect that reads the rule's causes, e.g. print, runs on the executor
+ * like any other, but the causes may be evaluated again while it waits in
+ * the queue.  snapshot() copies what it needs from them on the main loop's
+ * thread, into memory from malloc(), or returns NULL on failure.  apply()
+ * then runs on the executor with the snapshot, in place of main(), and
+ * the executor frees the snapshot afterwards.
+ */
+typedef void *(*effect_snapshot)(struct effect * const eff, const struct cause * const cse);
+typedef int (*effect_apply)(struct effect * const eff, const void * const snap);
+/* see cause_pack() */
+typedef int (*effect_pack)(const struct effect * const eff, struct image_buf * const ib);
+typedef int (*effect_unpack)(struct effect * const eff, const void * const data, size_t len,
+			     const struct cause * const cse, struct arena * const arena);
 
 struct effect_functions {
 	effect_init init;
 	effect_main main;
-	effect_exit exit;
+	effect_exit exit;	/* implementing the exit() function is optional */
+	effect_pack pack;	/* implementing pack() and unpack() is optional */
+	effect_unpack unpack;
+	/* implemented instead of main() by an effect that reads the causes */
+	effect_snapshot snapshot;
+	effect_apply apply;
 };
 
 extern const char * const effect_names[];
@@ -52,13 +115,23 @@ extern const struct effect_functions effect_fns[];
 
 
 int print_init(struct effect * const eff, struct json_object *eff_obj,
-	       const struct cause * const cse);
-int print_main(struct effect * const eff);
-void print_exit(struct effect * const eff);
+	       const struct cause * const cse, struct arena * const arena);
+void *print_snapshot(struct effect * const eff, const struct cause * const cse);
+int print_apply(struct effect * const eff, const void * const snap);
+int print_pack(const struct effect * const eff, struct image_buf * const ib);
+int print_unpack(struct effect * const eff, const void * const data, size_t len,
+		 const struct cause * const cse, struct arena * const arena);
 
 int validate_init(struct effect * const eff, struct json_object *eff_obj,
-		  const struct cause * const cse);
-int validate_main(struct effect * const eff);
-void validate_exit(struct effect * const eff);
+		  const struct cause * const cse, struct arena * const arena);
+int validate_main(struct effect * const eff, const struct cause * const cse);
+int validate_pack(const struct effect * const eff, struct image_buf * const ib);
+int validate_unpack(struct effect * const eff, const void * const data, size_t len,
+		    const struct cause * const cse, struct arena * const arena);
+
+int cgroup_setting_init(struct effect * const eff, struct json_object *eff_obj,
+			const struct cause * const cse, struct arena * const arena);
+int cgroup_setting_main(struct effect * const eff, const struct cause * const cse);
+void cgroup_setting_exit(struct effect * const eff);
 
 #endif /* __BELAYD_EFFECT_H */
@@ -0,0 +1,246 @@
+// LICENSE TBD
+/**
+ * cgroup setting effect
+ *
+ * This file runs the cgroup setting effect, which writes a value to a
+ * cgroup v2 knob such as cpu.weight, cpu.max, memory.high or io.max.
+ *
+ * Each knob file is opened once and shared by every effect that writes to
+ * it.  The last value written to each file is remembered, and the write
+ * is skipped if the value has not changed, so that a rule that trips
+ * every tick does not hammer the kernel with identical writes.  A write
+ * that fails because the cgroup was removed is only logged.  In replay
+ * mode the knobs are not opened, because the effects are only recorded.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "belayd-internal.h"
+#include "defines.h"
+
+#define CGROUP_MOUNT_POINT "/sys/fs/cgroup/"
+
+struct knob {
+	char *path;
+	int fd;
+	int refcnt;
+
+	/*
+	 * a copy of the value most recently written, or NULL if it is
+	 * unknown.  It is not shared with the effect, whose exit() may run
+	 * while another effect writes the knob on the executor's thread.
+	 */
+	char *last;
+	size_t last_len;
+
+	struct knob *next;
+};
+
+/* every knob file that is written by an effect */
+static struct knob *knobs;
+
+struct cgroup_setting_opts {
+	struct knob *knob;
+	char *value;
+	size_t value_len;
+};
+
+static struct knob *knob_get(const char * const path)
+{
+	struct knob *knob;
+
+	for (knob = knobs; knob; knob = knob->next) {
+		if (strcmp(knob->path, path) == 0) {
+			knob->refcnt++;
+			return knob;
+		}
+	}
+
+	knob = malloc(sizeof(struct knob));
+	if (!knob)
+		return NULL;
+
+	memset(knob, 0, sizeof(struct knob));
+
+	knob->path = malloc(strlen(path) + 1);
+	if (!knob->path)
+		goto error;
+
+	strcpy(knob->path, path);
+
+	knob->fd = -1;
+	if (!replay_enabled()) {
+		knob->fd = open(path, O_WRONLY | O_CLOEXEC);
+		if (knob->fd < 0) {
+			belayd_err("Failed to open %s: %d\n", path, errno);
+			goto error;
+		}
+	}
+
+	knob->refcnt = 1;
+	knob->next = knobs;
+	knobs = knob;
+
+	return knob;
+
+error:
+	if (knob->path)
+		free(knob->path);
+
+	free(knob);
+
+	return NULL;
+}
+
+static void knob_put(struct knob * const knob)
+{
+	struct knob **prev;
+
+	if (--knob->refcnt)
+		return;
+
+	for (prev = &knobs; *prev; prev = &(*prev)->next) {
+		if (*prev == knob) {
+			*prev = knob->next;
+			break;
+		}
+	}
+
+	if (knob->fd >= 0)
+		close(knob->fd);
+	free(knob->last);
+	free(knob->path);
+	free(knob);
+}
+
+/*
+ * cgroup paths that begin with "/" or "." are used as is.  All others are
+ * relative to the cgroup v2 mount point.
+ */
+static struct knob *knob_get_setting(const char * const cgroup, const char * const setting)
+{
+	struct knob *knob;
+	const char *root;
+	char *path;
+
+	if (strchr(setting, '/')) {
+		belayd_err("Invalid cgroup setting: %s\n", setting);
+		return NULL;
+	}
+
+	root = (cgroup[0] == '/' || cgroup[0] == '.') ? "" : CGROUP_MOUNT_POINT;
+
+	path = malloc(strlen(root) + strlen(cgroup) + strlen(setting) + 2);
+	if (!path)
+		return NULL;
+
+	sprintf(path, "%s%s/%s", root, cgroup, setting);
+	knob = knob_get(path);
+	free(path);
+
+	return knob;
+}
+
+int cgroup_setting_init(struct effect * const eff, struct json_object *eff_obj,
+			const struct cause * const cse, struct arena * const arena)
+{
+	const char *cgroup_str, *setting_str, *value_str;
+	struct cgroup_setting_opts *opts;
+	struct json_object *args_obj;
+	json_bool exists;
+	int ret = 0;
+
+	opts = arena_alloc(arena, sizeof(struct cgroup_setting_opts));
+	if (!opts)
+		return -ENOMEM;
+
+	exists = json_object_object_get_ex(eff_obj, "args", &args_obj);
+	if (!exists || !args_obj)
+		return -EINVAL;
+
+	ret = parse_string(args_obj, "cgroup", &cgroup_str);
+	if (ret)
+		return ret;
+
+	ret = parse_string(args_obj, "setting", &setting_str);
+	if (ret)
+		return ret;
+
+	ret = parse_string(args_obj, "value", &value_str);
+	if (ret)
+		return ret;
+
+	opts->value_len = strlen(value_str);
+	opts->value = arena_strdup(arena, value_str);
+	if (!opts->value)
+		return -ENOMEM;
+
+	opts->knob = knob_get_setting(cgroup_str, setting_str);
+	if (!opts->knob)
+		return -EINVAL;
+
+	/* we have successfully setup the cgroup_setting effect */
+	eff->data = (void *)opts;
+
+	return ret;
+}
+
+int cgroup_setting_main(struct effect * const eff, const struct cause * const cse)
+{
+	struct cgroup_setting_opts *opts = (struct cgroup_setting_opts *)eff->data;
+	struct knob *knob = opts->knob;
+	ssize_t bytes;
+	int err;
+
+	/* several effects may write the same knob, so compare the values */
+	if (knob->last && knob->last_len == opts->value_len &&
+	    memcmp(knob->last, opts->value, opts->value_len) == 0) {
+		belayd_dbg("%s is already %s\n", knob->path, opts->value);
+		return 0;
+	}
+
+	bytes = pwrite(knob->fd, opts->value, opts->value_len, 0);
+	if (bytes != opts->value_len) {
+		err = bytes < 0 ? errno : EIO;
+
+		/* the contents of the file are now unknown */
+		free(knob->last);
+		knob->last = NULL;
+
+		/* the cgroup was removed, which must not stop belayd */
+		if (err == ENOENT || err == ENODEV) {
+			belayd_wrn("Failed to write %s to %s: %d\n", opts->value, knob->path, err);
+			return 0;
+		}
+
+		belayd_err("Failed to write %s to %s: %d\n", opts->value, knob->path, err);
+		return -err;
+	}
+
+	belayd_info("Set %s to %s\n", knob->path, opts->value);
+
+	/* if there is no memory for the copy, the next write is not skipped */
+	free(knob->last);
+	knob->last = malloc(opts->value_len);
+	if (knob->last)
+		memcpy(knob->last, opts->value, opts->value_len);
+	knob->last_len = opts->value_len;
+
+	return 0;
+}
+
+void cgroup_setting_exit(struct effect * const eff)
+{
+	struct cgroup_setting_opts *opts = (struct cgroup_setting_opts *)eff->data;
+
+	knob_put(opts->knob);
+}
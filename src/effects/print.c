@@ -9,6 +9,8 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
@@ -25,11 +27,10 @@ enum file_enum {
 
 struct print_opts {
 	FILE *file;
-	const struct cause *cse;
 };
 
 int print_init(struct effect * const eff, struct json_object *eff_obj,
-	       const struct cause * const cse)
+	       const struct cause * const cse, struct arena * const arena)
 {
 	struct json_object *args_obj;
 	struct print_opts *opts;
@@ -37,68 +38,108 @@ int print_init(struct effect * const eff, struct json_object *eff_obj,
 	json_bool exists;
 	int ret = 0;
 
-	opts = malloc(sizeof(struct print_opts));
-	if (!opts) {
-		ret = -ENOMEM;
-		goto error;
-	}
+	opts = arena_alloc(arena, sizeof(struct print_opts));
+	if (!opts)
+		return -ENOMEM;
 
 	exists = json_object_object_get_ex(eff_obj, "args", &args_obj);
-	if (!exists || !args_obj) {
-		ret = -EINVAL;
-		goto error;
-	}
+	if (!exists || !args_obj)
+		return -EINVAL;
 
 	ret = parse_string(args_obj, "file", &file_str);
 	if (ret)
-		goto error;
+		return ret;
 
 	if (strncmp(file_str, "stderr", strlen("stderr")) == 0) {
 		opts->file = stderr;
 	} else if (strncmp(file_str, "stdout", strlen("stdout")) == 0) {
 		opts->file = stdout;
 	} else {
-		ret = -EINVAL;
-		goto error;
+		return -EINVAL;
 	}
 
-	opts->cse = cse;
-
 	/* we have successfully setup the print effect */
 	eff->data = (void *)opts;
 
 	return ret;
-
-error:
-	if (opts)
-		free(opts);
-
-	return ret;
 }
 
-int print_main(struct effect * const eff)
+/* the message is written on the main loop's thread, and printed by print_apply() */
+void *print_snapshot(struct effect * const eff, const struct cause * const cse)
 {
-	struct print_opts *opts = (struct print_opts *)eff->data;
-	const struct cause *cse;
+	const struct cause *cur;
+	FILE *file;
+	size_t len;
+	char *buf;
 
-	fprintf(opts->file, "Print effect triggered by:\n");
+	file = open_memstream(&buf, &len);
+	if (!file)
+		return NULL;
 
-	cse = opts->cse;
-	while (cse) {
-		if (cse->fns->print)
-			(*cse->fns->print)(cse, opts->file);
+	fprintf(file, "Print effect triggered by:\n");
+
+	for (cur = cse; cur; cur = cur->next) {
+		if (cur->fns->print)
+			(*cur->fns->print)(cur, file);
 		else
-			fprintf(opts->file, "\t%s\n", cse->name);
+			fprintf(file, "\t%s\n", cur->name);
+	}
 
-		cse = cse->next;
+	if (fclose(file)) {
+		free(buf);
+		return NULL;
 	}
 
+	return buf;
+}
+
+int print_apply(struct effect * const eff, const void * const snap)
+{
+	struct print_opts *opts = (struct print_opts *)eff->data;
+
+	fputs(snap, opts->file);
+
 	return 0;
 }
 
-void print_exit(struct effect * const eff)
+/* the file is stored in a compiled rule image as a file_enum */
+int print_pack(const struct effect * const eff, struct image_buf * const ib)
 {
 	struct print_opts *opts = (struct print_opts *)eff->data;
+	uint32_t file;
 
-	free(opts);
+	file = opts->file == stderr ? FILE_STDERR : FILE_STDOUT;
+
+	return image_buf_append(ib, &file, sizeof(file));
+}
+
+int print_unpack(struct effect * const eff, const void * const data, size_t len,
+		 const struct cause * const cse, struct arena * const arena)
+{
+	struct print_opts *opts;
+	uint32_t file;
+
+	if (len < sizeof(file))
+		return -EINVAL;
+
+	memcpy(&file, data, sizeof(file));
+
+	opts = arena_alloc(arena, sizeof(struct print_opts));
+	if (!opts)
+		return -ENOMEM;
+
+	switch (file) {
+	case FILE_STDOUT:
+		opts->file = stdout;
+		break;
+	case FILE_STDERR:
+		opts->file = stderr;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	eff->data = (void *)opts;
+
+	return 0;
 }
@@ -27,43 +27,33 @@ struct validate_opts {
 };
 
 int validate_init(struct effect * const eff, struct json_object *eff_obj,
-	       const struct cause * const cse)
+		  const struct cause * const cse, struct arena * const arena)
 {
 	struct json_object *args_obj;
 	struct validate_opts *opts;
 	json_bool exists;
 	int ret = 0;
 
-	opts = malloc(sizeof(struct validate_opts));
-	if (!opts) {
-		ret = -ENOMEM;
-		goto error;
-	}
+	opts = arena_alloc(arena, sizeof(struct validate_opts));
+	if (!opts)
+		return -ENOMEM;
 	opts->ret = default_return_value;
 
 	exists = json_object_object_get_ex(eff_obj, "args", &args_obj);
-	if (!exists || !args_obj) {
-		ret = -EINVAL;
-		goto error;
-	}
+	if (!exists || !args_obj)
+		return -EINVAL;
 
 	ret = parse_int(args_obj, "return_value", &opts->ret);
 	if (ret)
-		goto error;
+		return ret;
 
 	/* we have successfully setup the validate effect */
 	eff->data = (void *)opts;
 
 	return ret;
-
-error:
-	if (opts)
-		free(opts);
-
-	return ret;
 }
 
-int validate_main(struct effect * const eff)
+int validate_main(struct effect * const eff, const struct cause * const cse)
 {
 	struct validate_opts *opts = (struct validate_opts *)eff->data;
 
@@ -71,9 +61,31 @@ int validate_main(struct effect * const eff)
 	return -opts->ret;
 }
 
-void validate_exit(struct effect * const eff)
+int validate_pack(const struct effect * const eff, struct image_buf * const ib)
 {
 	struct validate_opts *opts = (struct validate_opts *)eff->data;
+	int32_t ret = opts->ret;
+
+	return image_buf_append(ib, &ret, sizeof(ret));
+}
+
+int validate_unpack(struct effect * const eff, const void * const data, size_t len,
+		    const struct cause * const cse, struct arena * const arena)
+{
+	struct validate_opts *opts;
+	int32_t ret;
+
+	if (len < sizeof(ret))
+		return -EINVAL;
+
+	memcpy(&ret, data, sizeof(ret));
+
+	opts = arena_alloc(arena, sizeof(struct validate_opts));
+	if (!opts)
+		return -ENOMEM;
+
+	opts->ret = ret;
+	eff->data = (void *)opts;
 
-	free(opts);
+	return 0;
 }
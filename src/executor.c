@@ -0,0 +1,493 @@
+// LICENSE TBD
+/**
+ * Effect executor for belayd
+ *
+ * Effects are run by a dedicated thread rather than by the main loop, so
+ * that an effect that takes a long time, e.g. one that writes to many
+ * cgroups, does not hold up the evaluation of the causes.  The main loop
+ * submits the effects of the rules that tripped to a bounded FIFO queue,
+ * in config order, and the executor runs them in that order.
+ *
+ * - An effect that is still waiting in the queue when its rule trips
+ *   again is not queued a second time.
+ * - When the queue is full, the effect is rejected with a warning.  Its
+ *   rule trips again on a later tick if its causes still hold, so
+ *   enforcement is delayed rather than lost while the executor catches up.
+ *   The main loop then submits the deferred rules' effects first, so that
+ *   the rules at the end of the config are not starved.
+ * - An effect with a timeout is dropped if it waited in the queue for
+ *   longer than that, because the tick that tripped it is stale by then,
+ *   and the main loop warns if it runs for longer than that.  A running
+ *   effect cannot be interrupted.
+ * - When belayd exits, the effects that are still queued are run before
+ *   the executor stops, subject to their timeouts.
+ *
+ * Effects that read the rule's causes, e.g. print, are queued too, so
+ * that every effect runs in config order.  The causes may be evaluated
+ * again while the executor runs, so the main loop takes a snapshot of
+ * what such an effect needs from them when it submits the effect.  A nonzero return value from an effect stops
+ * the executor and is passed back to the main loop, which exits with it.
+ *
+ * A reload does not wait for the executor.  The queued jobs are moved
+ * over to the new config's effects, or dropped if their effect was
+ * removed, and the old config is freed once the job that is running, if
+ * any, has finished.  That way no effect's exit() runs alongside its
+ * main(), and a slow effect does not hold up the rules' ticks.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "belayd-internal.h"
+#include "clock.h"
+#include "trace.h"
+
+/* milliseconds between the warnings about a full queue */
+#define EXECUTOR_WARN_PERIOD 1000
+
+struct effect_job {
+	struct effect *eff;
+	const struct rule *rule;
+	uint64_t deadline;	/* CLOCK_MONOTONIC milliseconds, or 0 for none */
+	void *snap;		/* see effect_snapshot, or NULL */
+};
+
+/* a rule set that was replaced by a reload, see executor_retire() */
+struct retired_set {
+	struct rule_set set;
+	unsigned long long until;	/* freed once this many jobs have finished */
+	struct retired_set *next;
+};
+
+static struct {
+	pthread_t thread;
+	bool running;
+	int done_fd;		/* eventfd, signalled when an effect fails or a job finishes */
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* a job was queued, or the executor is exiting */
+	pthread_cond_t ran;	/* a job finished */
+
+	/* ring buffer of pending jobs, protected by lock */
+	struct effect_job *jobs;
+	int size;
+	int head;
+	int cnt;
+
+	/* the job that is running, if any */
+	const struct effect *cur;
+	const struct rule *cur_rule;
+	uint64_t cur_start;
+	bool cur_warned;
+
+	/* jobs that were started and finished, and the sets waiting on them */
+	unsigned long long started;
+	unsigned long long finished;
+	struct retired_set *retired;
+
+	bool exiting;
+	int ret;		/* the first nonzero return value of an effect */
+
+	/* statistics */
+	unsigned long long queued;
+	unsigned long long coalesced;
+	unsigned long long rejected;
+	unsigned long long expired;
+	uint64_t warn_next;
+} exec = {
+	.done_fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.ran = PTHREAD_COND_INITIALIZER,
+};
+
+static void executor_signal(void)
+{
+	uint64_t done = 1;
+
+	if (write(exec.done_fd, &done, sizeof(done)) != sizeof(done))
+		belayd_err("Failed to signal the executor's event: %d\n", errno);
+}
+
+static void *executor_thread(void *arg)
+{
+	struct effect_job job;
+	uint64_t now, start, cost;
+	int ret;
+
+	pthread_mutex_lock(&exec.lock);
+
+	while (1) {
+		while (!exec.cnt && !exec.exiting)
+			pthread_cond_wait(&exec.work, &exec.lock);
+
+		/* when belayd exits, the queue is drained first */
+		if (!exec.cnt || exec.ret)
+			break;
+
+		job = exec.jobs[exec.head];
+		exec.head = (exec.head + 1) % exec.size;
+		exec.cnt--;
+
+		/* from now on, the rule tripping again queues the effect again */
+		job.eff->pending = false;
+
+		now = clock_mono_ms();
+		if (job.deadline && now > job.deadline) {
+			exec.expired++;
+			belayd_wrn("Dropping effect %s of rule %s, which waited %llu ms\n",
+				   job.eff->name, job.rule->name,
+				   (unsigned long long)(now - job.deadline + job.eff->timeout));
+			free(job.snap);
+			continue;
+		}
+
+		exec.started++;
+		exec.cur = job.eff;
+		exec.cur_rule = job.rule;
+		exec.cur_start = now;
+		exec.cur_warned = false;
+		pthread_mutex_unlock(&exec.lock);
+
+		belayd_dbg("Running effect %s\n", job.eff->name);
+		trace(effect__start, job.rule->name, job.eff->name);
+		start = job.eff->metrics || trace_enabled(effect__done) ? clock_real_ns() : 0;
+
+		if (job.snap)
+			ret = (*job.eff->fns->apply)(job.eff, job.snap);
+		else
+			ret = (*job.eff->fns->main)(job.eff, job.rule->causes);
+		free(job.snap);
+
+		cost = start ? clock_real_ns() - start : 0;
+		metrics_record(job.eff->metrics, ret ? -1 : 0, cost);
+		trace(effect__done, job.rule->name, job.eff->name, ret, cost);
+
+		pthread_mutex_lock(&exec.lock);
+		exec.cur = NULL;
+		exec.finished++;
+		pthread_cond_broadcast(&exec.ran);
+
+		if (ret) {
+			/* stop here, like the main loop did when it ran the effects itself */
+			exec.ret = ret;
+			exec.exiting = true;
+			executor_signal();
+			break;
+		}
+
+		/* the main loop frees the rule sets that waited for this job */
+		if (exec.retired)
+			executor_signal();
+	}
+
+	pthread_cond_broadcast(&exec.ran);
+	pthread_mutex_unlock(&exec.lock);
+
+	return NULL;
+}
+
+/*
+ * The executor stopped because an effect returned nonzero, or it finished
+ * a job that a retired rule set was waiting for.  The sets are freed here,
+ * on the main loop's thread, because the causes' exit() may remove their
+ * event sources.
+ */
+static int executor_done(int fd, uint32_t events, void *data)
+{
+	struct retired_set *done_sets = NULL, **prev, *retired;
+	uint64_t done;
+	int ret;
+
+	if (read(fd, &done, sizeof(done)) != sizeof(done))
+		return errno == EAGAIN ? 0 : -errno;
+
+	pthread_mutex_lock(&exec.lock);
+	ret = exec.ret;
+
+	prev = &exec.retired;
+	while ((retired = *prev)) {
+		if (retired->until > exec.finished) {
+			prev = &retired->next;
+			continue;
+		}
+
+		*prev = retired->next;
+		retired->next = done_sets;
+		done_sets = retired;
+	}
+	pthread_mutex_unlock(&exec.lock);
+
+	while ((retired = done_sets)) {
+		done_sets = retired->next;
+		rule_set_free(&retired->set);
+		free(retired);
+	}
+
+	return ret;
+}
+
+/*
+ * Queue an effect of a rule that tripped, along with its snapshot of the
+ * causes, if any, which is freed if the effect is not queued.  Returns 0
+ * if it was queued, 1 if it was already queued and the submission was
+ * coalesced with it, -EBUSY if the queue is full, and -ECANCELED if the
+ * executor is stopping.
+ */
+int executor_submit(struct effect * const eff, const struct rule * const rule, uint64_t now,
+		    void * const snap)
+{
+	struct effect_job *job;
+	int ret = 0;
+
+	pthread_mutex_lock(&exec.lock);
+
+	if (exec.exiting) {
+		ret = -ECANCELED;
+		goto out;
+	}
+
+	if (eff->pending) {
+		exec.coalesced++;
+		belayd_dbg("Effect %s of rule %s is already queued\n", eff->name, rule->name);
+		ret = 1;
+		goto out;
+	}
+
+	if (exec.cnt == exec.size) {
+		exec.rejected++;
+		if (now >= exec.warn_next) {
+			belayd_wrn("The effect queue is full, deferring effect %s of rule %s.  "
+				   "%llu effects deferred so far\n", eff->name, rule->name,
+				   exec.rejected);
+			exec.warn_next = now + EXECUTOR_WARN_PERIOD;
+		}
+		ret = -EBUSY;
+		goto out;
+	}
+
+	job = &exec.jobs[(exec.head + exec.cnt) % exec.size];
+	job->eff = eff;
+	job->rule = rule;
+	job->deadline = eff->timeout ? now + eff->timeout : 0;
+	job->snap = snap;
+
+	eff->pending = true;
+	exec.cnt++;
+	exec.queued++;
+	pthread_cond_signal(&exec.work);
+
+out:
+	pthread_mutex_unlock(&exec.lock);
+
+	if (ret)
+		free(snap);
+
+	return ret;
+}
+
+/* Warn once about an effect that has been running for longer than its timeout */
+void executor_watchdog(uint64_t now)
+{
+	pthread_mutex_lock(&exec.lock);
+
+	if (exec.cur && exec.cur->timeout && !exec.cur_warned &&
+	    now > exec.cur_start + exec.cur->timeout) {
+		belayd_wrn("Effect %s of rule %s has been running for %llu ms, past its %d ms "
+			   "timeout\n", exec.cur->name, exec.cur_rule->name,
+			   (unsigned long long)(now - exec.cur_start), exec.cur->timeout);
+		exec.cur_warned = true;
+	}
+
+	pthread_mutex_unlock(&exec.lock);
+}
+
+/* the rule of set that eff belongs to, whose effects are in config order */
+static const struct rule *effect_rule(const struct rule_set * const set,
+				      const struct effect * const eff)
+{
+	const struct rule *rule;
+	int lo = 0, hi = set->rule_cnt - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		rule = &set->rules[mid];
+
+		if (rule->effects + rule->effect_cnt <= eff)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return &set->rules[lo];
+}
+
+/*
+ * Move the queued jobs over to the new rule set of a reload, before the
+ * origins in set are cleared.  The jobs of the effects that were carried
+ * over follow them into set, in the same order, and those of the effects
+ * that were removed or replaced are dropped along with their rules.
+ */
+void executor_switch(struct rule_set * const set)
+{
+	struct effect_job *job;
+	struct effect *eff;
+	int i, cnt = 0;
+
+	for (i = 0; i < set->effect_cnt; i++) {
+		if (set->effects[i].origin)
+			set->effects[i].origin->successor = &set->effects[i];
+	}
+
+	pthread_mutex_lock(&exec.lock);
+
+	for (i = 0; i < exec.cnt; i++) {
+		job = &exec.jobs[(exec.head + i) % exec.size];
+		eff = job->eff->successor;
+		if (!eff) {
+			belayd_dbg("Dropping effect %s of rule %s, which was reloaded\n",
+				   job->eff->name, job->rule->name);
+			free(job->snap);
+			continue;
+		}
+
+		eff->pending = true;
+		job->eff = eff;
+		job->rule = effect_rule(set, eff);
+		exec.jobs[(exec.head + cnt++) % exec.size] = *job;
+	}
+	exec.cnt = cnt;
+
+	pthread_mutex_unlock(&exec.lock);
+}
+
+/*
+ * Free the rule set that a reload replaced, once the executor is done
+ * with it.  executor_switch() moved its queued jobs, so only the job that
+ * is running, if any, can still use it.  Rather than wait for that job,
+ * which may be slow or stuck, the set is kept until executor_done().
+ */
+void executor_retire(struct rule_set * const set)
+{
+	struct retired_set *retired;
+	unsigned long long until;
+
+	pthread_mutex_lock(&exec.lock);
+
+	if (!exec.cur) {
+		pthread_mutex_unlock(&exec.lock);
+		rule_set_free(set);
+		return;
+	}
+
+	retired = malloc(sizeof(struct retired_set));
+	if (!retired) {
+		/* there is no room to keep it, so wait for the job after all */
+		until = exec.started;
+		while (exec.finished < until)
+			pthread_cond_wait(&exec.ran, &exec.lock);
+
+		pthread_mutex_unlock(&exec.lock);
+		rule_set_free(set);
+		return;
+	}
+
+	retired->set = *set;
+	retired->until = exec.started;
+	retired->next = exec.retired;
+	exec.retired = retired;
+	memset(set, 0, sizeof(struct rule_set));
+
+	pthread_mutex_unlock(&exec.lock);
+}
+
+/* Start the executor with room for depth pending effects */
+int executor_init(int depth)
+{
+	int ret;
+
+	exec.jobs = calloc(depth, sizeof(struct effect_job));
+	if (!exec.jobs)
+		return -ENOMEM;
+
+	exec.size = depth;
+	exec.head = 0;
+	exec.cnt = 0;
+	exec.exiting = false;
+	exec.ret = 0;
+
+	exec.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (exec.done_fd < 0) {
+		belayd_err("Failed to create the executor eventfd: %d\n", errno);
+		return -errno;
+	}
+
+	ret = belayd_event_add(exec.done_fd, EPOLLIN, executor_done, NULL);
+	if (ret)
+		return ret;
+
+	ret = pthread_create(&exec.thread, NULL, executor_thread, NULL);
+	if (ret) {
+		belayd_err("Failed to start the effect executor: %d\n", ret);
+		return -ret;
+	}
+
+	exec.running = true;
+
+	return 0;
+}
+
+/*
+ * Stop the executor once it has run the effects that are still queued,
+ * so that the effects of the last tick are not lost.  Those that wait past
+ * their timeout are dropped as usual.  If an effect failed, the executor
+ * has already stopped, and the rest of the queue is discarded.
+ */
+void executor_exit(void)
+{
+	struct retired_set *retired;
+
+	pthread_mutex_lock(&exec.lock);
+	exec.exiting = true;
+	pthread_cond_broadcast(&exec.work);
+	pthread_mutex_unlock(&exec.lock);
+
+	if (exec.running) {
+		pthread_join(exec.thread, NULL);
+		exec.running = false;
+
+		if (exec.cnt)
+			belayd_info("Discarding %d queued effects\n", exec.cnt);
+		for (; exec.cnt; exec.cnt--, exec.head = (exec.head + 1) % exec.size)
+			free(exec.jobs[exec.head].snap);
+
+		belayd_info("Effects queued: %llu, coalesced: %llu, deferred: %llu, "
+			    "expired: %llu\n", exec.queued, exec.coalesced, exec.rejected,
+			    exec.expired);
+	}
+
+	/* the event source itself is freed by loop_exit() */
+	if (exec.done_fd >= 0)
+		close(exec.done_fd);
+	exec.done_fd = -1;
+
+	free(exec.jobs);
+	exec.jobs = NULL;
+	exec.size = 0;
+
+	while ((retired = exec.retired)) {
+		exec.retired = retired->next;
+		rule_set_free(&retired->set);
+		free(retired);
+	}
+}
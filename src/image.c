@@ -0,0 +1,856 @@
+// LICENSE TBD
+/**
+ * Compiled rule images for belayd
+ *
+ * An image holds a rule set as it was compiled from a JSON config.  It
+ * starts with a header, followed by fixed-size records for the rules,
+ * causes and effects, in config order, and then by a data section with
+ * the names, the canonical keys and the plugins' packed arguments.  The
+ * records refer to the data section by offset.  Everything after the
+ * header is covered by a checksum.
+ *
+ * An image is only used if it was compiled from the config file as it is
+ * now, which is checked by the config's size, mtime and inode, as is
+ * done for compiled Python modules.  Otherwise belayd loads the JSON.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <json-c/json.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "belayd-internal.h"
+#include "image.h"
+
+#define IMAGE_MAGIC	"BELAYDIM"
+/* bump whenever the layout of the image or of any plugin's packed arguments changes */
+#define IMAGE_VERSION	5
+
+#define IMAGE_ALIGN		8
+#define IMAGE_ROUND(size)	(((size) + IMAGE_ALIGN - 1) & ~((size_t)IMAGE_ALIGN - 1))
+
+/* the cause is not a duplicate of another one */
+#define IMAGE_NOT_SHARED	UINT32_MAX
+
+/* the object's arguments were packed by its plugin rather than stored as JSON */
+#define IMAGE_PACKED		0x1
+
+#define FNV_OFFSET	14695981039346656037ULL
+#define FNV_PRIME	1099511628211ULL
+
+struct image_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t size;			/* of the whole image */
+	uint64_t checksum;		/* of everything after the header */
+
+	/* the config that the image was compiled from */
+	uint64_t config_size;
+	int64_t config_mtime_sec;
+	int64_t config_mtime_nsec;
+	uint64_t config_ino;
+
+	uint32_t cause_plugin_cnt;
+	uint32_t effect_plugin_cnt;
+
+	uint32_t rule_cnt;
+	uint32_t cause_cnt;
+	uint32_t effect_cnt;
+	uint32_t reserved;
+
+	/* offsets of the sections from the start of the image */
+	uint64_t rules_off;
+	uint64_t causes_off;
+	uint64_t effects_off;
+	uint64_t data_off;
+	uint64_t data_size;
+};
+
+/* name, key and data are offsets into the data section */
+struct image_rule {
+	uint32_t name;
+	uint32_t key;
+	int32_t interval;
+	uint32_t reorder;
+	uint32_t cause_cnt;
+	uint32_t effect_cnt;
+	/* the nodes and then the masks of the compiled when expression, if any */
+	uint32_t when;
+	uint32_t when_len;
+};
+
+struct image_cause {
+	uint32_t plugin;
+	uint32_t flags;
+	uint32_t name;
+	uint32_t key;
+	int32_t interval;
+	uint32_t shared;		/* index of the shared instance */
+	uint32_t data;
+	uint32_t data_len;
+};
+
+struct image_effect {
+	uint32_t plugin;
+	uint32_t flags;
+	uint32_t name;
+	uint32_t key;
+	int32_t timeout;
+	int32_t cooldown;
+	int32_t dwell;
+	int32_t rate_cnt;
+	int32_t rate_period;
+	uint32_t reserved;
+	uint32_t data;
+	uint32_t data_len;
+};
+
+static_assert(sizeof(struct when_node) == IMAGE_ALIGN,
+	      "the masks of a packed when expression must stay aligned");
+static_assert(sizeof(struct image_header) % IMAGE_ALIGN == 0 &&
+	      sizeof(struct image_rule) % IMAGE_ALIGN == 0 &&
+	      sizeof(struct image_cause) % IMAGE_ALIGN == 0 &&
+	      sizeof(struct image_effect) % IMAGE_ALIGN == 0,
+	      "image records must keep the sections aligned");
+
+int image_buf_append(struct image_buf * const ib, const void * const data, size_t len)
+{
+	size_t size;
+	char *buf;
+
+	if (ib->len + len > ib->size) {
+		size = ib->size ? ib->size : 4096;
+		while (ib->len + len > size)
+			size *= 2;
+
+		buf = realloc(ib->buf, size);
+		if (!buf)
+			return -ENOMEM;
+
+		ib->buf = buf;
+		ib->size = size;
+	}
+
+	memcpy(ib->buf + ib->len, data, len);
+	ib->len += len;
+
+	return 0;
+}
+
+int image_buf_append_str(struct image_buf * const ib, const char * const str)
+{
+	return image_buf_append(ib, str, strlen(str) + 1);
+}
+
+static int image_buf_align(struct image_buf * const ib)
+{
+	static const char zeros[IMAGE_ALIGN];
+
+	return image_buf_append(ib, zeros, IMAGE_ROUND(ib->len) - ib->len);
+}
+
+const char *image_str(const void * const data, size_t len, size_t * const off)
+{
+	const char *str = (const char *)data + *off;
+	const char *nul;
+
+	if (*off >= len)
+		return NULL;
+
+	nul = memchr(str, '\0', len - *off);
+	if (!nul)
+		return NULL;
+
+	*off += nul - str + 1;
+
+	return str;
+}
+
+/* FNV-1a over 64-bit words.  len must be a multiple of IMAGE_ALIGN */
+static uint64_t image_hash(uint64_t hash, const void * const data, size_t len)
+{
+	const uint64_t *word = data;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(uint64_t); i++) {
+		hash ^= word[i];
+		hash *= FNV_PRIME;
+		hash ^= hash >> 32;
+	}
+
+	return hash;
+}
+
+/* add str to the data section, and store its offset in *off */
+static int data_str(struct image_buf * const data, const char * const str, uint32_t * const off)
+{
+	if (data->len > UINT32_MAX)
+		return -E2BIG;
+
+	*off = data->len;
+
+	return image_buf_append_str(data, str);
+}
+
+/* add the plugin's packed arguments to the data section */
+static int data_packed(struct image_buf * const data, const struct image_buf * const packed,
+		       uint32_t * const off, uint32_t * const len)
+{
+	int ret;
+
+	ret = image_buf_align(data);
+	if (ret)
+		return ret;
+
+	if (data->len > UINT32_MAX || packed->len > UINT32_MAX)
+		return -E2BIG;
+
+	*off = data->len;
+	*len = packed->len;
+
+	return image_buf_append(data, packed->buf, packed->len);
+}
+
+static int pack_cause(const struct rule_set * const set, const struct cause * const cse,
+		      struct image_cause * const rec, struct image_buf * const data,
+		      struct image_buf * const packed)
+{
+	int ret;
+
+	rec->plugin = cse->idx;
+	rec->interval = cse->interval;
+	rec->shared = cse->shared ? cse->shared - set->causes : IMAGE_NOT_SHARED;
+
+	ret = data_str(data, cse->name, &rec->name);
+	if (ret)
+		return ret;
+
+	ret = data_str(data, cse->key, &rec->key);
+	if (ret)
+		return ret;
+
+	/* a duplicate has nothing of its own to pack */
+	if (cse->shared || !cse->fns->pack)
+		return 0;
+
+	packed->len = 0;
+	ret = (*cse->fns->pack)(cse, packed);
+	if (ret)
+		return ret;
+
+	rec->flags |= IMAGE_PACKED;
+
+	return data_packed(data, packed, &rec->data, &rec->data_len);
+}
+
+static int pack_effect(const struct effect * const eff, struct image_effect * const rec,
+		       struct image_buf * const data, struct image_buf * const packed)
+{
+	int ret;
+
+	rec->plugin = eff->idx;
+	rec->timeout = eff->timeout;
+	rec->cooldown = eff->cooldown;
+	rec->dwell = eff->dwell;
+	rec->rate_cnt = eff->rate_cnt;
+	rec->rate_period = eff->rate_period;
+
+	ret = data_str(data, eff->name, &rec->name);
+	if (ret)
+		return ret;
+
+	ret = data_str(data, eff->key, &rec->key);
+	if (ret)
+		return ret;
+
+	if (!eff->fns->pack)
+		return 0;
+
+	packed->len = 0;
+	ret = (*eff->fns->pack)(eff, packed);
+	if (ret)
+		return ret;
+
+	rec->flags |= IMAGE_PACKED;
+
+	return data_packed(data, packed, &rec->data, &rec->data_len);
+}
+
+static int pack_when(const struct when * const when, struct image_rule * const rec,
+		     struct image_buf * const data, struct image_buf * const packed)
+{
+	int ret;
+
+	packed->len = 0;
+
+	ret = image_buf_append(packed, when->nodes, sizeof(struct when_node) * when->node_cnt);
+	if (ret)
+		return ret;
+
+	ret = image_buf_append(packed, when->masks,
+			       sizeof(uint64_t) * 2 * when->word_cnt * when->node_cnt);
+	if (ret)
+		return ret;
+
+	return data_packed(data, packed, &rec->when, &rec->when_len);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t bytes;
+
+	while (len) {
+		bytes = write(fd, buf, len);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf = (const char *)buf + bytes;
+		len -= bytes;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the rule set that was just compiled from the JSON config to the
+ * image.  The image is written to a temporary file that is then renamed,
+ * so that a running belayd never sees a partial image.
+ */
+int image_write(const struct belayd_opts * const opts)
+{
+	const struct rule_set *set = &opts->set;
+	struct image_buf data = { 0 }, packed = { 0 };
+	struct image_header *hdr;
+	struct image_effect *effects;
+	struct image_cause *causes;
+	struct image_rule *rules;
+	char tmp[FILENAME_MAX];
+	size_t fixed_len;
+	char *fixed = NULL;
+	struct stat st;
+	int ret = 0;
+	int fd = -1;
+	int i;
+
+	if (stat(opts->config, &st)) {
+		belayd_err("Failed to stat %s: %d\n", opts->config, errno);
+		return -errno;
+	}
+
+	fixed_len = sizeof(struct image_header) + set->rule_cnt * sizeof(struct image_rule) +
+		    set->cause_cnt * sizeof(struct image_cause) +
+		    set->effect_cnt * sizeof(struct image_effect);
+
+	fixed = calloc(1, fixed_len);
+	if (!fixed)
+		return -ENOMEM;
+
+	hdr = (struct image_header *)fixed;
+	rules = (struct image_rule *)(hdr + 1);
+	causes = (struct image_cause *)(rules + set->rule_cnt);
+	effects = (struct image_effect *)(causes + set->cause_cnt);
+
+	for (i = 0; i < set->rule_cnt; i++) {
+		rules[i].interval = set->rules[i].config_interval;
+		rules[i].reorder = set->rules[i].reorder;
+		rules[i].cause_cnt = set->rules[i].cause_cnt;
+		rules[i].effect_cnt = set->rules[i].effect_cnt;
+
+		ret = data_str(&data, set->rules[i].name, &rules[i].name);
+		if (ret)
+			goto out;
+
+		ret = data_str(&data, set->rules[i].key, &rules[i].key);
+		if (ret)
+			goto out;
+
+		if (set->rules[i].when) {
+			ret = pack_when(set->rules[i].when, &rules[i], &data, &packed);
+			if (ret)
+				goto out;
+		}
+	}
+
+	for (i = 0; i < set->cause_cnt; i++) {
+		ret = pack_cause(set, &set->causes[i], &causes[i], &data, &packed);
+		if (ret) {
+			belayd_err("Failed to pack cause %s: %d\n", set->causes[i].name, ret);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < set->effect_cnt; i++) {
+		ret = pack_effect(&set->effects[i], &effects[i], &data, &packed);
+		if (ret) {
+			belayd_err("Failed to pack effect %s: %d\n", set->effects[i].name, ret);
+			goto out;
+		}
+	}
+
+	ret = image_buf_align(&data);
+	if (ret)
+		goto out;
+
+	memcpy(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic));
+	hdr->version = IMAGE_VERSION;
+	hdr->header_size = sizeof(struct image_header);
+	hdr->size = fixed_len + data.len;
+
+	hdr->config_size = st.st_size;
+	hdr->config_mtime_sec = st.st_mtim.tv_sec;
+	hdr->config_mtime_nsec = st.st_mtim.tv_nsec;
+	hdr->config_ino = st.st_ino;
+
+	hdr->cause_plugin_cnt = CAUSE_CNT;
+	hdr->effect_plugin_cnt = EFFECT_CNT;
+	hdr->rule_cnt = set->rule_cnt;
+	hdr->cause_cnt = set->cause_cnt;
+	hdr->effect_cnt = set->effect_cnt;
+
+	hdr->rules_off = (char *)rules - fixed;
+	hdr->causes_off = (char *)causes - fixed;
+	hdr->effects_off = (char *)effects - fixed;
+	hdr->data_off = fixed_len;
+	hdr->data_size = data.len;
+
+	hdr->checksum = image_hash(FNV_OFFSET, hdr + 1, fixed_len - sizeof(struct image_header));
+	hdr->checksum = image_hash(hdr->checksum, data.buf, data.len);
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", opts->image) >= sizeof(tmp)) {
+		ret = -ENAMETOOLONG;
+		goto out;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		belayd_err("Failed to create %s: %d\n", tmp, errno);
+		ret = -errno;
+		goto out;
+	}
+
+	ret = write_all(fd, fixed, fixed_len);
+	if (!ret)
+		ret = write_all(fd, data.buf, data.len);
+	if (!ret && fsync(fd))
+		ret = -errno;
+
+	close(fd);
+
+	if (!ret && rename(tmp, opts->image))
+		ret = -errno;
+
+	if (ret) {
+		belayd_err("Failed to write %s: %d\n", opts->image, ret);
+		unlink(tmp);
+		goto out;
+	}
+
+	belayd_info("Compiled %d rules from %s into %s\n", set->rule_cnt, opts->config,
+		    opts->image);
+
+out:
+	free(fixed);
+	free(data.buf);
+	free(packed.buf);
+
+	return ret;
+}
+
+/* check that the image is intact, and that it was compiled from the config as it is now */
+static int image_check(const struct belayd_opts * const opts,
+		       const struct image_header * const hdr, size_t size)
+{
+	uint64_t checksum;
+	struct stat st;
+
+	if (size < sizeof(struct image_header) ||
+	    memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic)) != 0) {
+		belayd_wrn("%s is not a belayd image\n", opts->image);
+		return -EINVAL;
+	}
+
+	if (hdr->version != IMAGE_VERSION || hdr->header_size != sizeof(struct image_header) ||
+	    hdr->cause_plugin_cnt != CAUSE_CNT || hdr->effect_plugin_cnt != EFFECT_CNT) {
+		belayd_info("%s was compiled by another version of belayd\n", opts->image);
+		return -ESTALE;
+	}
+
+	if (stat(opts->config, &st) || st.st_size != hdr->config_size ||
+	    st.st_mtim.tv_sec != hdr->config_mtime_sec ||
+	    st.st_mtim.tv_nsec != hdr->config_mtime_nsec || st.st_ino != hdr->config_ino) {
+		belayd_info("%s has changed since %s was compiled\n", opts->config, opts->image);
+		return -ESTALE;
+	}
+
+	if (hdr->size != size ||
+	    hdr->rules_off + (uint64_t)hdr->rule_cnt * sizeof(struct image_rule) > size ||
+	    hdr->causes_off + (uint64_t)hdr->cause_cnt * sizeof(struct image_cause) > size ||
+	    hdr->effects_off + (uint64_t)hdr->effect_cnt * sizeof(struct image_effect) > size ||
+	    hdr->rules_off % IMAGE_ALIGN || hdr->causes_off % IMAGE_ALIGN ||
+	    hdr->effects_off % IMAGE_ALIGN || hdr->data_off % IMAGE_ALIGN ||
+	    hdr->data_off + hdr->data_size != size || hdr->data_size % IMAGE_ALIGN ||
+	    hdr->rule_cnt > INT_MAX || hdr->cause_cnt > INT_MAX || hdr->effect_cnt > INT_MAX) {
+		belayd_wrn("%s is truncated or corrupt\n", opts->image);
+		return -EINVAL;
+	}
+
+	checksum = image_hash(FNV_OFFSET, hdr + 1, size - sizeof(struct image_header));
+	if (checksum != hdr->checksum) {
+		belayd_wrn("%s is corrupt\n", opts->image);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+struct image {
+	const struct image_header *hdr;
+	const struct image_rule *rules;
+	const struct image_cause *causes;
+	const struct image_effect *effects;
+	const char *data;
+};
+
+/* copy the string at off in the data section into the rule set */
+static char *load_str(const struct image * const img, struct rule_set * const set, uint32_t off)
+{
+	size_t end = off;
+
+	if (!image_str(img->data, img->hdr->data_size, &end))
+		return NULL;
+
+	return arena_strdup(&set->arena, img->data + off);
+}
+
+/*
+ * Set up a cause from its packed arguments, or from its canonical JSON if
+ * its plugin does not pack them
+ */
+static int load_plugin(const struct image * const img, uint32_t flags, uint32_t data,
+		       uint32_t data_len, const char * const key, void * const obj,
+		       const struct cause * const cse, bool is_cause,
+		       struct arena * const arena)
+{
+	struct json_object *json;
+	int ret;
+
+	if (flags & IMAGE_PACKED) {
+		if ((uint64_t)data + data_len > img->hdr->data_size)
+			return -EINVAL;
+
+		if (is_cause)
+			return (*((struct cause *)obj)->fns->unpack)(obj, img->data + data,
+								     data_len, arena);
+
+		return (*((struct effect *)obj)->fns->unpack)(obj, img->data + data, data_len,
+							      cse, arena);
+	}
+
+	json = json_tokener_parse(key);
+	if (!json)
+		return -EINVAL;
+
+	if (is_cause)
+		ret = (*((struct cause *)obj)->fns->init)(obj, json, arena);
+	else
+		ret = (*((struct effect *)obj)->fns->init)(obj, json, cse, arena);
+
+	json_object_put(json);
+
+	return ret;
+}
+
+static int load_cause(const struct image * const img, struct rule_set * const set,
+		      struct rule * const rule)
+{
+	const struct image_cause *rec = &img->causes[set->cause_cnt];
+	struct cause *cse = &set->causes[set->cause_cnt];
+	int ret;
+
+	memset(cse, 0, sizeof(struct cause));
+
+	cse->name = load_str(img, set, rec->name);
+	cse->key = load_str(img, set, rec->key);
+	if (!cse->name || !cse->key)
+		return -EINVAL;
+
+	/* the plugin tables may not change without a new IMAGE_VERSION, but be sure */
+	if (rec->plugin >= CAUSE_CNT || strcmp(cse->name, cause_names[rec->plugin]) != 0)
+		return -EINVAL;
+
+	cse->idx = rec->plugin;
+	cse->fns = &cause_fns[rec->plugin];
+	cse->interval = rec->interval;
+
+	if (rec->shared != IMAGE_NOT_SHARED) {
+		if (rec->shared >= set->cause_cnt || set->causes[rec->shared].shared)
+			return -EINVAL;
+
+		cse->shared = &set->causes[rec->shared];
+		cse->data = cse->shared->data;
+	} else {
+		if ((rec->flags & IMAGE_PACKED) && !cse->fns->unpack)
+			return -EINVAL;
+
+		ret = load_plugin(img, rec->flags, rec->data, rec->data_len, cse->key, cse,
+				  NULL, true, set->data);
+		if (ret)
+			return ret;
+
+		cse->home = arena_get(set->data);
+	}
+
+	if (rule->cause_cnt)
+		cse[-1].next = cse;
+	rule->cause_cnt++;
+	set->cause_cnt++;
+
+	return 0;
+}
+
+static int load_effect(const struct image * const img, struct rule_set * const set,
+		       struct rule * const rule)
+{
+	const struct image_effect *rec = &img->effects[set->effect_cnt];
+	struct effect *eff = &set->effects[set->effect_cnt];
+	int ret;
+
+	memset(eff, 0, sizeof(struct effect));
+
+	eff->name = load_str(img, set, rec->name);
+	eff->key = load_str(img, set, rec->key);
+	if (!eff->name || !eff->key)
+		return -EINVAL;
+
+	if (rec->plugin >= EFFECT_CNT || strcmp(eff->name, effect_names[rec->plugin]) != 0)
+		return -EINVAL;
+
+	eff->idx = rec->plugin;
+	eff->fns = &effect_fns[rec->plugin];
+	eff->timeout = rec->timeout;
+	eff->cooldown = rec->cooldown;
+	eff->dwell = rec->dwell;
+	eff->rate_cnt = rec->rate_cnt;
+	eff->rate_period = rec->rate_period;
+
+	if ((rec->flags & IMAGE_PACKED) && !eff->fns->unpack)
+		return -EINVAL;
+
+	ret = load_plugin(img, rec->flags, rec->data, rec->data_len, eff->key, eff,
+			  rule->causes, false, set->data);
+	if (ret)
+		return ret;
+
+	eff->home = arena_get(set->data);
+
+	rule->effect_cnt++;
+	set->effect_cnt++;
+
+	return 0;
+}
+
+/*
+ * Check that every node's subtree, and the causes in its masks, lie within
+ * the compiled when expression and the rule, so that evaluating it cannot
+ * stray outside of them
+ */
+static bool when_valid(const struct when_node * const nodes, uint32_t node_cnt,
+		       const uint64_t * const masks, int word_cnt, int cause_cnt)
+{
+	uint64_t tail = cause_cnt % 64 ? ~0ULL << (cause_cnt % 64) : 0;
+	uint32_t i, j, child, end;
+
+	if (!node_cnt || nodes[0].size != node_cnt)
+		return false;
+
+	for (i = 0; i < node_cnt; i++) {
+		if (nodes[i].op >= WHEN_OP_CNT || nodes[i].size < 1 ||
+		    nodes[i].size > node_cnt - i)
+			return false;
+
+		end = i + nodes[i].size;
+		for (j = 0, child = i + 1; j < nodes[i].child_cnt; j++) {
+			if (child >= end || nodes[child].size > end - child)
+				return false;
+			child += nodes[child].size;
+		}
+
+		if (child != end)
+			return false;
+
+		if ((masks[(2 * i + 1) * word_cnt - 1] | masks[(2 * i + 2) * word_cnt - 1]) & tail)
+			return false;
+	}
+
+	return true;
+}
+
+static int load_when(const struct image * const img, struct rule_set * const set,
+		     struct rule * const rule, const struct image_rule * const rec)
+{
+	const struct when_node *nodes;
+	const uint64_t *masks;
+	size_t node_len;
+	uint32_t node_cnt;
+	int word_cnt;
+
+	if ((uint64_t)rec->when + rec->when_len > img->hdr->data_size || !rule->cause_cnt ||
+	    rec->when % IMAGE_ALIGN)
+		return -EINVAL;
+
+	word_cnt = (rule->cause_cnt + 63) / 64;
+	node_len = sizeof(struct when_node) + sizeof(uint64_t) * 2 * word_cnt;
+	if (rec->when_len % node_len)
+		return -EINVAL;
+
+	node_cnt = rec->when_len / node_len;
+	nodes = (const struct when_node *)(img->data + rec->when);
+	masks = (const uint64_t *)(nodes + node_cnt);
+
+	/* the nodes are 8 bytes each, so the masks are aligned too */
+	if (!when_valid(nodes, node_cnt, masks, word_cnt, rule->cause_cnt))
+		return -EINVAL;
+
+	return rule_when_alloc(set, rule, nodes, node_cnt, masks);
+}
+
+static int load_rule(const struct belayd_opts * const opts, const struct image * const img,
+		     struct rule_set * const set)
+{
+	const struct image_rule *rec = &img->rules[set->rule_cnt];
+	struct rule *rule = &set->rules[set->rule_cnt];
+	uint32_t i;
+	int ret;
+
+	if (rec->cause_cnt > img->hdr->cause_cnt - set->cause_cnt ||
+	    rec->effect_cnt > img->hdr->effect_cnt - set->effect_cnt)
+		return -EINVAL;
+
+	memset(rule, 0, sizeof(struct rule));
+
+	rule->name = load_str(img, set, rec->name);
+	rule->key = load_str(img, set, rec->key);
+	if (!rule->name || !rule->key)
+		return -EINVAL;
+
+	rule->config_interval = rec->interval;
+	rule->reorder = rec->reorder;
+
+	rule->causes = rec->cause_cnt ? &set->causes[set->cause_cnt] : NULL;
+	for (i = 0; i < rec->cause_cnt; i++) {
+		ret = load_cause(img, set, rule);
+		if (ret)
+			return ret;
+	}
+
+	if (rec->when_len) {
+		ret = load_when(img, set, rule, rec);
+		if (ret)
+			return ret;
+	}
+
+	rule_schedule(opts, rule);
+
+	rule->effects = &set->effects[set->effect_cnt];
+	for (i = 0; i < rec->effect_cnt; i++) {
+		ret = load_effect(img, set, rule);
+		if (ret)
+			return ret;
+	}
+
+	set->rule_cnt++;
+
+	return 0;
+}
+
+/*
+ * Load the rule set from the compiled image, if there is one and it is up
+ * to date.  -ENOENT and -ESTALE mean that the JSON config should be used.
+ */
+int image_load(const struct belayd_opts * const opts, struct rule_set * const set)
+{
+	struct image img = { 0 };
+	struct stat st;
+	void *map;
+	int ret;
+	int fd;
+
+	fd = open(opts->image, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		belayd_dbg("No compiled image at %s\n", opts->image);
+		return -errno;
+	}
+
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	if (st.st_size < sizeof(struct image_header)) {
+		belayd_wrn("%s is not a belayd image\n", opts->image);
+		close(fd);
+		return -EINVAL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		belayd_err("Failed to mmap %s: %d\n", opts->image, errno);
+		return -errno;
+	}
+
+	img.hdr = map;
+	ret = image_check(opts, img.hdr, st.st_size);
+	if (ret)
+		goto out;
+
+	img.rules = (const struct image_rule *)((const char *)map + img.hdr->rules_off);
+	img.causes = (const struct image_cause *)((const char *)map + img.hdr->causes_off);
+	img.effects = (const struct image_effect *)((const char *)map + img.hdr->effects_off);
+	img.data = (const char *)map + img.hdr->data_off;
+
+	ret = rule_set_alloc(set, img.hdr->rule_cnt, img.hdr->cause_cnt, img.hdr->effect_cnt);
+	if (ret)
+		goto error;
+
+	while (set->rule_cnt < img.hdr->rule_cnt) {
+		ret = load_rule(opts, &img, set);
+		if (ret) {
+			belayd_err("Failed to load rule #%d from %s: %d\n", set->rule_cnt,
+				   opts->image, ret);
+			goto error;
+		}
+	}
+
+	if (set->cause_cnt != img.hdr->cause_cnt || set->effect_cnt != img.hdr->effect_cnt) {
+		belayd_wrn("%s is corrupt\n", opts->image);
+		ret = -EINVAL;
+		goto error;
+	}
+
+	belayd_info("Loaded %d rules from %s\n", set->rule_cnt, opts->image);
+	goto out;
+
+error:
+	rule_set_free(set);
+out:
+	munmap(map, st.st_size);
+
+	return ret;
+}
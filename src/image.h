@@ -0,0 +1,37 @@
+// LICENSE TBD
+/**
+ * belayd compiled rule image header file
+ *
+ * "belayd --compile" writes the compiled rule set to a binary image that
+ * the daemon loads at startup in place of the JSON config, as long as the
+ * config has not changed since.  Plugins may implement pack() and
+ * unpack() to store their parsed arguments in the image, so that loading
+ * it skips JSON entirely.  Causes and effects of other plugins are
+ * initialized from the canonical JSON that is stored in the image.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#ifndef __BELAYD_IMAGE_H
+#define __BELAYD_IMAGE_H
+
+#include <stddef.h>
+
+/* a growing buffer that pack() appends the plugin's arguments to */
+struct image_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+int image_buf_append(struct image_buf * const ib, const void * const data, size_t len);
+int image_buf_append_str(struct image_buf * const ib, const char * const str);
+
+/*
+ * Return the NUL-terminated string at *off within data, and advance *off
+ * past it, or return NULL if there is none
+ */
+const char *image_str(const void * const data, size_t len, size_t * const off);
+
+#endif /* __BELAYD_IMAGE_H */
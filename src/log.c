@@ -2,31 +2,105 @@
 /**
  * Logging for belayd
  *
+ * Once log_init() has run, belayd_log() does not write the message itself.
+ * It formats it into a slot of a preallocated ring and returns, and a
+ * flusher thread writes the ring to the log location.  Logging therefore
+ * never blocks the thread that logs, even if e.g. journald stops reading
+ * syslog.  If the ring is full, the message is dropped and counted, and the
+ * flusher reports the count once it catches up.
+ *
+ * Any thread may log.  A logging thread claims the next slot with a
+ * compare-and-swap on the ring's head and then publishes it by setting the
+ * slot's sequence number, as in Dmitry Vyukov's bounded queue, so no locks
+ * are taken.  The flusher is the only consumer.  It sleeps on a semaphore
+ * while the ring is empty, and a logging thread only posts it if it is
+ * asleep.
+ *
+ * The arguments are formatted by the thread that logs rather than by the
+ * flusher.  A string that a message refers to may be freed as soon as
+ * belayd_log() returns, so only the formatted text can be deferred.
+ *
  * Copyright (c) 2023 Oracle and/or its affiliates.
  * Author: Tom Hromatka <tom.hromatka@oracle.com>
  */
 
+#include <semaphore.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
+#include <errno.h>
 
 #include "belayd-internal.h"
 
+/* must be a power of two */
+#define LOG_RING_SIZE	1024
+#define LOG_MSG_MAX	256
+#define LOG_CACHE_LINE	64
+
+static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0,
+	      "LOG_RING_SIZE must be a power of two");
+
 int log_level = LOG_ERR;
 enum log_location log_loc = LOG_LOC_STDERR;
 
-void belayd_log(int priority, const char *fmt, ...)
+struct log_slot {
+	/*
+	 * the slot is free for the message at position seq, and holds the
+	 * message at position seq - 1 once it has been published
+	 */
+	uint64_t seq;
+	int priority;
+	char msg[LOG_MSG_MAX];
+};
+
+static struct {
+	struct log_slot *slots;
+	pthread_t thread;
+	bool running;
+	bool exiting;
+	sem_t wake;
+
+	/* the next position to claim, shared by the logging threads */
+	uint64_t head __attribute__((aligned(LOG_CACHE_LINE)));
+	unsigned long long dropped;
+
+	/* the next position to write, only used by the flusher */
+	uint64_t tail __attribute__((aligned(LOG_CACHE_LINE)));
+	unsigned long long reported;
+	bool sleeping;
+} ring;
+
+static void log_write(int priority, const char * const msg)
 {
-	va_list ap;
-	va_start(ap, fmt);
+	switch(log_loc) {
+		case LOG_LOC_SYSLOG:
+			syslog(priority, "%s", msg);
+			break;
+		case LOG_LOC_STDOUT:
+			fputs(msg, stdout);
+			break;
+		case LOG_LOC_STDERR:
+			fputs(msg, stderr);
+			break;
+		default:
+			assert(true);
+			break;
+	}
+}
 
+static void log_vwrite(int priority, const char *fmt, va_list ap)
+{
 	switch(log_loc) {
 		case LOG_LOC_SYSLOG:
 			vsyslog(priority, fmt, ap);
 			break;
 		case LOG_LOC_STDOUT:
-			vfprintf(stderr, fmt, ap);
+			vfprintf(stdout, fmt, ap);
 			break;
 		case LOG_LOC_STDERR:
 			vfprintf(stderr, fmt, ap);
@@ -35,5 +109,191 @@ void belayd_log(int priority, const char *fmt, ...)
 			assert(true);
 			break;
 	}
+}
+
+/* the slot of the next message to write, if it has been published */
+static struct log_slot *log_ready(void)
+{
+	struct log_slot *slot = &ring.slots[ring.tail & (LOG_RING_SIZE - 1)];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != ring.tail + 1)
+		return NULL;
+
+	return slot;
+}
+
+/* write every published message to the log location */
+static void log_drain(void)
+{
+	unsigned long long dropped;
+	struct log_slot *slot;
+	bool wrote = false;
+
+	while ((slot = log_ready())) {
+		log_write(slot->priority, slot->msg);
+		wrote = true;
+
+		/* hand the slot back for the message one lap later */
+		__atomic_store_n(&slot->seq, ring.tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+		ring.tail++;
+	}
+
+	dropped = __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+	if (dropped != ring.reported) {
+		if (log_level >= LOG_WARNING) {
+			char msg[LOG_MSG_MAX];
+
+			snprintf(msg, sizeof(msg), "Warning: The log was full, dropped %llu "
+				 "messages\n", dropped - ring.reported);
+			log_write(LOG_WARNING, msg);
+			wrote = true;
+		}
+		ring.reported = dropped;
+	}
+
+	if (wrote && log_loc != LOG_LOC_SYSLOG)
+		fflush(log_loc == LOG_LOC_STDOUT ? stdout : stderr);
+}
+
+static void *log_thread(void *arg)
+{
+	while (1) {
+		log_drain();
+
+		if (__atomic_load_n(&ring.exiting, __ATOMIC_ACQUIRE))
+			break;
+
+		/*
+		 * announce that we are going to sleep, then look once more, so
+		 * that a message that was published in between is not missed
+		 */
+		__atomic_store_n(&ring.sleeping, true, __ATOMIC_SEQ_CST);
+		if (log_ready() && __atomic_exchange_n(&ring.sleeping, false, __ATOMIC_SEQ_CST))
+			continue;
+
+		/* a logging thread has posted, or is about to post */
+		while (sem_wait(&ring.wake) && errno == EINTR)
+			;
+	}
+
+	return NULL;
+}
+
+void belayd_log(int priority, const char *fmt, ...)
+{
+	struct log_slot *slot;
+	uint64_t pos, seq;
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+
+	if (!__atomic_load_n(&ring.running, __ATOMIC_ACQUIRE)) {
+		log_vwrite(priority, fmt, ap);
+		goto out;
+	}
+
+	pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+	while (1) {
+		slot = &ring.slots[pos & (LOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == pos) {
+			/* on failure, pos is updated to the current head */
+			if (__atomic_compare_exchange_n(&ring.head, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (seq < pos) {
+			/* the flusher has not written the message from one lap ago */
+			__atomic_fetch_add(&ring.dropped, 1, __ATOMIC_RELAXED);
+			goto out;
+		} else {
+			/* another thread claimed this slot first */
+			pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->priority = priority;
+	len = vsnprintf(slot->msg, LOG_MSG_MAX, fmt, ap);
+	if (len >= LOG_MSG_MAX)
+		slot->msg[LOG_MSG_MAX - 2] = '\n';
+
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(&ring.sleeping, false, __ATOMIC_SEQ_CST))
+		sem_post(&ring.wake);
+
+out:
 	va_end(ap);
 }
+
+/*
+ * Start the flusher.  Until then, and after log_exit(), belayd_log() writes
+ * each message itself.
+ */
+int log_init(void)
+{
+	sigset_t mask, old;
+	int ret, i;
+
+	ring.slots = calloc(LOG_RING_SIZE, sizeof(struct log_slot));
+	if (!ring.slots)
+		return -ENOMEM;
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		ring.slots[i].seq = i;
+
+	ring.head = 0;
+	ring.tail = 0;
+	ring.exiting = false;
+	ring.sleeping = false;
+
+	if (sem_init(&ring.wake, 0, 0)) {
+		ret = -errno;
+		goto err;
+	}
+
+	/* the signals belong to the main loop's signalfd */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	ret = pthread_create(&ring.thread, NULL, log_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		sem_destroy(&ring.wake);
+		ret = -ret;
+		goto err;
+	}
+
+	__atomic_store_n(&ring.running, true, __ATOMIC_RELEASE);
+
+	return 0;
+
+err:
+	free(ring.slots);
+	ring.slots = NULL;
+	belayd_err("Failed to start the log flusher: %d\n", ret);
+
+	return ret;
+}
+
+/*
+ * Write the messages that are still in the ring and stop the flusher.  No
+ * other thread may log by now.
+ */
+void log_exit(void)
+{
+	if (!__atomic_load_n(&ring.running, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&ring.exiting, true, __ATOMIC_RELEASE);
+	sem_post(&ring.wake);
+	pthread_join(ring.thread, NULL);
+
+	__atomic_store_n(&ring.running, false, __ATOMIC_RELEASE);
+	log_drain();
+
+	sem_destroy(&ring.wake);
+	free(ring.slots);
+	ring.slots = NULL;
+}
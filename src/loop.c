@@ -0,0 +1,1276 @@
+// LICENSE TBD
+/**
+ * Event loop for belayd
+ *
+ * belayd sleeps in epoll_wait() until one of its event sources is ready.
+ * Each rule is scheduled on a timer wheel at its own interval, and a
+ * timerfd is armed with the absolute CLOCK_MONOTONIC time of the earliest
+ * pending rule.  Rules are rescheduled relative to their previous deadline,
+ * so the time spent evaluating them does not push out the following
+ * tick.  A rule whose causes cannot trip before a known time (see the
+ * cause horizon() hook) sleeps straight through to that time, and a
+ * CLOCK_REALTIME timerfd reschedules everything if the wall clock is
+ * stepped underneath those predictions.  Other file descriptors (signals,
+ * cause-specific event sources, etc.) can be added to the same epoll set
+ * via belayd_event_add().
+ *
+ * Each tick runs in two phases.  The causes of every rule that is due are
+ * evaluated first, in parallel if there is a worker pool (see pool.c).  A
+ * cause that is shared by several rules is claimed by whichever thread
+ * gets to it first, and the others wait for its result.  The effects of
+ * the rules that tripped are then handed to the effect executor (see
+ * executor.c) on the main thread, in config order, so their order does not
+ * depend on how the causes were scheduled.  Only the rules whose effects
+ * were deferred by a full queue go ahead of the others.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+
+#include "belayd-internal.h"
+#include "defines.h"
+#include "trace.h"
+
+#define LOOP_MAX_EVENTS 16
+#define NSEC_PER_MSEC 1000000L
+
+/* how often, in rule runs, a rule's causes are re-sorted */
+#define REORDER_PERIOD 32
+/* weight of the newest sample in the cause statistics' moving averages */
+#define STATS_WEIGHT 0.125
+
+/* cause->seq while a thread is evaluating the cause */
+#define CAUSE_SEQ_BUSY UINT64_MAX
+
+/* a rule that is due in this tick, and the result of its causes */
+struct rule_eval {
+	struct rule *rule;
+	int ret;
+	uint64_t wake;
+};
+
+struct event_src {
+	int fd;
+	event_fn fn;
+	void *data;
+
+	struct event_src *next;
+};
+
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static int signal_fd = -1;
+static int clock_fd = -1;
+static struct event_src *event_srcs;
+
+/* each rule is scheduled on the wheel at its own interval */
+static struct wheel wheel;
+
+/* CLOCK_MONOTONIC milliseconds when the timer last fired */
+static uint64_t loop_now;
+
+/* snapshot shared by every cause that is evaluated during this tick */
+static struct cause_ctx tick_ctx;
+
+/* the rules that are due in this tick, see rule_timer_fn() */
+static struct rule_eval *due;
+static int due_cnt;
+static int due_size;
+
+static unsigned int loop_cnt;
+
+/* only valid while loop_run() is running */
+static struct belayd_opts *loop_opts;
+
+/*
+ * bumped whenever an event source is removed, e.g. by a reload, so that the
+ * main loop does not dispatch stale events from the same epoll_wait()
+ */
+static unsigned int event_gen;
+
+int belayd_event_add(int fd, uint32_t events, event_fn fn, void *data)
+{
+	struct event_src *src;
+	struct epoll_event ev;
+	int ret;
+
+	src = malloc(sizeof(struct event_src));
+	if (!src)
+		return -ENOMEM;
+
+	memset(src, 0, sizeof(struct event_src));
+	src->fd = fd;
+	src->fn = fn;
+	src->data = data;
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = events;
+	ev.data.ptr = src;
+
+	ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	if (ret) {
+		ret = -errno;
+		belayd_err("Failed to add fd %d to the epoll set: %d\n", fd, errno);
+		free(src);
+		return ret;
+	}
+
+	src->next = event_srcs;
+	event_srcs = src;
+
+	return 0;
+}
+
+int belayd_event_del(int fd)
+{
+	struct event_src *src, **prev;
+
+	prev = &event_srcs;
+	src = event_srcs;
+
+	while (src) {
+		if (src->fd == fd) {
+			*prev = src->next;
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			free(src);
+			event_gen++;
+			return 0;
+		}
+
+		prev = &src->next;
+		src = src->next;
+	}
+
+	return -ENOENT;
+}
+
+/* the instance that actually holds the cause's data, schedule and result */
+static struct cause *cause_instance(struct cause * const cse)
+{
+	return cse->shared ? cse->shared : cse;
+}
+
+static void update_stats(struct cause * const cse, uint64_t cost)
+{
+	double is_false = cse->result > 0 ? 0.0 : 1.0;
+
+	if (cse->evals++ == 0) {
+		cse->cost = cost;
+		cse->false_rate = is_false;
+		return;
+	}
+
+	cse->cost += STATS_WEIGHT * ((double)cost - cse->cost);
+	cse->false_rate += STATS_WEIGHT * (is_false - cse->false_rate);
+}
+
+/*
+ * The expected cost of an AND chain is minimized by evaluating the causes
+ * in increasing order of cost / P(false).  Causes that have never been
+ * measured sort first so that they get measured.
+ */
+static double cause_rank(struct cause * const rule_cse)
+{
+	const struct cause *cse = cause_instance(rule_cse);
+
+	if (!cse->evals)
+		return 0.0;
+
+	/* a cause that never stops the chain belongs at the end */
+	if (cse->false_rate < 1e-6)
+		return cse->cost * 1e6;
+
+	return cse->cost / cse->false_rate;
+}
+
+static void reorder_causes(struct rule * const rule)
+{
+	struct cause *sorted = NULL, *cse, *next, **pos;
+	bool changed = false;
+	double rank;
+
+	/* insertion sort.  rules rarely have more than a handful of causes */
+	for (cse = rule->eval_causes; cse; cse = next) {
+		next = cse->eval_next;
+		rank = cause_rank(cse);
+
+		pos = &sorted;
+		while (*pos && cause_rank(*pos) <= rank)
+			pos = &(*pos)->eval_next;
+
+		if (*pos)
+			changed = true;
+
+		cse->eval_next = *pos;
+		*pos = cse;
+	}
+
+	rule->eval_causes = sorted;
+
+	if (changed && log_level >= LOG_DEBUG) {
+		belayd_dbg("Rule %s evaluation order:\n", rule->name);
+		for (cse = rule->eval_causes; cse; cse = cse->eval_next)
+			belayd_dbg("\t%s: %.0f ns, %.2f false\n", cse->name,
+				   cause_instance(cse)->cost, cause_instance(cse)->false_rate);
+	}
+}
+
+/*
+ * Take exclusive ownership of a cause instance, unless it has already run
+ * during this tick.  An instance is shared by every rule that contains the
+ * same cause, and those rules may be evaluated on different threads at the
+ * same time.  Returns the instance's previous seq, which must be passed
+ * to release_cause(), or seq if it has already run.
+ */
+static uint64_t claim_cause(struct cause * const cse, uint64_t seq)
+{
+	uint64_t cur;
+
+	while (1) {
+		cur = __atomic_load_n(&cse->seq, __ATOMIC_ACQUIRE);
+		if (cur == seq)
+			return cur;
+
+		if (cur != CAUSE_SEQ_BUSY &&
+		    __atomic_compare_exchange_n(&cse->seq, &cur, CAUSE_SEQ_BUSY, false,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return cur;
+
+		/* another thread is evaluating it.  it may block, so do not spin */
+		sched_yield();
+	}
+}
+
+static void release_cause(struct cause * const cse, uint64_t seq)
+{
+	__atomic_store_n(&cse->seq, seq, __ATOMIC_RELEASE);
+}
+
+/*
+ * Evaluate a cause, or reuse its previous result if it is not due yet or
+ * if an identical cause in another rule has already been evaluated during
+ * this tick.  *next_run is set to the time at which the cause is next due.
+ */
+static int run_cause(struct cause * const rule_cse, const struct rule * const rule,
+		     struct cause_ctx * const ctx, uint64_t now, uint64_t * const next_run)
+{
+	struct cause *cse = cause_instance(rule_cse);
+	uint64_t horizon, start, cost, seq;
+	int time_since_last_run;
+	bool timed;
+	int result;
+
+	seq = claim_cause(cse, ctx->seq);
+	if (seq == ctx->seq) {
+		belayd_dbg("%s already ran this tick, reusing result %d\n", cse->name,
+			   cse->result);
+		*next_run = cse->next_run;
+		return cse->result;
+	}
+
+	if (cse->last_run && now < cse->next_run) {
+		belayd_dbg("%s is not due, reusing result %d\n", cse->name, cse->result);
+		*next_run = cse->next_run;
+		result = cse->result;
+
+		/* a rule with a later deadline in this tick may find it due */
+		release_cause(cse, seq);
+		return result;
+	}
+
+	if (cse->last_run)
+		time_since_last_run = (int)(now - cse->last_run);
+	else
+		time_since_last_run = cse->interval ? cse->interval : rule->interval;
+
+	trace(cause__start, rule->name, cse->name);
+
+	timed = rule->reorder || rule_cse->metrics || trace_enabled(cause__done);
+	if (timed)
+		start = clock_real_ns();
+
+	cse->result = (*cse->fns->main)(cse, ctx, time_since_last_run);
+
+	cost = 0;
+	if (timed) {
+		cost = clock_real_ns() - start;
+		if (rule->reorder)
+			update_stats(cse, cost);
+		metrics_record(rule_cse->metrics, cse->result, cost);
+	}
+
+	trace(cause__done, rule->name, cse->name, cse->result, cost);
+
+	cse->last_run = now;
+	cse->next_run = now + cse->interval;
+
+	if (cse->result >= 0 && cse->fns->horizon) {
+		horizon = (*cse->fns->horizon)(cse, ctx);
+		if (horizon > cse->next_run)
+			cse->next_run = horizon;
+	}
+
+	*next_run = cse->next_run;
+	result = cse->result;
+	release_cause(cse, ctx->seq);
+
+	return result;
+}
+
+/*
+ * Evaluate cause idx of a rule with a when expression, and record its result
+ * in the rule's bit vectors.  *wake is lowered to the time at which the
+ * cause is next due.  Returns 1 if the cause tripped, 0 if it did not, or
+ * a negative error.
+ */
+static int when_cause(struct rule * const rule, int idx, struct cause_ctx * const ctx,
+		      uint64_t * const wake)
+{
+	struct when *when = rule->when;
+	uint64_t bit = 1ULL << (idx % 64);
+	struct cause *cse = &rule->causes[idx];
+	uint64_t next_run;
+	int ret;
+
+	ret = run_cause(cse, rule, ctx, rule->timer.expires, &next_run);
+	if (ret < 0) {
+		belayd_dbg("%s raised error %d\n", cse->name, ret);
+		return ret;
+	}
+
+	belayd_dbg("%s %s\n", cse->name, ret ? "tripped" : "did not trip");
+
+	if (next_run < *wake)
+		*wake = next_run;
+
+	when->known[idx / 64] |= bit;
+	if (ret)
+		when->bits[idx / 64] |= bit;
+
+	return ret > 0;
+}
+
+/*
+ * Resolve node idx of a rule's when expression.  The causes among its
+ * operands that have already been evaluated are checked a word at a time,
+ * and may decide the node without evaluating anything else.  Otherwise the
+ * remaining causes and then the child nodes are evaluated until one of
+ * them decides it, i.e. is false for an AND or true for an OR.
+ */
+static int when_node(struct rule * const rule, int idx, struct cause_ctx * const ctx,
+		     uint64_t * const wake)
+{
+	const struct when *when = rule->when;
+	const struct when_node *node = &when->nodes[idx];
+	const uint64_t *mask = &when->masks[2 * idx * when->word_cnt];
+	const uint64_t *neg = mask + when->word_cnt;
+	bool decider = node->op == WHEN_OR;
+	uint64_t pending, want;
+	int i, bit, child, ret;
+
+	/* the value of an operand that decides the node, in each bit */
+	want = decider ? ~0ULL : 0;
+
+	for (i = 0; i < when->word_cnt; i++) {
+		if (when->known[i] & mask[i] & ~(when->bits[i] ^ neg[i] ^ want))
+			goto decided;
+	}
+
+	for (i = 0; i < when->word_cnt; i++) {
+		pending = mask[i] & ~when->known[i];
+
+		while (pending) {
+			bit = __builtin_ctzll(pending);
+			pending &= pending - 1;
+
+			ret = when_cause(rule, i * 64 + bit, ctx, wake);
+			if (ret < 0)
+				return ret;
+
+			if ((ret ^ ((neg[i] >> bit) & 1)) == decider)
+				goto decided;
+		}
+	}
+
+	for (i = 0, child = idx + 1; i < node->child_cnt; i++, child += when->nodes[child].size) {
+		ret = when_node(rule, child, ctx, wake);
+		if (ret < 0)
+			return ret;
+
+		if (ret == decider)
+			goto decided;
+	}
+
+	/* every operand of the AND held, or none of the OR did */
+	return !decider ^ node->negate;
+
+decided:
+	return decider ^ node->negate;
+}
+
+/*
+ * Evaluate a rule's when expression.  A cause that is referenced more than
+ * once is only evaluated once.  If the rule did not trip, *wake is set to
+ * the time at which the first of the causes that were evaluated is next
+ * due, because the expression cannot change before then.
+ */
+static int eval_when(struct rule * const rule, struct cause_ctx * const ctx,
+		     uint64_t * const wake)
+{
+	struct when *when = rule->when;
+	int ret;
+
+	memset(when->known, 0, sizeof(uint64_t) * when->word_cnt);
+	memset(when->bits, 0, sizeof(uint64_t) * when->word_cnt);
+
+	*wake = CAUSE_HORIZON_NEVER;
+
+	ret = when_node(rule, 0, ctx, wake);
+	if (ret != 0)
+		*wake = 0;
+
+	return ret;
+}
+
+/*
+ * Evaluate a windowed cause that was skipped because its rule's result was
+ * already known, so that its window misses no reading.  Its result cannot
+ * change the rule's, but *wake is lowered to the time at which it is next
+ * due.
+ */
+static int sample_window(struct cause * const cse, const struct rule * const rule,
+			 struct cause_ctx * const ctx, uint64_t * const wake)
+{
+	uint64_t next_run;
+	int ret;
+
+	if (!cause_instance(cse)->windowed)
+		return 0;
+
+	ret = run_cause(cse, rule, ctx, rule->timer.expires, &next_run);
+	if (ret < 0) {
+		belayd_dbg("%s raised error %d\n", cse->name, ret);
+		return ret;
+	}
+
+	belayd_dbg("Sampled the window of %s\n", cse->name);
+
+	if (next_run < *wake)
+		*wake = next_run;
+
+	return 0;
+}
+
+/*
+ * Evaluate a rule's causes.  This may run on any thread of the pool.  If
+ * the rule did not trip, e->wake is set to the time before which it cannot
+ * trip, i.e. the time at which the cause that did not trip is next due, or
+ * a windowed cause that was skipped is, if that is sooner.
+ */
+static void eval_rule(int idx, struct cause_ctx * const ctx, void *data)
+{
+	struct rule_eval *e = &due[idx];
+	struct rule *rule = e->rule;
+	uint64_t next_run, start = 0, cost = 0;
+	int i, err = 0, ret = 0;
+	struct cause *cse;
+
+	belayd_dbg("Running rule %s\n", rule->name);
+	trace(rule__start, rule->name);
+	if (rule->metrics || trace_enabled(rule__done))
+		start = clock_real_ns();
+
+	cse = rule->eval_causes;
+	e->wake = 0;
+
+	if (rule->when) {
+		ret = eval_when(rule, ctx, &e->wake);
+		if (ret >= 0) {
+			belayd_dbg("The when expression of rule %s %s\n", rule->name,
+				   ret ? "holds" : "does not hold");
+		}
+		cse = NULL;
+	}
+
+	while (cse) {
+		ret = run_cause(cse, rule, ctx, rule->timer.expires, &next_run);
+		if (ret < 0) {
+			belayd_dbg("%s raised error %d\n", cse->name, ret);
+			break;
+		} else if (ret == 0) {
+			/*
+			 * this cause did not trip.  skip all the remaining causes
+			 * in this rule because the effect will not be invoked.
+			 */
+			belayd_dbg("%s did not trip\n", cse->name);
+			e->wake = next_run;
+			break;
+		} else if (ret > 0) {
+			/*
+			 * This cause tripped.  We don't need to do anything.
+			 * If all of the causes in this rule are triggered,
+			 * then the "ret > 0" will flow down to the logic
+			 * below and the effects will be run.
+			 */
+			belayd_dbg("%s tripped\n", cse->name);
+		}
+
+		cse = cse->eval_next;
+	}
+
+	if (ret >= 0 && rule->when) {
+		for (i = 0; i < rule->cause_cnt && !err; i++) {
+			if (!(rule->when->known[i / 64] & (1ULL << (i % 64))))
+				err = sample_window(&rule->causes[i], rule, ctx, &e->wake);
+		}
+	} else if (ret >= 0 && cse) {
+		for (cse = cse->eval_next; cse && !err; cse = cse->eval_next)
+			err = sample_window(cse, rule, ctx, &e->wake);
+	}
+
+	if (err)
+		ret = err;
+
+	e->ret = ret;
+
+	if (start) {
+		cost = clock_real_ns() - start;
+		metrics_record(rule->metrics, ret, cost);
+	}
+	trace(rule__done, rule->name, ret, cost);
+}
+
+/*
+ * Whether the effect must be skipped, even though its rule tripped, because
+ * of its cooldown, dwell or max_rate.  max_rate is a token bucket that holds
+ * up to rate_cnt runs and refills at rate_cnt per rate_period.  Its credit
+ * is kept in units of 1/rate_period of a run, so that it refills by
+ * rate_cnt every millisecond without any division.
+ */
+static bool effect_limited(struct effect * const eff, const struct rule * const rule)
+{
+	uint64_t full, elapsed;
+
+	if (eff->dwell && loop_now - rule->tripped < (uint64_t)eff->dwell) {
+		belayd_dbg("Effect %s of rule %s is waiting for the rule to hold for %d ms\n",
+			   eff->name, rule->name, eff->dwell);
+		return true;
+	}
+
+	if (eff->cooldown && eff->last_run &&
+	    loop_now - eff->last_run < (uint64_t)eff->cooldown) {
+		belayd_dbg("Effect %s of rule %s is cooling down\n", eff->name, rule->name);
+		return true;
+	}
+
+	if (!eff->rate_cnt)
+		return false;
+
+	full = (uint64_t)eff->rate_cnt * eff->rate_period;
+	elapsed = loop_now - eff->refilled;
+
+	/* the bucket starts out full, and fills up within one period */
+	if (!eff->refilled || elapsed >= (uint64_t)eff->rate_period)
+		eff->credit = full;
+	else if (eff->credit + elapsed * eff->rate_cnt < full)
+		eff->credit += elapsed * eff->rate_cnt;
+	else
+		eff->credit = full;
+	eff->refilled = loop_now;
+
+	if (eff->credit < (uint64_t)eff->rate_period) {
+		belayd_dbg("Effect %s of rule %s exceeded %d runs per %d ms\n", eff->name,
+			   rule->name, eff->rate_cnt, eff->rate_period);
+		return true;
+	}
+
+	return false;
+}
+
+/* Charge a run of the effect against its limits */
+static void effect_ran(struct effect * const eff)
+{
+	eff->last_run = loop_now;
+
+	if (eff->rate_cnt)
+		eff->credit -= eff->rate_period;
+}
+
+/*
+ * Queue the effects of a rule whose causes have been evaluated for the
+ * executor.  Those that read the causes are queued with a snapshot of them.
+ */
+static int run_rule(struct rule_eval * const e)
+{
+	struct rule *rule = e->rule;
+	struct effect *eff;
+	uint64_t deferred;
+	void *snap;
+	int ret, i;
+
+	if (e->ret < 0)
+		return e->ret;
+
+	if (rule->reorder && ++rule->runs % REORDER_PERIOD == 0)
+		reorder_causes(rule);
+
+	deferred = rule->deferred;
+	rule->deferred = 0;
+
+	if (e->ret > 0) {
+		if (!rule->tripped)
+			rule->tripped = loop_now;
+
+		/*
+		 * The cause(s) for this rule were triggered, invoke the
+		 * effect(s)
+		 */
+		for (i = 0, eff = rule->effects; i < rule->effect_cnt; i++, eff++) {
+			if (effect_limited(eff, rule))
+				continue;
+
+			if (replay_enabled()) {
+				replay_effect(rule, eff);
+				effect_ran(eff);
+				continue;
+			}
+
+			snap = NULL;
+			if (eff->fns->snapshot) {
+				snap = (*eff->fns->snapshot)(eff, rule->causes);
+				if (!snap) {
+					belayd_err("Failed to snapshot the causes of rule %s for "
+						   "effect %s\n", rule->name, eff->name);
+					continue;
+				}
+			}
+
+			/*
+			 * a full queue has already been reported.  Only an
+			 * effect that was queued now counts as having run.
+			 */
+			ret = executor_submit(eff, rule, loop_now, snap);
+			if (ret == -EBUSY)
+				rule->deferred = deferred ? deferred : tick_ctx.seq;
+			else if (ret == 0)
+				effect_ran(eff);
+		}
+	} else {
+		rule->tripped = 0;
+	}
+
+	return 0;
+}
+
+static void schedule_rule(struct rule * const rule, uint64_t wake)
+{
+	struct wheel_timer *timer = &rule->timer;
+	uint64_t missed;
+
+	/*
+	 * The next deadline is relative to the previous deadline rather than
+	 * to the current time, so the evaluation time does not accumulate as
+	 * drift.  If the evaluation overran one or more intervals, skip the
+	 * missed ticks rather than running them back to back.
+	 */
+	timer->expires += rule->interval;
+
+	if (timer->expires <= loop_now) {
+		missed = (loop_now - timer->expires) / rule->interval + 1;
+		belayd_wrn("Rule %s overran, skipping %llu tick(s)\n", rule->name,
+			   (unsigned long long)missed);
+		timer->expires += missed * rule->interval;
+	}
+
+	/*
+	 * The rule cannot trip before the cause that stopped it is due again,
+	 * so sleep straight through to that time.  If that cause is event
+	 * driven, the rule sleeps until belayd_cause_notify() wakes it.
+	 */
+	if (wake == CAUSE_HORIZON_NEVER) {
+		belayd_dbg("Rule %s is waiting for an event\n", rule->name);
+		return;
+	} else if (wake > timer->expires) {
+		belayd_dbg("Rule %s cannot trip for %llu ms\n", rule->name,
+			   (unsigned long long)(wake - loop_now));
+		timer->expires = wake;
+	}
+
+	wheel_add(&wheel, timer);
+}
+
+/* Collect a rule that is due.  It is run once the wheel has been advanced */
+static int rule_timer_fn(struct wheel_timer * const timer, void *data)
+{
+	struct rule_eval *tmp;
+	int size;
+
+	if (due_cnt == due_size) {
+		size = due_size ? due_size * 2 : 64;
+
+		tmp = realloc(due, sizeof(struct rule_eval) * size);
+		if (!tmp)
+			return -ENOMEM;
+
+		due = tmp;
+		due_size = size;
+	}
+
+	due[due_cnt].rule = (struct rule *)data;
+	due_cnt++;
+
+	return 0;
+}
+
+/* rules live in one array, so their addresses are in config order */
+static int rule_eval_cmp(const void *a, const void *b)
+{
+	const struct rule *ra = ((const struct rule_eval *)a)->rule;
+	const struct rule *rb = ((const struct rule_eval *)b)->rule;
+
+	return (ra > rb) - (ra < rb);
+}
+
+/* rules that are not deferred sort last */
+static int rule_eval_deferred_cmp(const void *a, const void *b)
+{
+	uint64_t da = ((const struct rule_eval *)a)->rule->deferred - 1;
+	uint64_t db = ((const struct rule_eval *)b)->rule->deferred - 1;
+
+	if (da != db)
+		return (da > db) - (da < db);
+
+	return rule_eval_cmp(a, b);
+}
+
+static int run_due(void)
+{
+	int ret, i;
+
+	/* the wheel usually fires the rules in config order already */
+	for (i = 1; i < due_cnt; i++) {
+		if (due[i - 1].rule > due[i].rule) {
+			qsort(due, due_cnt, sizeof(struct rule_eval), rule_eval_cmp);
+			break;
+		}
+	}
+
+	pool_run(due_cnt, eval_rule, NULL, &tick_ctx);
+
+	/*
+	 * The rules whose effects were deferred by a full queue go first, the
+	 * longest deferred first, so that a busy executor does not starve the
+	 * rules at the end of the config
+	 */
+	for (i = 0; i < due_cnt; i++) {
+		if (due[i].rule->deferred) {
+			qsort(due, due_cnt, sizeof(struct rule_eval), rule_eval_deferred_cmp);
+			break;
+		}
+	}
+
+	for (i = 0; i < due_cnt; i++) {
+		ret = run_rule(&due[i]);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < due_cnt; i++)
+		schedule_rule(due[i].rule, due[i].wake);
+
+	return 0;
+}
+
+static int arm_timer(void);
+
+/*
+ * Called by event-driven causes when their result may have changed.  The
+ * cause is identified by its private data, which unlike the cause itself
+ * is carried over by a reload.  The cause is re-evaluated, and every rule
+ * that uses it is run, as soon as the event handlers return.
+ */
+int belayd_cause_notify(const void * const data)
+{
+	struct rule_set *set;
+	struct cause *cse;
+	struct rule *rule;
+	uint64_t now;
+	int i, j;
+
+	if (!loop_opts)
+		return 0;
+
+	set = &loop_opts->set;
+	now = clock_mono_ms();
+
+	for (i = 0; i < set->rule_cnt; i++) {
+		rule = &set->rules[i];
+		for (j = 0; j < rule->cause_cnt; j++) {
+			cse = cause_instance(&rule->causes[j]);
+			if (cse->data != data)
+				continue;
+
+			cse->next_run = 0;
+
+			if (!wheel_pending(&rule->timer) || rule->timer.expires > now)
+				wheel_mod(&wheel, &rule->timer, now);
+			break;
+		}
+	}
+
+	return arm_timer();
+}
+
+static int arm_timer(void)
+{
+	struct itimerspec its;
+	uint64_t expires;
+	int ret;
+
+	/* the rules are driven by loop_tick() rather than by the timer */
+	if (timer_fd < 0)
+		return 0;
+
+	memset(&its, 0, sizeof(struct itimerspec));
+
+	/* an all-zero it_value disarms the timer when there is nothing to run */
+	expires = wheel_next_expiry(&wheel);
+	if (expires != WHEEL_NEVER) {
+		its.it_value.tv_sec = expires / 1000;
+		its.it_value.tv_nsec = (expires % 1000) * NSEC_PER_MSEC;
+	}
+
+	ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	if (ret) {
+		belayd_err("Failed to arm the timer: %d\n", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Run every rule that is due at now, in CLOCK_MONOTONIC milliseconds.  The
+ * main loop calls this whenever the timer fires.  Callers that drive the
+ * rules themselves, e.g. the benchmarks, call it after loop_start().
+ */
+int loop_tick(struct belayd_opts * const opts, uint64_t now)
+{
+	int ret;
+
+	loop_now = now;
+	cause_ctx_init(&tick_ctx, loop_now);
+	due_cnt = 0;
+
+	ret = wheel_advance(&wheel, loop_now);
+	if (ret)
+		return ret;
+
+	ret = run_due();
+	if (ret)
+		return ret;
+
+	executor_watchdog(loop_now);
+
+	if (due_cnt) {
+		loop_cnt++;
+		if (opts->max_loops > 0 && loop_cnt > opts->max_loops)
+			return -ETIME;
+	}
+
+	return 0;
+}
+
+/* the time at which the next rule is due, or WHEEL_NEVER */
+uint64_t loop_next(void)
+{
+	return wheel_next_expiry(&wheel);
+}
+
+static int timer_handler(int fd, uint32_t events, void *data)
+{
+	struct belayd_opts *opts = (struct belayd_opts *)data;
+	uint64_t expirations;
+	ssize_t bytes;
+	int ret;
+
+	bytes = read(fd, &expirations, sizeof(expirations));
+	if (bytes != sizeof(expirations)) {
+		if (errno == EAGAIN)
+			return 0;
+
+		belayd_err("Failed to read the timer: %d\n", errno);
+		return -errno;
+	}
+
+	ret = loop_tick(opts, clock_mono_ms());
+	if (ret)
+		return ret;
+
+	return arm_timer();
+}
+
+/*
+ * Arm a CLOCK_REALTIME timer that never expires.  Its only purpose is to
+ * be cancelled, and thus wake belayd, when the wall clock is set.
+ */
+static int arm_clock_watch(void)
+{
+	struct itimerspec its;
+	int ret;
+
+	memset(&its, 0, sizeof(struct itimerspec));
+	its.it_value.tv_sec = INT32_MAX;
+
+	ret = timerfd_settime(clock_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+			      &its, NULL);
+	if (ret) {
+		belayd_err("Failed to arm the clock watch: %d\n", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int clock_handler(int fd, uint32_t events, void *data)
+{
+	struct belayd_opts *opts = (struct belayd_opts *)data;
+	struct rule_set *set = &opts->set;
+	uint64_t expirations;
+	struct cause *cse;
+	ssize_t bytes;
+	int ret, i;
+
+	bytes = read(fd, &expirations, sizeof(expirations));
+	if (bytes == sizeof(expirations) || errno == EAGAIN)
+		return 0;
+
+	if (errno != ECANCELED) {
+		belayd_err("Failed to read the clock watch: %d\n", errno);
+		return -errno;
+	}
+
+	/*
+	 * The wall clock was stepped, so the horizons of the time-based
+	 * causes are stale.  Forget them and re-evaluate every rule now.
+	 */
+	belayd_info("Wall clock changed, re-evaluating all rules\n");
+	loop_now = clock_mono_ms();
+
+	for (i = 0; i < set->cause_cnt; i++) {
+		cse = &set->causes[i];
+		if (!cse->shared && cse->fns->horizon)
+			cse->next_run = cse->last_run + cse->interval;
+	}
+
+	for (i = 0; i < set->rule_cnt; i++)
+		wheel_mod(&wheel, &set->rules[i].timer, loop_now);
+
+	ret = arm_clock_watch();
+	if (ret)
+		return ret;
+
+	return arm_timer();
+}
+
+static int signal_handler(int fd, uint32_t events, void *data)
+{
+	struct signalfd_siginfo info;
+	ssize_t bytes;
+
+	bytes = read(fd, &info, sizeof(info));
+	if (bytes != sizeof(info)) {
+		if (errno == EAGAIN)
+			return 0;
+
+		belayd_err("Failed to read the signalfd: %d\n", errno);
+		return -errno;
+	}
+
+	if (info.ssi_signo == SIGHUP) {
+		belayd_info("Received SIGHUP, reloading %s\n", loop_opts->config);
+		return reload_request();
+	}
+
+	belayd_info("Received signal %d, exiting\n", info.ssi_signo);
+
+	/* a positive return value stops the loop without an error */
+	return 1;
+}
+
+static int setup_signals(void)
+{
+	sigset_t mask;
+	int ret;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+
+	ret = sigprocmask(SIG_BLOCK, &mask, NULL);
+	if (ret) {
+		belayd_err("Failed to block signals: %d\n", errno);
+		return -errno;
+	}
+
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		belayd_err("Failed to create the signalfd: %d\n", errno);
+		return -errno;
+	}
+
+	return belayd_event_add(signal_fd, EPOLLIN, signal_handler, NULL);
+}
+
+int loop_init(void)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		belayd_err("Failed to create the epoll instance: %d\n", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Start the threads, and schedule every rule to be evaluated at now, and
+ * every rule->interval thereafter.  loop_init() must have been called.
+ */
+int loop_start(struct belayd_opts * const opts, uint64_t now)
+{
+	struct rule *rule;
+	int ret, i;
+
+	ret = pool_init(opts->workers);
+	if (ret)
+		return ret;
+
+	ret = executor_init(opts->queue_depth);
+	if (ret)
+		return ret;
+
+	ret = metrics_init(opts);
+	if (ret)
+		return ret;
+
+	loop_opts = opts;
+	loop_now = now;
+	wheel_init(&wheel, loop_now);
+	loop_cnt = 0;
+
+	for (i = 0; i < opts->set.rule_cnt; i++) {
+		rule = &opts->set.rules[i];
+		rule->timer.expires = loop_now;
+		rule->timer.fn = rule_timer_fn;
+		rule->timer.data = rule;
+		wheel_add(&wheel, &rule->timer);
+	}
+
+	return 0;
+}
+
+int loop_run(struct belayd_opts * const opts)
+{
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	struct event_src *src;
+	unsigned int gen;
+	int ret, cnt, i;
+
+	ret = setup_signals();
+	if (ret)
+		return ret;
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		belayd_err("Failed to create the timerfd: %d\n", errno);
+		return -errno;
+	}
+
+	ret = belayd_event_add(timer_fd, EPOLLIN, timer_handler, opts);
+	if (ret)
+		return ret;
+
+	clock_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (clock_fd < 0) {
+		belayd_err("Failed to create the clock watch: %d\n", errno);
+		return -errno;
+	}
+
+	ret = belayd_event_add(clock_fd, EPOLLIN, clock_handler, opts);
+	if (ret)
+		return ret;
+
+	ret = arm_clock_watch();
+	if (ret)
+		return ret;
+
+	/* evaluate every rule immediately */
+	ret = loop_start(opts, clock_mono_ms());
+	if (ret)
+		return ret;
+
+	ret = arm_timer();
+	if (ret)
+		return ret;
+
+	while (1) {
+		cnt = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), -1);
+		if (cnt < 0) {
+			if (errno == EINTR)
+				continue;
+
+			belayd_err("epoll_wait failed: %d\n", errno);
+			return -errno;
+		}
+
+		gen = event_gen;
+
+		/*
+		 * the remaining events are level-triggered, so if a handler
+		 * removed an event source they are picked up by the next
+		 * epoll_wait()
+		 */
+		for (i = 0; i < cnt && gen == event_gen; i++) {
+			src = (struct event_src *)events[i].data.ptr;
+
+			ret = (*src->fn)(src->fd, events[i].events, src->data);
+			if (ret > 0)
+				return 0;
+			else if (ret < 0)
+				return ret;
+		}
+	}
+}
+
+/*
+ * Carry the schedule of an unchanged rule over from the running config.  The
+ * rule's causes are identical, so their evaluation order maps index for
+ * index.
+ */
+static void adopt_schedule(struct rule * const rule, const struct rule * const origin)
+{
+	const struct cause *cse;
+	struct cause **next;
+
+	rule->runs = origin->runs;
+	rule->tripped = origin->tripped;
+
+	next = &rule->eval_causes;
+	for (cse = origin->eval_causes; cse; cse = cse->eval_next) {
+		*next = &rule->causes[cse - origin->causes];
+		next = &(*next)->eval_next;
+	}
+	*next = NULL;
+
+	if (wheel_pending(&origin->timer))
+		rule->timer.expires = origin->timer.expires;
+	else
+		/* the rule is waiting for an event */
+		rule->timer.expires = WHEEL_NEVER;
+}
+
+/*
+ * Switch the main loop over to a new rule set, which takes ownership of
+ * set, and free the old one once the executor is done with it.  This runs
+ * between ticks, so every tick sees either the old or the new config in
+ * full.  Unchanged rules keep their schedule, and all other rules are
+ * evaluated right away.
+ */
+int loop_switch(struct belayd_opts * const opts, struct rule_set * const set)
+{
+	struct rule_set old = opts->set;
+	struct rule *rule;
+	int i;
+
+	loop_now = clock_mono_ms();
+	metrics_attach(set);
+
+	for (i = 0; i < set->rule_cnt; i++) {
+		rule = &set->rules[i];
+		rule->timer.expires = loop_now;
+		rule->timer.fn = rule_timer_fn;
+		rule->timer.data = rule;
+
+		if (rule->origin) {
+			adopt_schedule(rule, rule->origin);
+			metrics_adopt(rule, rule->origin);
+		}
+
+		if (rule->timer.expires != WHEEL_NEVER)
+			wheel_add(&wheel, &rule->timer);
+
+		rule->origin = NULL;
+	}
+
+	for (i = 0; i < old.rule_cnt; i++) {
+		if (wheel_pending(&old.rules[i].timer))
+			wheel_del(&wheel, &old.rules[i].timer);
+	}
+
+	executor_switch(set);
+
+	opts->set = *set;
+	memset(set, 0, sizeof(struct rule_set));
+
+	for (i = 0; i < opts->set.cause_cnt; i++)
+		opts->set.causes[i].origin = NULL;
+	for (i = 0; i < opts->set.effect_cnt; i++)
+		opts->set.effects[i].origin = NULL;
+
+	executor_retire(&old);
+
+	belayd_info("Switched to a config with %d rules\n", opts->set.rule_cnt);
+
+	return arm_timer();
+}
+
+void loop_exit(void)
+{
+	struct event_src *src, *src_next;
+
+	loop_opts = NULL;
+
+	pool_exit();
+
+	free(due);
+	due = NULL;
+	due_cnt = 0;
+	due_size = 0;
+
+	src = event_srcs;
+	while (src) {
+		src_next = src->next;
+		free(src);
+		src = src_next;
+	}
+	event_srcs = NULL;
+
+	if (timer_fd >= 0)
+		close(timer_fd);
+	if (signal_fd >= 0)
+		close(signal_fd);
+	if (clock_fd >= 0)
+		close(clock_fd);
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+
+	timer_fd = -1;
+	signal_fd = -1;
+	clock_fd = -1;
+	epoll_fd = -1;
+}
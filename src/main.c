@@ -27,36 +27,61 @@ static_assert(ARRAY_SIZE(log_files) == LOG_LOC_CNT,
 	      "log_files[] must be the same length as LOG_LOC_CNT");
 
 static const char * const default_config_file = "/etc/belayd.json";
-static const int default_interval = 5; /* seconds */
+static const char * const default_image_suffix = ".img";
+static const int default_interval = 5000; /* milliseconds */
+static const int default_workers = 1;
+static const int default_queue_depth = 256;
 
 static void usage(FILE *fd)
 {
 	fprintf(fd, "\nbelayd: a daemon for managing and prioritizing resources\n\n");
 	fprintf(fd, "Usage: belayd [options]\n\n");
 	fprintf(fd, "Optional arguments:\n");
+	fprintf(fd, "  -C --compile              Compile the configuration into its image "
+						 "and exit\n");
 	fprintf(fd, "  -c --config=CONFIG        Configuration file (default: %s)\n",
 		default_config_file);
+	fprintf(fd, "  -F --metrics-file=FILE    Write Prometheus metrics to FILE every "
+						 "10 seconds\n");
 	fprintf(fd, "  -h --help                 Show this help message\n");
-	fprintf(fd, "  -i --interval=INTERVAL    Polling interval in seconds (default: %d)\n",
-		default_interval);
+	fprintf(fd, "  -I --image=IMAGE          Compiled configuration image "
+						 "(default: CONFIG%s)\n", default_image_suffix);
+	fprintf(fd, "  -i --interval=INTERVAL    Polling interval, e.g. 5, 0.5, or 100ms "
+						 "(default: %ds)\n", default_interval / 1000);
 	fprintf(fd, "  -L --loglocation=LOCATION Location to write belayd logs\n");
 	fprintf(fd, "  -l --loglevel=LEVEL       Log level. See <syslog.h>\n");
+	fprintf(fd, "  -M --metrics-socket=PATH  Serve Prometheus metrics on a Unix "
+						 "socket\n");
 	fprintf(fd, "  -m --maxloops=COUNT       Maximum number of loops to run."
 						 "Useful for testing\n");
+	fprintf(fd, "  -q --queue=DEPTH          Maximum number of effects waiting to run "
+						 "(default: %d)\n", default_queue_depth);
+	fprintf(fd, "  -R --replay=FILE          Run the rules against the samples in FILE "
+						 "and print\n");
+	fprintf(fd, "                            their effects rather than running them\n");
+	fprintf(fd, "  -w --workers=COUNT        Threads that evaluate causes, 0 for one "
+						 "per CPU (default: %d)\n", default_workers);
 }
 
 int parse_opts(int argc, char *argv[], struct belayd_opts * const opts)
 {
 	struct option long_options[] = {
 		{"help",		no_argument, NULL, 'h'},
+		{"compile",		no_argument, NULL, 'C'},
 		{"config",	  required_argument, NULL, 'c'},
+		{"image",	  required_argument, NULL, 'I'},
 		{"interval",	  required_argument, NULL, 'i'},
 		{"loglocation",	  required_argument, NULL, 'L'},
 		{"loglevel",	  required_argument, NULL, 'l'},
 		{"maxloops",	  required_argument, NULL, 'm'},
+		{"metrics-file",  required_argument, NULL, 'F'},
+		{"metrics-socket", required_argument, NULL, 'M'},
+		{"queue",	  required_argument, NULL, 'q'},
+		{"replay",	  required_argument, NULL, 'R'},
+		{"workers",	  required_argument, NULL, 'w'},
 		{NULL, 0, NULL, 0}
 	};
-	const char *short_options = "c:hi:L:l:m:";
+	const char *short_options = "Cc:F:hI:i:L:l:M:m:q:R:w:";
 
 	int ret = 0, i;
 	int tmp_level;
@@ -66,6 +91,8 @@ int parse_opts(int argc, char *argv[], struct belayd_opts * const opts)
 	strncpy(opts->config, default_config_file, FILENAME_MAX - 1);
 	opts->interval = default_interval;
 	opts->max_loops = 0;
+	opts->workers = default_workers;
+	opts->queue_depth = default_queue_depth;
 
 	while (1) {
 		int c;
@@ -75,16 +102,26 @@ int parse_opts(int argc, char *argv[], struct belayd_opts * const opts)
 			break;
 
 		switch (c) {
+		case 'C':
+			opts->compile = true;
+			break;
 		case 'c':
 			strncpy(opts->config, optarg, FILENAME_MAX - 1);
 			opts->config[FILENAME_MAX - 1] = '\0';
 			break;
+		case 'F':
+			strncpy(opts->metrics_file, optarg, FILENAME_MAX - 1);
+			opts->metrics_file[FILENAME_MAX - 1] = '\0';
+			break;
 		case 'h':
 			usage(stdout);
 			exit(0);
+		case 'I':
+			strncpy(opts->image, optarg, FILENAME_MAX - 1);
+			opts->image[FILENAME_MAX - 1] = '\0';
+			break;
 		case 'i':
-			opts->interval = atoi(optarg);
-			if (opts->interval < 1) {
+			if (parse_duration_str(optarg, &opts->interval)) {
 				belayd_err("Invalid interval: %s\n", optarg);
 				ret = 1;
 				goto err;
@@ -117,6 +154,10 @@ int parse_opts(int argc, char *argv[], struct belayd_opts * const opts)
 				goto err;
 			}
 			break;
+		case 'M':
+			strncpy(opts->metrics_socket, optarg, FILENAME_MAX - 1);
+			opts->metrics_socket[FILENAME_MAX - 1] = '\0';
+			break;
 		case 'm':
 			opts->max_loops = atoi(optarg);
 			if (opts->max_loops < 1) {
@@ -125,6 +166,26 @@ int parse_opts(int argc, char *argv[], struct belayd_opts * const opts)
 				goto err;
 			}
 			break;
+		case 'q':
+			opts->queue_depth = atoi(optarg);
+			if (opts->queue_depth < 1) {
+				belayd_err("Invalid queue depth: %s\n", optarg);
+				ret = 1;
+				goto err;
+			}
+			break;
+		case 'R':
+			strncpy(opts->replay, optarg, FILENAME_MAX - 1);
+			opts->replay[FILENAME_MAX - 1] = '\0';
+			break;
+		case 'w':
+			opts->workers = atoi(optarg);
+			if (opts->workers < 0) {
+				belayd_err("Invalid workers: %s\n", optarg);
+				ret = 1;
+				goto err;
+			}
+			break;
 
 		default:
 			ret = 1;
@@ -132,6 +193,13 @@ int parse_opts(int argc, char *argv[], struct belayd_opts * const opts)
 		}
 	}
 
+	if (!opts->image[0] &&
+	    snprintf(opts->image, sizeof(opts->image), "%s%s", opts->config,
+		     default_image_suffix) >= sizeof(opts->image)) {
+		belayd_err("Config file name is too long: %s\n", opts->config);
+		ret = 1;
+	}
+
 err:
 	if (ret)
 		usage(stderr);
@@ -141,131 +209,60 @@ err:
 
 void cleanup(struct belayd_opts *opts)
 {
-	struct rule *rule, *rule_next;
-	struct effect *eff, *eff_next;
-	struct cause *cse, *cse_next;
-
-	rule = opts->rules;
-
-	while (rule) {
-		belayd_dbg("Cleaning up rule %s\n", rule->name);
-		rule_next = rule->next;
-
-		cse = rule->causes;
-		while (cse) {
-			cse_next = cse->next;
-			belayd_dbg("Cleaning up cause %s\n", cse->name);
-			(*cse->fns->exit)(cse);
-			if (cse->name)
-				free(cse->name);
-
-			free(cse);
-			cse = cse_next;
-		}
-
-		eff = rule->effects;
-		while (eff) {
-			eff_next = eff->next;
-			belayd_dbg("Cleaning up effect %s\n", eff->name);
-			(*eff->fns->exit)(eff);
-			if (eff->name)
-				free(eff->name);
-
-			free(eff);
-			eff = eff_next;
-		}
-
-		if (rule->name)
-			free(rule->name);
-
-		free(rule);
-		rule = rule_next;
-	}
+	rule_set_free(&opts->set);
 }
 
 int main(int argc, char *argv[])
 {
 	struct belayd_opts opts;
-	unsigned int loop_cnt;
-	struct effect *eff;
-	struct cause *cse;
-	struct rule *rule;
 	int ret;
 
 	ret = parse_opts(argc, argv, &opts);
 	if (ret)
 		goto out;
 
-	ret = parse_config(&opts);
+	ret = log_init();
 	if (ret)
 		goto out;
 
-	loop_cnt = 0;
-
-	while (1) {
-		rule = opts.rules;
-
-		while (rule) {
-			belayd_dbg("Running rule %s\n", rule->name);
-			cse = rule->causes;
-
-			while (cse) {
-				ret = (*cse->fns->main)(cse, opts.interval);
-				if (ret < 0) {
-					belayd_dbg("%s raised error %d\n", cse->name, ret);
-					goto out;
-				} else if (ret == 0) {
-					/*
-					 * this cause did not trip.  skip all the remaining causes
-					 * in this rule because the effect will not be invoked.
-					 */
-					belayd_dbg("%s did not trip\n", cse->name);
-					break;
-				} else if (ret > 0) {
-					/*
-					 * This cause tripped.  We don't need to do anything.
-					 * If all of the causes in this rule are triggered,
-					 * then the "ret > 0" will flow down to the logic
-					 * below and the effects will be run.
-					 */
-					belayd_dbg("%s tripped\n", cse->name);
-				}
-
-				cse = cse->next;
-			}
-
-			if (ret > 0) {
-				/*
-				 * The cause(s) for this rule were triggered, invoke the
-				 * effect(s)
-				 */
-				eff = rule->effects;
+	ret = loop_init();
+	if (ret)
+		goto out;
 
-				while (eff) {
-					belayd_dbg("Running effect %s\n", eff->name);
-					ret = (*eff->fns->main)(eff);
-					if (ret)
-						goto out;
+	if (opts.replay[0] && !opts.compile) {
+		ret = replay_init(&opts);
+		if (ret)
+			goto out;
+	}
 
-					eff = eff->next;
-				}
-			}
+	ret = parse_config(&opts);
+	if (ret)
+		goto out;
 
+	if (opts.compile) {
+		ret = image_write(&opts);
+		goto out;
+	}
 
-			rule = rule->next;
-		}
+	if (replay_enabled()) {
+		ret = replay_run(&opts);
+		goto out;
+	}
 
-		loop_cnt++;
-		if (opts.max_loops > 0 && loop_cnt > opts.max_loops) {
-			ret = -ETIME;
-			break;
-		}
+	ret = reload_init(&opts);
+	if (ret)
+		goto out;
 
-		sleep(opts.interval);
-	}
+	ret = loop_run(&opts);
 
 out:
+	reload_exit();
+	executor_exit();
+	metrics_exit();
 	cleanup(&opts);
+	replay_exit();
+	loop_exit();
+	log_exit();
 
 	return -ret;
 }
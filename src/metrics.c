@@ -0,0 +1,614 @@
+// LICENSE TBD
+/**
+ * Metrics for belayd
+ *
+ * Every rule, cause and effect of the running config has a struct metrics,
+ * see metrics.h.  They are exported in the Prometheus text format, either
+ * to each client that connects to a Unix socket, or to a file that is
+ * rewritten every METRICS_FILE_PERIOD, e.g. for node_exporter's textfile
+ * collector.  A client of the socket receives an HTTP/1.0 response and
+ * need not send a request, so both of these work:
+ *
+ *	curl --unix-socket /run/belayd.sock http://localhost/metrics
+ *	socat - UNIX-CONNECT:/run/belayd.sock
+ *
+ * The metrics are kept in an array that belongs to the rule set.  When a
+ * reload keeps a rule, its new copy takes over the counts of the old one.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "belayd-internal.h"
+#include "defines.h"
+#include "metrics.h"
+
+#define METRICS_FILE_PERIOD	10000	/* milliseconds */
+#define METRICS_LABEL_MAX	512
+#define METRICS_BACKLOG		16
+
+/* struct metrics_family.counter of a histogram */
+#define METRICS_HISTOGRAM	SIZE_MAX
+
+enum metrics_kind {
+	METRICS_RULE,
+	METRICS_CAUSE,
+	METRICS_EFFECT,
+};
+
+struct metrics_family {
+	const char *name;
+	const char *help;
+	enum metrics_kind kind;
+	size_t counter;		/* offset of the counter in struct metrics */
+};
+
+static const struct metrics_family families[] = {
+	{"belayd_rule_evaluations_total", "Evaluations of the rule's causes",
+	 METRICS_RULE, offsetof(struct metrics, evals)},
+	{"belayd_rule_trips_total", "Evaluations in which every cause of the rule tripped",
+	 METRICS_RULE, offsetof(struct metrics, trips)},
+	{"belayd_rule_errors_total", "Evaluations in which a cause of the rule failed",
+	 METRICS_RULE, offsetof(struct metrics, errors)},
+	{"belayd_rule_duration_seconds", "Time spent evaluating the rule's causes",
+	 METRICS_RULE, METRICS_HISTOGRAM},
+
+	{"belayd_cause_evaluations_total", "Calls to the cause's main()",
+	 METRICS_CAUSE, offsetof(struct metrics, evals)},
+	{"belayd_cause_trips_total", "Calls to the cause's main() that tripped",
+	 METRICS_CAUSE, offsetof(struct metrics, trips)},
+	{"belayd_cause_errors_total", "Calls to the cause's main() that failed",
+	 METRICS_CAUSE, offsetof(struct metrics, errors)},
+	{"belayd_cause_duration_seconds", "Time spent in the cause's main()",
+	 METRICS_CAUSE, METRICS_HISTOGRAM},
+
+	{"belayd_effect_runs_total", "Calls to the effect's main()",
+	 METRICS_EFFECT, offsetof(struct metrics, evals)},
+	{"belayd_effect_errors_total", "Calls to the effect's main() that returned nonzero",
+	 METRICS_EFFECT, offsetof(struct metrics, errors)},
+	{"belayd_effect_duration_seconds", "Time spent in the effect's main()",
+	 METRICS_EFFECT, METRICS_HISTOGRAM},
+};
+
+/* a client of the socket that has not yet received all of its metrics */
+struct metrics_client {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t off;
+
+	struct metrics_client *next;
+};
+
+static struct {
+	const struct belayd_opts *opts;
+	bool enabled;
+
+	int sock_fd;
+	bool bound;		/* the socket file is ours to remove */
+	int timer_fd;
+	struct metrics_client *clients;
+} export = {
+	.sock_fd = -1,
+	.timer_fd = -1,
+};
+
+/*
+ * The bucket of an evaluation that took ns nanoseconds.  A bucket holds the
+ * values up to and including its upper bound, as a Prometheus bucket does.
+ */
+static int metrics_bucket(uint64_t ns)
+{
+	uint64_t val = ns ? ns - 1 : 0;
+	int msb, sub, idx;
+
+	if (val < (1ULL << METRICS_MIN_SHIFT))
+		return 0;
+
+	msb = 63 - __builtin_clzll(val);
+	sub = (val >> (msb - METRICS_SUB_SHIFT)) & ((1 << METRICS_SUB_SHIFT) - 1);
+	idx = 1 + ((msb - METRICS_MIN_SHIFT) << METRICS_SUB_SHIFT) + sub;
+
+	return idx < METRICS_BUCKETS ? idx : METRICS_BUCKETS - 1;
+}
+
+/* the upper bound of every bucket but the last, in nanoseconds */
+static uint64_t metrics_bucket_le(int idx)
+{
+	int msb, sub;
+
+	if (idx == 0)
+		return 1ULL << METRICS_MIN_SHIFT;
+
+	msb = METRICS_MIN_SHIFT + ((idx - 1) >> METRICS_SUB_SHIFT);
+	sub = (idx - 1) & ((1 << METRICS_SUB_SHIFT) - 1);
+
+	return (uint64_t)((1 << METRICS_SUB_SHIFT) + sub + 1) << (msb - METRICS_SUB_SHIFT);
+}
+
+void metrics_record(struct metrics * const m, int ret, uint64_t ns)
+{
+	if (!m)
+		return;
+
+	__atomic_fetch_add(&m->evals, 1, __ATOMIC_RELAXED);
+	if (ret > 0)
+		__atomic_fetch_add(&m->trips, 1, __ATOMIC_RELAXED);
+	else if (ret < 0)
+		__atomic_fetch_add(&m->errors, 1, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&m->sum, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&m->buckets[metrics_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Give every rule, cause and effect of a rule set its metrics, if metrics
+ * are enabled.  Without memory for them, the rule set runs without.
+ */
+void metrics_attach(struct rule_set * const set)
+{
+	int i;
+
+	if (!export.enabled)
+		return;
+
+	set->metrics = calloc(set->rule_cnt + set->cause_cnt + set->effect_cnt,
+			      sizeof(struct metrics));
+	if (!set->metrics) {
+		belayd_wrn("Failed to allocate the metrics, they will not be collected\n");
+		return;
+	}
+
+	for (i = 0; i < set->rule_cnt; i++)
+		set->rules[i].metrics = &set->metrics[i];
+	for (i = 0; i < set->cause_cnt; i++)
+		set->causes[i].metrics = &set->metrics[set->rule_cnt + i];
+	for (i = 0; i < set->effect_cnt; i++)
+		set->effects[i].metrics = &set->metrics[set->rule_cnt + set->cause_cnt + i];
+}
+
+/* A rule that was kept by a reload takes over the counts of its origin */
+void metrics_adopt(struct rule * const rule, const struct rule * const origin)
+{
+	int i;
+
+	if (!rule->metrics || !origin->metrics)
+		return;
+
+	memcpy(rule->metrics, origin->metrics, sizeof(struct metrics));
+
+	for (i = 0; i < rule->cause_cnt; i++)
+		memcpy(rule->causes[i].metrics, origin->causes[i].metrics,
+		       sizeof(struct metrics));
+	for (i = 0; i < rule->effect_cnt; i++)
+		memcpy(rule->effects[i].metrics, origin->effects[i].metrics,
+		       sizeof(struct metrics));
+}
+
+/* escape a label value as the text format requires */
+static void metrics_escape(char * const dst, size_t size, const char * const src)
+{
+	size_t len = 0;
+	const char *c;
+
+	for (c = src; *c && len + 3 < size; c++) {
+		if (*c == '\\' || *c == '"') {
+			dst[len++] = '\\';
+			dst[len++] = *c;
+		} else if (*c == '\n') {
+			dst[len++] = '\\';
+			dst[len++] = 'n';
+		} else {
+			dst[len++] = *c;
+		}
+	}
+
+	dst[len] = '\0';
+}
+
+static void metrics_print_one(FILE * const f, const struct metrics_family * const fam,
+			      const char * const labels, struct metrics * const m)
+{
+	unsigned long long cnt = 0;
+	int i;
+
+	if (fam->counter != METRICS_HISTOGRAM) {
+		fprintf(f, "%s{%s} %llu\n", fam->name, labels,
+			__atomic_load_n((unsigned long long *)((char *)m + fam->counter),
+					__ATOMIC_RELAXED));
+		return;
+	}
+
+	for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+		cnt += __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+		fprintf(f, "%s_bucket{%s,le=\"%.12g\"} %llu\n", fam->name, labels,
+			metrics_bucket_le(i) / 1e9, cnt);
+	}
+
+	cnt += __atomic_load_n(&m->buckets[METRICS_BUCKETS - 1], __ATOMIC_RELAXED);
+	fprintf(f, "%s_bucket{%s,le=\"+Inf\"} %llu\n", fam->name, labels, cnt);
+	fprintf(f, "%s_sum{%s} %.9f\n", fam->name, labels,
+		__atomic_load_n(&m->sum, __ATOMIC_RELAXED) / 1e9);
+	fprintf(f, "%s_count{%s} %llu\n", fam->name, labels, cnt);
+}
+
+static void metrics_print_family(FILE * const f, const struct rule_set * const set,
+				 const struct metrics_family * const fam)
+{
+	char rule_name[METRICS_LABEL_MAX];
+	char labels[METRICS_LABEL_MAX * 2 + 64];
+	char name[METRICS_LABEL_MAX];
+	struct effect *eff;
+	struct cause *cse;
+	struct rule *rule;
+	int i, j;
+
+	fprintf(f, "# HELP %s %s\n", fam->name, fam->help);
+	fprintf(f, "# TYPE %s %s\n", fam->name,
+		fam->counter == METRICS_HISTOGRAM ? "histogram" : "counter");
+
+	for (i = 0; i < set->rule_cnt; i++) {
+		rule = &set->rules[i];
+		if (!rule->metrics)
+			continue;
+
+		metrics_escape(rule_name, sizeof(rule_name), rule->name);
+
+		switch (fam->kind) {
+		case METRICS_RULE:
+			snprintf(labels, sizeof(labels), "rule=\"%s\"", rule_name);
+			metrics_print_one(f, fam, labels, rule->metrics);
+			break;
+		case METRICS_CAUSE:
+			for (j = 0, cse = rule->causes; j < rule->cause_cnt; j++, cse++) {
+				metrics_escape(name, sizeof(name), cse->name);
+				snprintf(labels, sizeof(labels), "rule=\"%s\",cause=\"%s\",index=\"%d\"",
+					 rule_name, name, j);
+				metrics_print_one(f, fam, labels, cse->metrics);
+			}
+			break;
+		case METRICS_EFFECT:
+			for (j = 0, eff = rule->effects; j < rule->effect_cnt; j++, eff++) {
+				metrics_escape(name, sizeof(name), eff->name);
+				snprintf(labels, sizeof(labels), "rule=\"%s\",effect=\"%s\",index=\"%d\"",
+					 rule_name, name, j);
+				metrics_print_one(f, fam, labels, eff->metrics);
+			}
+			break;
+		}
+	}
+}
+
+/* render the metrics of the running config into a malloc'd buffer */
+static int metrics_render(char ** const buf, size_t * const len)
+{
+	FILE *f;
+	int i;
+
+	f = open_memstream(buf, len);
+	if (!f)
+		return -errno;
+
+	for (i = 0; i < ARRAY_SIZE(families); i++)
+		metrics_print_family(f, &export.opts->set, &families[i]);
+
+	if (fclose(f)) {
+		free(*buf);
+		*buf = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int metrics_write_file(void)
+{
+	char tmp[FILENAME_MAX + 8];
+	size_t len, written;
+	char *buf = NULL;
+	FILE *f;
+	int ret;
+
+	ret = metrics_render(&buf, &len);
+	if (ret)
+		return ret;
+
+	/* write a new file and rename it, so that readers never see half of one */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", export.opts->metrics_file);
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		ret = -errno;
+		goto out;
+	}
+
+	written = fwrite(buf, 1, len, f);
+	if (fclose(f) || written != len) {
+		ret = -EIO;
+		unlink(tmp);
+		goto out;
+	}
+
+	if (rename(tmp, export.opts->metrics_file)) {
+		ret = -errno;
+		unlink(tmp);
+	}
+
+out:
+	if (ret)
+		belayd_wrn("Failed to write the metrics to %s: %d\n",
+			   export.opts->metrics_file, ret);
+	free(buf);
+
+	return ret;
+}
+
+static int metrics_timer(int fd, uint32_t events, void *data)
+{
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return errno == EAGAIN ? 0 : -errno;
+
+	/* a failure has been logged, and is retried in the next period */
+	metrics_write_file();
+
+	return 0;
+}
+
+static void metrics_client_free(struct metrics_client * const client)
+{
+	struct metrics_client **prev;
+
+	for (prev = &export.clients; *prev; prev = &(*prev)->next) {
+		if (*prev == client) {
+			*prev = client->next;
+			break;
+		}
+	}
+
+	close(client->fd);
+	free(client->buf);
+	free(client);
+}
+
+/*
+ * Send as much of the metrics as the socket takes.  Returns 0 once they have
+ * all been sent, -EAGAIN if the rest must wait for the socket to drain, or
+ * another negative value if the client went away.
+ */
+static int metrics_send(struct metrics_client * const client)
+{
+	ssize_t cnt;
+
+	while (client->off < client->len) {
+		cnt = send(client->fd, client->buf + client->off, client->len - client->off,
+			   MSG_NOSIGNAL);
+		if (cnt < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		client->off += cnt;
+	}
+
+	return 0;
+}
+
+static int metrics_client_fn(int fd, uint32_t events, void *data)
+{
+	struct metrics_client *client = data;
+
+	if (metrics_send(client) == -EAGAIN)
+		return 0;
+
+	belayd_event_del(fd);
+	metrics_client_free(client);
+
+	return 0;
+}
+
+static void metrics_serve(int fd)
+{
+	struct metrics_client *client;
+	char hdr[128];
+	size_t len;
+	char *buf;
+	int hlen;
+	int ret;
+
+	client = calloc(1, sizeof(struct metrics_client));
+	if (!client) {
+		close(fd);
+		return;
+	}
+
+	client->fd = fd;
+	client->next = export.clients;
+	export.clients = client;
+
+	ret = metrics_render(&buf, &len);
+	if (ret)
+		goto err;
+
+	hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n\r\n", len);
+
+	client->buf = malloc(hlen + len);
+	if (!client->buf) {
+		free(buf);
+		goto err;
+	}
+
+	memcpy(client->buf, hdr, hlen);
+	memcpy(client->buf + hlen, buf, len);
+	client->len = hlen + len;
+	free(buf);
+
+	ret = metrics_send(client);
+	if (ret == -EAGAIN) {
+		/* the rest is sent as the client reads */
+		ret = belayd_event_add(fd, EPOLLOUT, metrics_client_fn, client);
+		if (!ret)
+			return;
+	}
+
+err:
+	metrics_client_free(client);
+}
+
+static int metrics_accept(int fd, uint32_t events, void *data)
+{
+	int client_fd;
+
+	while (1) {
+		client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_fd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				belayd_wrn("Failed to accept a metrics client: %d\n", errno);
+			return 0;
+		}
+
+		metrics_serve(client_fd);
+	}
+}
+
+static int metrics_listen(const char * const path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		belayd_err("Metrics socket path is too long: %s\n", path);
+		return -ENAMETOOLONG;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* a socket that is left over from a previous run */
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	export.sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (export.sock_fd < 0) {
+		belayd_err("Failed to create the metrics socket: %d\n", errno);
+		return -errno;
+	}
+
+	if (bind(export.sock_fd, (struct sockaddr *)&addr, sizeof(addr)))
+		goto err;
+	export.bound = true;
+
+	if (listen(export.sock_fd, METRICS_BACKLOG))
+		goto err;
+
+	return belayd_event_add(export.sock_fd, EPOLLIN, metrics_accept, NULL);
+
+err:
+	ret = -errno;
+	belayd_err("Failed to listen on the metrics socket %s: %d\n", path, errno);
+	return ret;
+}
+
+static int metrics_start_timer(void)
+{
+	struct itimerspec its;
+
+	export.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (export.timer_fd < 0) {
+		belayd_err("Failed to create the metrics timer: %d\n", errno);
+		return -errno;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = METRICS_FILE_PERIOD / 1000;
+	its.it_value.tv_nsec = (METRICS_FILE_PERIOD % 1000) * 1000000;
+	its.it_interval = its.it_value;
+
+	if (timerfd_settime(export.timer_fd, 0, &its, NULL)) {
+		belayd_err("Failed to arm the metrics timer: %d\n", errno);
+		return -errno;
+	}
+
+	return belayd_event_add(export.timer_fd, EPOLLIN, metrics_timer, NULL);
+}
+
+/*
+ * Start collecting metrics for the running config, if they are exported
+ * anywhere
+ */
+int metrics_init(struct belayd_opts * const opts)
+{
+	int ret;
+
+	if (!opts->metrics_socket[0] && !opts->metrics_file[0])
+		return 0;
+
+	export.opts = opts;
+	export.enabled = true;
+	metrics_attach(&opts->set);
+
+	if (opts->metrics_socket[0]) {
+		ret = metrics_listen(opts->metrics_socket);
+		if (ret)
+			return ret;
+	}
+
+	if (opts->metrics_file[0]) {
+		ret = metrics_start_timer();
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Write the final metrics to the file and stop exporting them */
+void metrics_exit(void)
+{
+	if (!export.enabled)
+		return;
+
+	if (export.opts->metrics_file[0] && export.opts->set.metrics)
+		metrics_write_file();
+
+	/* the event sources themselves are freed by loop_exit() */
+	while (export.clients)
+		metrics_client_free(export.clients);
+
+	if (export.sock_fd >= 0)
+		close(export.sock_fd);
+	if (export.bound)
+		unlink(export.opts->metrics_socket);
+	if (export.timer_fd >= 0)
+		close(export.timer_fd);
+
+	export.sock_fd = -1;
+	export.bound = false;
+	export.timer_fd = -1;
+	export.enabled = false;
+	export.opts = NULL;
+}
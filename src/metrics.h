@@ -0,0 +1,45 @@
+// LICENSE TBD
+/**
+ * belayd metrics header file
+ *
+ * Each rule, cause and effect counts its evaluations, the evaluations in
+ * which it tripped and those that failed, and keeps a histogram of how
+ * long they took.  A histogram has a fixed set of log-linear buckets, as
+ * in an HDR histogram: every power of two of nanoseconds from
+ * 2^METRICS_MIN_SHIFT to 2^METRICS_MAX_SHIFT is split into
+ * 2^METRICS_SUB_SHIFT buckets of equal width.  The first bucket holds
+ * everything faster than that, and the last one everything slower.  Every
+ * bucket is exported for every object, so the default of one bucket per
+ * power of two keeps a scrape of a large config to a sensible size.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#ifndef __BELAYD_METRICS_H
+#define __BELAYD_METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_MIN_SHIFT	10	/* 1.024 us */
+#define METRICS_MAX_SHIFT	34	/* 17.2 s */
+#define METRICS_SUB_SHIFT	0
+#define METRICS_BUCKETS \
+	((((METRICS_MAX_SHIFT) - (METRICS_MIN_SHIFT)) << (METRICS_SUB_SHIFT)) + 2)
+
+/* the counters are updated with relaxed atomics by whichever thread ran the object */
+struct metrics {
+	unsigned long long evals;
+	unsigned long long trips;
+	unsigned long long errors;
+	unsigned long long sum;		/* nanoseconds */
+	unsigned long long buckets[METRICS_BUCKETS];
+};
+
+/*
+ * Count an evaluation that took ns nanoseconds.  ret > 0 means that it
+ * tripped, and ret < 0 that it failed.  m may be NULL.
+ */
+void metrics_record(struct metrics * const m, int ret, uint64_t ns);
+
+#endif /* __BELAYD_METRICS_H */
@@ -9,33 +9,23 @@
 #include <json-c/json.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 
 #include "belayd-internal.h"
 #include "effect.h"
 #include "cause.h"
+#include "trace.h"
 
-static int get_file_size(FILE * const fd, long * const file_size)
-{
-	int ret;
-
-	ret = fseek(fd, 0, SEEK_END);
-	if (ret) {
-		belayd_err("fseek SEEK_END failed: %d\n", ret);
-		return -errno;
-	}
-
-	*file_size = ftell(fd);
-
-	ret = fseek(fd, 0, SEEK_SET);
-	if (ret) {
-		belayd_err("fseek SEEK_SET failed: %d\n", ret);
-		return -errno;
-	}
-
-	return ret;
-}
+/*
+ * the plugins' private data is small, and an arena that holds the data of a
+ * cause carried over by a reload outlives the rest of its config
+ */
+#define DATA_BLOCK_SIZE	(16 * 1024)
 
 int parse_string(struct json_object * const obj, const char * const key, const char **value)
 {
@@ -91,8 +81,434 @@ int parse_int(struct json_object * const obj, const char * const key, int * cons
 error:
 	return ret;
 }
-static int parse_cause(struct rule * const rule, struct json_object * const cause_obj)
+
+/*
+ * Parse an optional boolean, given as true/false or as the string
+ * "true"/"false".  *value is set to default_value if the key is not present.
+ */
+int parse_bool(struct json_object * const obj, const char * const key, bool * const value,
+	       bool default_value)
+{
+	struct json_object *key_obj;
+	const char *str_value;
+	json_bool exists;
+
+	*value = default_value;
+
+	exists = json_object_object_get_ex(obj, key, &key_obj);
+	if (!exists || !key_obj)
+		return 0;
+
+	str_value = json_object_get_string(key_obj);
+	if (str_value && strcmp(str_value, "true") == 0) {
+		*value = true;
+	} else if (str_value && strcmp(str_value, "false") == 0) {
+		*value = false;
+	} else {
+		belayd_err("Invalid value for key %s: %s\n", key, str_value);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Convert a duration string into milliseconds.  A bare number is
+ * interpreted as seconds and may contain a fractional part, e.g. "0.25".
+ * The suffixes "ms", "s", "m", and "h" are also accepted, e.g. "100ms".
+ */
+int parse_duration_str(const char * const str, int * const ms)
+{
+	double value, scale;
+	char *end;
+
+	if (!str || !ms)
+		return -EINVAL;
+
+	errno = 0;
+	value = strtod(str, &end);
+	/* strtod() also accepts "nan" and "inf" */
+	if (errno || end == str || !isfinite(value) || value < 0)
+		return -EINVAL;
+
+	if (*end == '\0' || strcmp(end, "s") == 0)
+		scale = 1000.0;
+	else if (strcmp(end, "ms") == 0)
+		scale = 1.0;
+	else if (strcmp(end, "m") == 0)
+		scale = 60.0 * 1000.0;
+	else if (strcmp(end, "h") == 0)
+		scale = 60.0 * 60.0 * 1000.0;
+	else
+		return -EINVAL;
+
+	/* written so that it also rejects NaN */
+	value = value * scale + 0.5;
+	if (!(value >= 1 && value <= INT_MAX))
+		return -EINVAL;
+
+	*ms = (int)value;
+
+	return 0;
+}
+
+/*
+ * Parse the optional "interval" key of a rule or cause.  *interval is left
+ * untouched if the key is not present.
+ */
+static int parse_duration(struct json_object * const obj, const char * const key, int * const ms)
+{
+	struct json_object *duration_obj;
+	const char *duration_str;
+	json_bool exists;
+	int ret;
+
+	exists = json_object_object_get_ex(obj, key, &duration_obj);
+	if (!exists || !duration_obj)
+		return 0;
+
+	duration_str = json_object_get_string(duration_obj);
+
+	ret = parse_duration_str(duration_str, ms);
+	if (ret)
+		belayd_err("Invalid %s: %s\n", key, duration_str);
+
+	return ret;
+}
+
+static int parse_interval(struct json_object * const obj, int * const interval)
+{
+	return parse_duration(obj, "interval", interval);
+}
+
+/*
+ * Parse the optional "max_rate" key of an effect, e.g. "3/1h" or "10/m",
+ * into a number of runs per period.  The values are left untouched if the
+ * key is not present.
+ */
+static int parse_rate(struct json_object * const obj, const char * const key, int * const cnt,
+		      int * const period)
+{
+	char period_str[32];
+	const char *rate_str;
+	json_bool exists;
+	char *end;
+	long value;
+	int ret;
+
+	exists = json_object_object_get_ex(obj, key, NULL);
+	if (!exists)
+		return 0;
+
+	ret = parse_string(obj, key, &rate_str);
+	if (ret)
+		return ret;
+
+	errno = 0;
+	value = strtol(rate_str, &end, 10);
+	if (errno || end == rate_str || *end != '/' || value < 1 || value > INT_MAX)
+		goto err;
+
+	/* the count of the period may be left out, as in "10/m", but not the period */
+	end++;
+	if (*end == '\0')
+		goto err;
+
+	snprintf(period_str, sizeof(period_str), "%s%s", (*end >= '0' && *end <= '9') ||
+		 *end == '.' ? "" : "1", end);
+
+	ret = parse_duration_str(period_str, period);
+	if (ret)
+		goto err;
+
+	*cnt = value;
+
+	return 0;
+
+err:
+	belayd_err("Invalid %s: %s\n", key, rate_str);
+	return -EINVAL;
+}
+
+/*
+ * Hash tables, keyed by the canonical form of an object's JSON, that are
+ * only used while a config is parsed.  Identical causes are shared between
+ * rules, so every distinct cause is kept in cause_table.  During a reload,
+ * the old_*_table hold the running config's objects, so that those that
+ * did not change can be carried over.
+ */
+struct key_slot {
+	const char *key;
+	void *obj;
+};
+
+struct key_table {
+	struct key_slot *slots;
+	size_t size;		/* always a power of two */
+	size_t cnt;
+};
+
+static struct key_table cause_table;
+static struct key_table old_cause_table;
+static struct key_table old_effect_table;
+static struct key_table old_rule_table;
+
+struct canon {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static int canon_append(struct canon * const c, const char * const str, size_t len)
+{
+	size_t size;
+	char *buf;
+
+	if (c->len + len + 1 > c->size) {
+		size = c->size ? c->size : 256;
+		while (c->len + len + 1 > size)
+			size *= 2;
+
+		buf = realloc(c->buf, size);
+		if (!buf)
+			return -ENOMEM;
+
+		c->buf = buf;
+		c->size = size;
+	}
+
+	memcpy(c->buf + c->len, str, len);
+	c->len += len;
+	c->buf[c->len] = '\0';
+
+	return 0;
+}
+
+static int cmp_names(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/*
+ * Serialize obj with the keys of every object sorted, so that configs that
+ * only differ in key order or whitespace produce the same string.  The key
+ * skip of obj itself, if not NULL, is left out.
+ */
+static int canon_json(struct canon * const c, struct json_object * const obj,
+		      const char * const skip)
+{
+	struct json_object_iterator it, end;
+	struct json_object *val;
+	const char **names;
+	const char *str;
+	int ret = 0;
+	size_t cnt, i;
+
+	switch (json_object_get_type(obj)) {
+	case json_type_object:
+		cnt = json_object_object_length(obj);
+		names = malloc(sizeof(char *) * (cnt ? cnt : 1));
+		if (!names)
+			return -ENOMEM;
+
+		i = 0;
+		it = json_object_iter_begin(obj);
+		end = json_object_iter_end(obj);
+		while (!json_object_iter_equal(&it, &end) && i < cnt) {
+			names[i] = json_object_iter_peek_name(&it);
+			if (!skip || strcmp(names[i], skip) != 0)
+				i++;
+			json_object_iter_next(&it);
+		}
+		cnt = i;
+
+		qsort(names, cnt, sizeof(char *), cmp_names);
+
+		ret = canon_append(c, "{", 1);
+		for (i = 0; !ret && i < cnt; i++) {
+			json_object_object_get_ex(obj, names[i], &val);
+
+			ret = canon_append(c, "\"", 1);
+			if (!ret)
+				ret = canon_append(c, names[i], strlen(names[i]));
+			if (!ret)
+				ret = canon_append(c, "\":", 2);
+			if (!ret)
+				ret = canon_json(c, val, NULL);
+			if (!ret && i + 1 < cnt)
+				ret = canon_append(c, ",", 1);
+		}
+		if (!ret)
+			ret = canon_append(c, "}", 1);
+
+		free(names);
+		break;
+	case json_type_array:
+		cnt = json_object_array_length(obj);
+
+		ret = canon_append(c, "[", 1);
+		for (i = 0; !ret && i < cnt; i++) {
+			ret = canon_json(c, json_object_array_get_idx(obj, i), NULL);
+			if (!ret && i + 1 < cnt)
+				ret = canon_append(c, ",", 1);
+		}
+		if (!ret)
+			ret = canon_append(c, "]", 1);
+		break;
+	default:
+		str = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN);
+		ret = canon_append(c, str, strlen(str));
+		break;
+	}
+
+	return ret;
+}
+
+static uint64_t key_hash(const char *key)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	/* FNV-1a */
+	while (*key) {
+		hash ^= (unsigned char)*key++;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/*
+ * Return the first object with this key, skipping those for which skip()
+ * returns true, if skip is not NULL
+ */
+static void *key_table_find(const struct key_table * const table, const char * const key,
+			    bool (*skip)(const void * const obj))
+{
+	size_t i;
+
+	if (!table->size)
+		return NULL;
+
+	i = key_hash(key) & (table->size - 1);
+	while (table->slots[i].key) {
+		if (strcmp(table->slots[i].key, key) == 0 &&
+		    (!skip || !skip(table->slots[i].obj)))
+			return table->slots[i].obj;
+
+		i = (i + 1) & (table->size - 1);
+	}
+
+	return NULL;
+}
+
+static int key_table_add(struct key_table * const table, const char * const key,
+			 void * const obj)
+{
+	struct key_slot *slots, *old_slots;
+	size_t size, old_size, i, j;
+
+	/* keep the table at most half full */
+	if ((table->cnt + 1) * 2 > table->size) {
+		size = table->size ? table->size * 2 : 64;
+
+		slots = calloc(size, sizeof(struct key_slot));
+		if (!slots)
+			return -ENOMEM;
+
+		old_slots = table->slots;
+		old_size = table->size;
+
+		table->slots = slots;
+		table->size = size;
+
+		for (i = 0; i < old_size; i++) {
+			if (!old_slots[i].key)
+				continue;
+
+			j = key_hash(old_slots[i].key) & (size - 1);
+			while (slots[j].key)
+				j = (j + 1) & (size - 1);
+			slots[j] = old_slots[i];
+		}
+
+		free(old_slots);
+	}
+
+	i = key_hash(key) & (table->size - 1);
+	while (table->slots[i].key)
+		i = (i + 1) & (table->size - 1);
+
+	table->slots[i].key = key;
+	table->slots[i].obj = obj;
+	table->cnt++;
+
+	return 0;
+}
+
+static void key_table_free(struct key_table * const table)
+{
+	free(table->slots);
+	memset(table, 0, sizeof(struct key_table));
+}
+
+static bool effect_moved(const void * const obj)
+{
+	return ((const struct effect *)obj)->moved;
+}
+
+static bool rule_moved(const void * const obj)
+{
+	return ((const struct rule *)obj)->moved;
+}
+
+/* copy the canonical form of obj, without its key skip, into the rule set's arena */
+static int canon_key(struct rule_set * const set, struct json_object * const obj,
+		     const char * const skip, char ** const key)
+{
+	struct canon c = { 0 };
+	int ret;
+
+	ret = canon_json(&c, obj, skip);
+	if (!ret) {
+		*key = arena_strdup(&set->arena, c.buf);
+		if (!*key)
+			ret = -ENOMEM;
+	}
+
+	if (c.buf)
+		free(c.buf);
+
+	return ret;
+}
+
+/*
+ * Carry an unchanged cause over from the running config.  The private data
+ * and everything that belayd has learned about the cause move to the new
+ * cause, which takes over the origin's reference on home.
+ */
+static void adopt_cause(struct cause * const cse, struct cause * const origin)
+{
+	cse->idx = origin->idx;
+	cse->fns = origin->fns;
+	cse->data = origin->data;
+	cse->home = origin->home;
+
+	cse->last_run = origin->last_run;
+	cse->next_run = origin->next_run;
+	cse->result = origin->result;
+	cse->seq = origin->seq;
+	cse->evals = origin->evals;
+	cse->cost = origin->cost;
+	cse->false_rate = origin->false_rate;
+
+	cse->origin = origin;
+	origin->moved = true;
+}
+
+static int parse_cause(struct rule_set * const set, struct rule * const rule,
+		       struct json_object * const cause_obj)
 {
+	struct cause *shared, *origin;
 	bool found_cause = false;
 	struct cause *cse = NULL;
 	const char *name;
@@ -103,23 +519,43 @@ static int parse_cause(struct rule * const rule, struct json_object * const caus
 	if (ret )
 		goto error;
 
-	cse = malloc(sizeof(struct cause));
-	if (!cse) {
+	/* causes are appended to the rule set in config order */
+	cse = &set->causes[set->cause_cnt];
+	memset(cse, 0, sizeof(struct cause));
+
+	cse->name = arena_strdup(&set->arena, name);
+	if (!cse->name) {
 		ret = -ENOMEM;
 		goto error;
 	}
 
-	memset(cse, 0, sizeof(struct cause));
+	ret = parse_interval(cause_obj, &cse->interval);
+	if (ret)
+		goto error;
 
-	cse->name = malloc(strlen(name) + 1);
-	if (!cse->name) {
-		ret = -ENOMEM;
+	/* the id only names the cause within its rule, see parse_when() */
+	ret = canon_key(set, cause_obj, "id", &cse->key);
+	if (ret)
 		goto error;
+
+	shared = key_table_find(&cause_table, cse->key, NULL);
+	if (shared) {
+		belayd_dbg("Sharing cause %s with an identical cause\n", cse->name);
+		cse->shared = shared;
+		cse->idx = shared->idx;
+		cse->fns = shared->fns;
+		cse->data = shared->data;
+		goto add;
 	}
 
-	strcpy(cse->name, name);
+	origin = key_table_find(&old_cause_table, cse->key, NULL);
+	if (origin) {
+		belayd_dbg("Keeping cause %s from the running config\n", cse->name);
+		found_cause = true;
+		adopt_cause(cse, origin);
+	}
 
-	for (i = 0; i < CAUSE_CNT; i++) {
+	for (i = 0; !origin && i < CAUSE_CNT; i++) {
 		if (strlen(cause_names[i]) != strlen(name))
 			continue;
 
@@ -129,10 +565,12 @@ static int parse_cause(struct rule * const rule, struct json_object * const caus
 			cse->fns = &cause_fns[i];
 
 			belayd_dbg("Initializing cause %s\n", cse->name);
-			ret = (*cse->fns->init)(cse, cause_obj);
+			ret = (*cse->fns->init)(cse, cause_obj, set->data);
 			if (ret)
 				goto error;
 
+			cse->home = arena_get(set->data);
+
 			break;
 		}
 	}
@@ -143,31 +581,44 @@ static int parse_cause(struct rule * const rule, struct json_object * const caus
 		goto error;
 	}
 
+	ret = key_table_add(&cause_table, cse->key, cse);
+	if (ret) {
+		if (origin) {
+			origin->moved = false;
+		} else {
+			if (cse->fns->exit)
+				(*cse->fns->exit)(cse);
+			arena_put(cse->home);
+		}
+		goto error;
+	}
+
+add:
 	/*
 	 * do not goto error after this point.  we have added the cse
-	 * to the causes linked list
+	 * to the rule set
 	 */
-	if (!rule->causes)
-		rule->causes = cse;
-	else
-		rule->causes->next = cse;
+	if (rule->cause_cnt)
+		cse[-1].next = cse;
+	rule->cause_cnt++;
+	set->cause_cnt++;
 
 	return ret;
 
 error:
-	if (cse && cse->name)
-		free(cse->name);
-
+	/* the slot is reused by the next cause */
 	if (cse)
-		free(cse);
+		memset(cse, 0, sizeof(struct cause));
 
 	return ret;
 }
 
-static int parse_effect(struct rule * const rule, struct json_object * const effect_obj)
+static int parse_effect(struct rule_set * const set, struct rule * const rule,
+			struct json_object * const effect_obj)
 {
 	bool found_effect = false;
 	struct effect *eff = NULL;
+	struct effect *origin;
 	const char *name;
 	int ret = 0;
 	int i;
@@ -176,23 +627,53 @@ static int parse_effect(struct rule * const rule, struct json_object * const eff
 	if (ret )
 		goto error;
 
-	eff = malloc(sizeof(struct effect));
-	if (!eff) {
-		ret = -ENOMEM;
-		goto error;
-	}
-
+	/* effects are appended to the rule set in config order */
+	eff = &set->effects[set->effect_cnt];
 	memset(eff, 0, sizeof(struct effect));
 
-	eff->name = malloc(strlen(name) + 1);
+	eff->name = arena_strdup(&set->arena, name);
 	if (!eff->name) {
 		ret = -ENOMEM;
 		goto error;
 	}
 
-	strcpy(eff->name, name);
+	ret = canon_key(set, effect_obj, NULL, &eff->key);
+	if (ret)
+		goto error;
+
+	ret = parse_duration(effect_obj, "timeout", &eff->timeout);
+	if (ret)
+		goto error;
+
+	ret = parse_duration(effect_obj, "cooldown", &eff->cooldown);
+	if (ret)
+		goto error;
+
+	ret = parse_duration(effect_obj, "dwell", &eff->dwell);
+	if (ret)
+		goto error;
+
+	ret = parse_rate(effect_obj, "max_rate", &eff->rate_cnt, &eff->rate_period);
+	if (ret)
+		goto error;
 
-	for (i = 0; i < EFFECT_CNT; i++) {
+	/* effects are not shared, so each one in the running config is carried over once */
+	origin = key_table_find(&old_effect_table, eff->key, effect_moved);
+	if (origin) {
+		belayd_dbg("Keeping effect %s from the running config\n", eff->name);
+		found_effect = true;
+		eff->idx = origin->idx;
+		eff->fns = origin->fns;
+		eff->data = origin->data;
+		eff->home = origin->home;
+		eff->last_run = origin->last_run;
+		eff->credit = origin->credit;
+		eff->refilled = origin->refilled;
+		eff->origin = origin;
+		origin->moved = true;
+	}
+
+	for (i = 0; !origin && i < EFFECT_CNT; i++) {
 		if (strlen(effect_names[i]) != strlen(name))
 			continue;
 
@@ -202,10 +683,12 @@ static int parse_effect(struct rule * const rule, struct json_object * const eff
 			eff->fns = &effect_fns[i];
 
 			belayd_dbg("Initializing effect %s\n", eff->name);
-			ret = (*eff->fns->init)(eff, effect_obj, rule->causes);
+			ret = (*eff->fns->init)(eff, effect_obj, rule->causes, set->data);
 			if (ret)
 				goto error;
 
+			eff->home = arena_get(set->data);
+
 			break;
 		}
 	}
@@ -218,30 +701,478 @@ static int parse_effect(struct rule * const rule, struct json_object * const eff
 
 	/*
 	 * do not goto error after this point.  we have added the eff
-	 * to the effects linked list
+	 * to the rule set
 	 */
-	if (!rule->effects)
-		rule->effects = eff;
-	else
-		rule->effects->next = eff;
+	rule->effect_cnt++;
+	set->effect_cnt++;
 
 	return ret;
 
 error:
-	if (eff && eff->name)
-		free(eff->name);
-
+	/* the slot is reused by the next effect */
 	if (eff)
-		free(eff);
+		memset(eff, 0, sizeof(struct effect));
+
+	return ret;
+}
+
+/*
+ * "when" expressions.  The grammar is, from the loosest binding:
+ *
+ *	expr   := term ("or" term)*
+ *	term   := factor ("and" factor)*
+ *	factor := "not" factor | "(" expr ")" | cause
+ *
+ * A cause is referred to by its "id", or by the name of its plugin if no
+ * other cause in the rule has the same name.  The expression is parsed into
+ * a tree, which is then flattened into the nodes of struct when.
+ */
+#define WHEN_MAX_DEPTH	32
+
+enum when_ast_enum {
+	AST_AND = WHEN_AND,
+	AST_OR = WHEN_OR,
+	AST_NOT,
+	AST_CAUSE,
+};
+
+struct when_ast {
+	enum when_ast_enum type;
+	int cause;			/* index into the rule's causes */
+	struct when_ast *child;		/* the first operand */
+	struct when_ast *next;		/* the next operand of the parent */
+};
+
+struct when_parser {
+	const struct rule *rule;
+	const char * const *ids;	/* the name of each of the rule's causes */
+	const char *str;
+	const char *pos;
+	int depth;
+
+	/* the compiled expression */
+	struct when_node *nodes;
+	int node_cnt;
+	int node_size;
+	uint64_t *masks;
+	int word_cnt;
+};
+
+static int when_error(const struct when_parser * const p, const char * const msg)
+{
+	belayd_err("Invalid when expression in rule %s: %s at offset %d of \"%s\"\n",
+		   p->rule->name, msg, (int)(p->pos - p->str), p->str);
+
+	return -EINVAL;
+}
+
+static void when_ast_free(struct when_ast *ast)
+{
+	struct when_ast *next;
+
+	for (; ast; ast = next) {
+		next = ast->next;
+		when_ast_free(ast->child);
+		free(ast);
+	}
+}
+
+/* child is freed if the node cannot be allocated */
+static int when_ast_new(enum when_ast_enum type, int cause, struct when_ast * const child,
+			struct when_ast ** const ast)
+{
+	*ast = calloc(1, sizeof(struct when_ast));
+	if (!*ast) {
+		when_ast_free(child);
+		return -ENOMEM;
+	}
+
+	(*ast)->type = type;
+	(*ast)->cause = cause;
+	(*ast)->child = child;
+
+	return 0;
+}
+
+/* skip the whitespace, and return the length of the next token */
+static size_t when_token(struct when_parser * const p)
+{
+	const char *end;
+
+	while (*p->pos == ' ' || *p->pos == '\t' || *p->pos == '\n')
+		p->pos++;
+
+	if (*p->pos == '(' || *p->pos == ')')
+		return 1;
+
+	for (end = p->pos; isalnum((unsigned char)*end) || *end == '_' || *end == '-' ||
+	     *end == '.'; end++)
+		;
+
+	return end - p->pos;
+}
+
+static bool when_accept(struct when_parser * const p, const char * const word)
+{
+	size_t len = when_token(p);
+
+	if (len != strlen(word) || strncmp(p->pos, word, len) != 0)
+		return false;
+
+	p->pos += len;
+
+	return true;
+}
+
+static int when_cause(struct when_parser * const p, struct when_ast ** const ast)
+{
+	size_t len = when_token(p);
+	int i, cause = -1;
+
+	if (!len || *p->pos == '(' || *p->pos == ')')
+		return when_error(p, "expected a cause");
+
+	for (i = 0; i < p->rule->cause_cnt; i++) {
+		if (strlen(p->ids[i]) != len || strncmp(p->ids[i], p->pos, len) != 0)
+			continue;
+
+		if (cause >= 0)
+			return when_error(p, "ambiguous cause, give the causes an \"id\"");
+		cause = i;
+	}
+
+	if (cause < 0)
+		return when_error(p, "unknown cause");
+
+	p->pos += len;
+
+	return when_ast_new(AST_CAUSE, cause, NULL, ast);
+}
+
+static int when_expr(struct when_parser * const p, struct when_ast ** const ast);
+
+static int when_factor(struct when_parser * const p, struct when_ast ** const ast)
+{
+	struct when_ast *child;
+	int ret;
+
+	if (++p->depth > WHEN_MAX_DEPTH)
+		return when_error(p, "nested too deeply");
+
+	if (when_accept(p, "not")) {
+		ret = when_factor(p, &child);
+		if (!ret)
+			ret = when_ast_new(AST_NOT, -1, child, ast);
+	} else if (when_accept(p, "(")) {
+		ret = when_expr(p, ast);
+		if (!ret && !when_accept(p, ")")) {
+			when_ast_free(*ast);
+			*ast = NULL;
+			ret = when_error(p, "expected \")\"");
+		}
+	} else {
+		ret = when_cause(p, ast);
+	}
+
+	p->depth--;
+
+	return ret;
+}
+
+/*
+ * One or more operands, separated by word.  Like the other parsing
+ * functions, this leaves *ast untouched or NULL on failure.
+ */
+static int when_binary(struct when_parser * const p, enum when_ast_enum type,
+		       const char * const word,
+		       int (*operand)(struct when_parser * const, struct when_ast ** const),
+		       struct when_ast ** const ast)
+{
+	struct when_ast *first = NULL, *last;
+	int ret;
+
+	ret = (*operand)(p, &first);
+	if (ret)
+		return ret;
+
+	if (!when_accept(p, word)) {
+		*ast = first;
+		return 0;
+	}
+
+	ret = when_ast_new(type, -1, first, ast);
+	if (ret)
+		return ret;
+
+	last = first;
+	do {
+		ret = (*operand)(p, &last->next);
+		if (ret) {
+			when_ast_free(*ast);
+			*ast = NULL;
+			return ret;
+		}
+
+		last = last->next;
+	} while (when_accept(p, word));
+
+	return 0;
+}
+
+static int when_term(struct when_parser * const p, struct when_ast ** const ast)
+{
+	return when_binary(p, AST_AND, "and", when_factor, ast);
+}
+
+static int when_expr(struct when_parser * const p, struct when_ast ** const ast)
+{
+	return when_binary(p, AST_OR, "or", when_term, ast);
+}
+
+static int when_node_add(struct when_parser * const p, enum when_op_enum op, bool negate)
+{
+	struct when_node *nodes;
+	uint64_t *masks;
+	int size;
+
+	if (p->node_cnt == p->node_size) {
+		size = p->node_size ? p->node_size * 2 : 8;
+
+		nodes = realloc(p->nodes, sizeof(struct when_node) * size);
+		if (!nodes)
+			return -ENOMEM;
+		p->nodes = nodes;
+
+		masks = realloc(p->masks, sizeof(uint64_t) * 2 * p->word_cnt * size);
+		if (!masks)
+			return -ENOMEM;
+		p->masks = masks;
+
+		p->node_size = size;
+	}
+
+	memset(&p->masks[2 * p->node_cnt * p->word_cnt], 0, sizeof(uint64_t) * 2 * p->word_cnt);
+
+	p->nodes[p->node_cnt].op = op;
+	p->nodes[p->node_cnt].negate = negate;
+	p->nodes[p->node_cnt].child_cnt = 0;
+	p->nodes[p->node_cnt].size = 1;
+
+	return p->node_cnt++;
+}
+
+/*
+ * Add a cause to the operands of node idx.  Returns false if the node
+ * already has the cause with the opposite sign, e.g. in "a and not a".
+ */
+static bool when_leaf_add(struct when_parser * const p, int idx, int cause, bool negate)
+{
+	uint64_t *mask = &p->masks[2 * idx * p->word_cnt];
+	uint64_t bit = 1ULL << (cause % 64);
+	int word = cause / 64;
+
+	if (mask[word] & bit)
+		return !!(mask[p->word_cnt + word] & bit) == negate;
+
+	mask[word] |= bit;
+	if (negate)
+		mask[p->word_cnt + word] |= bit;
+
+	return true;
+}
+
+static int when_emit(struct when_parser * const p, const struct when_ast *ast, bool negate);
+
+/* add the operands of ast, an AND or an OR, to node idx */
+static int when_operands(struct when_parser * const p, int idx, const struct when_ast * const ast)
+{
+	const struct when_ast *operand, *cur;
+	bool negate;
+	int ret;
+
+	for (operand = ast->child; operand; operand = operand->next) {
+		negate = false;
+		for (cur = operand; cur->type == AST_NOT; cur = cur->child)
+			negate = !negate;
+
+		if (cur->type == AST_CAUSE && when_leaf_add(p, idx, cur->cause, negate))
+			continue;
+
+		/* "a and (b and c)" is the same as "a and b and c" */
+		if (cur->type == ast->type && !negate) {
+			ret = when_operands(p, idx, cur);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		if (p->nodes[idx].child_cnt == UINT16_MAX)
+			return when_error(p, "too many operands");
+
+		ret = when_emit(p, cur, negate);
+		if (ret)
+			return ret;
+
+		p->nodes[idx].child_cnt++;
+	}
+
+	return 0;
+}
+
+static int when_emit(struct when_parser * const p, const struct when_ast *ast, bool negate)
+{
+	int idx, ret = 0;
+
+	for (; ast->type == AST_NOT; ast = ast->child)
+		negate = !negate;
+
+	if (ast->type == AST_CAUSE) {
+		/* a node of its own, e.g. for the whole expression "not a" */
+		idx = when_node_add(p, WHEN_AND, false);
+		if (idx < 0)
+			return idx;
+
+		when_leaf_add(p, idx, ast->cause, negate);
+	} else {
+		idx = when_node_add(p, (enum when_op_enum)ast->type, negate);
+		if (idx < 0)
+			return idx;
+
+		ret = when_operands(p, idx, ast);
+	}
+
+	p->nodes[idx].size = p->node_cnt - idx;
 
 	return ret;
 }
 
-static int parse_rule(struct belayd_opts * const opts, struct json_object * const rule_obj)
+/* copy a compiled expression into the rule set */
+int rule_when_alloc(struct rule_set * const set, struct rule * const rule,
+		    const struct when_node * const nodes, int node_cnt,
+		    const uint64_t * const masks)
+{
+	struct when *when;
+	int word_cnt;
+
+	word_cnt = (rule->cause_cnt + 63) / 64;
+
+	when = arena_alloc(&set->arena, sizeof(struct when));
+	if (!when)
+		return -ENOMEM;
+
+	when->nodes = arena_alloc(&set->arena, sizeof(struct when_node) * node_cnt);
+	when->masks = arena_alloc(&set->arena, sizeof(uint64_t) * 2 * word_cnt * node_cnt);
+	when->known = arena_alloc(&set->arena, sizeof(uint64_t) * word_cnt);
+	when->bits = arena_alloc(&set->arena, sizeof(uint64_t) * word_cnt);
+	if (!when->nodes || !when->masks || !when->known || !when->bits)
+		return -ENOMEM;
+
+	memcpy(when->nodes, nodes, sizeof(struct when_node) * node_cnt);
+	memcpy(when->masks, masks, sizeof(uint64_t) * 2 * word_cnt * node_cnt);
+	when->node_cnt = node_cnt;
+	when->word_cnt = word_cnt;
+
+	rule->when = when;
+
+	return 0;
+}
+
+/* compile the rule's "when" expression, once all of its causes have been added */
+static int parse_when(struct rule_set * const set, struct rule * const rule,
+		      struct json_object * const when_obj, const char * const * const ids)
 {
-	struct json_object *causes_obj, *cause_obj, *effects_obj, *effect_obj;
+	struct when_parser p = { 0 };
+	struct when_ast *ast = NULL;
+	uint64_t used;
+	int ret, i, j;
+
+	if (!rule->cause_cnt) {
+		belayd_err("Rule %s has a when expression but no causes\n", rule->name);
+		return -EINVAL;
+	}
+
+	p.rule = rule;
+	p.ids = ids;
+	p.str = json_object_get_string(when_obj);
+	p.pos = p.str;
+	p.word_cnt = (rule->cause_cnt + 63) / 64;
+
+	ret = when_expr(&p, &ast);
+	if (ret)
+		goto out;
+
+	if (when_token(&p) || *p.pos != '\0') {
+		ret = when_error(&p, "expected \"and\", \"or\" or the end");
+		goto out;
+	}
+
+	ret = when_emit(&p, ast, false);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < rule->cause_cnt; i++) {
+		used = 0;
+		for (j = 0; j < p.node_cnt; j++)
+			used |= p.masks[2 * j * p.word_cnt + i / 64];
+
+		if (!(used & (1ULL << (i % 64)))) {
+			belayd_wrn("Cause %s is not used by the when expression of rule %s\n",
+				   ids[i], rule->name);
+		}
+	}
+
+	ret = rule_when_alloc(set, rule, p.nodes, p.node_cnt, p.masks);
+
+out:
+	when_ast_free(ast);
+	free(p.nodes);
+	free(p.masks);
+
+	return ret;
+}
+
+/* work out how often a rule runs, once all of its causes have been added */
+void rule_schedule(const struct belayd_opts * const opts, struct rule * const rule)
+{
+	struct cause *cse;
+	int i;
+
+	/*
+	 * Unless the rule has its own interval, run it as often as its most
+	 * frequently evaluated cause, but no less often than the global interval
+	 */
+	rule->interval = rule->config_interval;
+	if (!rule->interval) {
+		rule->interval = opts->interval;
+
+		for (i = 0; i < rule->cause_cnt; i++) {
+			cse = &rule->causes[i];
+			if (cse->interval && cse->interval < rule->interval)
+				rule->interval = cse->interval;
+		}
+	}
+
+	/* causes are evaluated in config order until belayd has measured them */
+	rule->eval_causes = rule->causes;
+
+	for (i = 0; i < rule->cause_cnt; i++) {
+		cse = &rule->causes[i];
+		cse->eval_next = cse->next;
+
+		if (cse->interval && cse->interval < rule->interval)
+			belayd_wrn("Cause %s in rule %s will only be evaluated every %d ms\n",
+				   cse->name, rule->name, rule->interval);
+	}
+}
+
+static int parse_rule(struct belayd_opts * const opts, struct rule_set * const set,
+		      struct json_object * const rule_obj)
+{
+	struct json_object *causes_obj, *cause_obj, *effects_obj, *effect_obj, *when_obj;
 	int i, cause_cnt, effect_cnt;
 	struct rule *rule = NULL;
+	const char **ids = NULL;
+	struct rule *origin;
 	json_bool exists;
 	const char *name;
 	int ret = 0;
@@ -250,20 +1181,27 @@ static int parse_rule(struct belayd_opts * const opts, struct json_object * cons
 	if (ret )
 		goto error;
 
-	rule = malloc(sizeof(struct rule));
-	if (!rule) {
-		ret = -ENOMEM;
-		goto error;
-	}
-
+	/* rules are appended to the rule set in config order */
+	rule = &set->rules[set->rule_cnt];
 	memset(rule, 0, sizeof(struct rule));
 
-	rule->name = malloc(strlen(name) + 1);
+	rule->name = arena_strdup(&set->arena, name);
 	if (!rule->name) {
 		ret = -ENOMEM;
 		goto error;
 	}
-	strcpy(rule->name, name);
+
+	ret = canon_key(set, rule_obj, NULL, &rule->key);
+	if (ret)
+		goto error;
+
+	ret = parse_interval(rule_obj, &rule->config_interval);
+	if (ret)
+		goto error;
+
+	ret = parse_bool(rule_obj, "reorder", &rule->reorder, true);
+	if (ret)
+		goto error;
 
 	/*
 	 * Parse the causes
@@ -276,6 +1214,22 @@ static int parse_rule(struct belayd_opts * const opts, struct json_object * cons
 	}
 
 	cause_cnt = json_object_array_length(causes_obj);
+	rule->causes = &set->causes[set->cause_cnt];
+
+	exists = json_object_object_get_ex(rule_obj, "when", &when_obj);
+	if (exists) {
+		if (!json_object_is_type(when_obj, json_type_string)) {
+			belayd_err("The when expression of rule %s is not a string\n", rule->name);
+			ret = -EINVAL;
+			goto error;
+		}
+
+		ids = calloc(cause_cnt ? cause_cnt : 1, sizeof(char *));
+		if (!ids) {
+			ret = -ENOMEM;
+			goto error;
+		}
+	}
 
 	for (i = 0; i < cause_cnt; i++) {
 		cause_obj = json_object_array_get_idx(causes_obj, i);
@@ -285,11 +1239,33 @@ static int parse_rule(struct belayd_opts * const opts, struct json_object * cons
 			goto error;
 		}
 
-		ret = parse_cause(rule, cause_obj);
+		ret = parse_cause(set, rule, cause_obj);
+		if (ret)
+			goto error;
+
+		if (!ids)
+			continue;
+
+		/* a cause without an id is referred to by the name of its plugin */
+		ids[i] = rule->causes[i].name;
+		if (json_object_object_get_ex(cause_obj, "id", NULL)) {
+			ret = parse_string(cause_obj, "id", &ids[i]);
+			if (ret)
+				goto error;
+		}
+	}
+
+	if (!rule->cause_cnt)
+		rule->causes = NULL;
+
+	if (ids) {
+		ret = parse_when(set, rule, when_obj, ids);
 		if (ret)
 			goto error;
 	}
 
+	rule_schedule(opts, rule);
+
 	/*
 	 * Parse the effects
 	 */
@@ -301,6 +1277,7 @@ static int parse_rule(struct belayd_opts * const opts, struct json_object * cons
 	}
 
 	effect_cnt = json_object_array_length(effects_obj);
+	rule->effects = &set->effects[set->effect_cnt];
 
 	for (i = 0; i < effect_cnt; i++) {
 		effect_obj = json_object_array_get_idx(effects_obj, i);
@@ -310,116 +1287,265 @@ static int parse_rule(struct belayd_opts * const opts, struct json_object * cons
 			goto error;
 		}
 
-		ret = parse_effect(rule, effect_obj);
+		ret = parse_effect(set, rule, effect_obj);
 		if (ret)
 			goto error;
 	}
 
 	/*
 	 * do not goto error after this point.  we have added the rule
-	 * to the rules linked list
+	 * to the rule set
 	 */
-	if (!opts->rules)
-		opts->rules = rule;
-	else
-		opts->rules->next = rule;
+	set->rule_cnt++;
+
+	/* an unchanged rule keeps its place in the schedule, see loop_switch() */
+	origin = key_table_find(&old_rule_table, rule->key, rule_moved);
+	if (origin) {
+		rule->origin = origin;
+		origin->moved = true;
+	}
+
+	free(ids);
 
 	return ret;
 
 error:
-	if (rule && rule->name)
-		free(rule->name);
-
+	/*
+	 * the causes and effects that were already set up stay in the rule
+	 * set, and are cleaned up with it
+	 */
 	if (rule)
-		free(rule);
+		memset(rule, 0, sizeof(struct rule));
+
+	free(ids);
 
 	return ret;
 }
 
-static int parse_json(struct belayd_opts * const opts, const char * const buf)
+static int array_length(struct json_object * const obj, const char * const key,
+			struct json_object ** const array_obj)
 {
-	struct json_object *obj, *rules_obj, *rule_obj;
-	enum json_tokener_error err;
-	json_bool exists;
-	int ret = 0, i;
-	int rule_cnt;
+	if (!json_object_object_get_ex(obj, key, array_obj) || !*array_obj ||
+	    !json_object_is_type(*array_obj, json_type_array))
+		return 0;
 
-	obj = json_tokener_parse_verbose(buf, &err);
-	if (!obj || err) {
-		ret = -EINVAL;
-		goto out;
+	return json_object_array_length(*array_obj);
+}
+
+/*
+ * Allocate an empty rule set with room for the given number of objects.  The
+ * counts in set are incremented again as each object is added.
+ */
+int rule_set_alloc(struct rule_set * const set, int rule_cnt, int cause_cnt, int effect_cnt)
+{
+	memset(set, 0, sizeof(struct rule_set));
+
+	set->rules = arena_alloc(&set->arena, sizeof(struct rule) * rule_cnt);
+	set->causes = arena_alloc(&set->arena, sizeof(struct cause) * cause_cnt);
+	set->effects = arena_alloc(&set->arena, sizeof(struct effect) * effect_cnt);
+	set->data = arena_new(DATA_BLOCK_SIZE);
+
+	if (!set->rules || !set->causes || !set->effects || !set->data)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int fill_old_tables(struct rule_set * const old)
+{
+	struct effect *eff;
+	struct cause *cse;
+	int i, ret;
+
+	for (i = 0; i < old->cause_cnt; i++) {
+		cse = &old->causes[i];
+		if (cse->shared || cse->moved)
+			continue;
+
+		ret = key_table_add(&old_cause_table, cse->key, cse);
+		if (ret)
+			return ret;
 	}
 
-	exists = json_object_object_get_ex(obj, "rules", &rules_obj);
-	if (!exists || !rules_obj) {
-		belayd_err("Failed to get \"rules\" object\n");
-		ret = -EINVAL;
+	for (i = 0; i < old->effect_cnt; i++) {
+		eff = &old->effects[i];
+		if (eff->moved)
+			continue;
+
+		ret = key_table_add(&old_effect_table, eff->key, eff);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < old->rule_cnt; i++) {
+		ret = key_table_add(&old_rule_table, old->rules[i].key, &old->rules[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* hand everything that set took over back to the running config */
+static void revert_rule_set(struct rule_set * const set)
+{
+	int i;
+
+	for (i = 0; i < set->cause_cnt; i++) {
+		if (set->causes[i].origin) {
+			set->causes[i].origin->moved = false;
+			set->causes[i].moved = true;
+		}
+	}
+
+	for (i = 0; i < set->effect_cnt; i++) {
+		if (set->effects[i].origin) {
+			set->effects[i].origin->moved = false;
+			set->effects[i].moved = true;
+		}
+	}
+
+	for (i = 0; i < set->rule_cnt; i++) {
+		if (set->rules[i].origin)
+			set->rules[i].origin->moved = false;
+	}
+}
+
+/*
+ * Build a rule set from a config, compiling each rule as soon as it has
+ * been parsed and freeing its JSON straight away.  If old is not NULL, it
+ * is the running config, and the causes and effects that are unchanged are
+ * carried over from it rather than initialized again.  On failure, set is
+ * freed and old is left as it was.
+ */
+int parse_config_stream(struct belayd_opts * const opts, struct config_stream * const s,
+			struct rule_set * const set, struct rule_set * const old)
+{
+	struct json_object *rule_obj = NULL, *array_obj;
+	int ret = 0;
+
+	ret = rule_set_alloc(set, s->rule_cnt, s->cause_cnt, s->effect_cnt);
+	if (ret)
 		goto out;
+
+	if (old) {
+		ret = fill_old_tables(old);
+		if (ret)
+			goto out;
 	}
 
-	rule_cnt = json_object_array_length(rules_obj);
+	while (1) {
+		ret = stream_next(s, &rule_obj);
+		if (ret || !rule_obj)
+			break;
 
-	for (i = 0; i < rule_cnt; i++) {
-		rule_obj = json_object_array_get_idx(rules_obj, i);
-		if (!rule_obj) {
-			belayd_err("Failed to get rule object #%d\n", i);
+		/* e.g. a key that is spelled with escapes was missed by the count */
+		if (set->cause_cnt + array_length(rule_obj, "causes", &array_obj) > s->cause_cnt ||
+		    set->effect_cnt + array_length(rule_obj, "effects", &array_obj) > s->effect_cnt) {
+			belayd_err("Failed to count the causes and effects of rule #%d\n",
+				   set->rule_cnt);
 			ret = -EINVAL;
-			goto out;
+			break;
 		}
 
-		ret = parse_rule(opts, rule_obj);
+		ret = parse_rule(opts, set, rule_obj);
 		if (ret)
-			goto out;
+			break;
+
+		json_object_put(rule_obj);
+		rule_obj = NULL;
 	}
 
 out:
+	if (rule_obj)
+		json_object_put(rule_obj);
+
+	key_table_free(&cause_table);
+	key_table_free(&old_cause_table);
+	key_table_free(&old_effect_table);
+	key_table_free(&old_rule_table);
+
+	if (ret) {
+		revert_rule_set(set);
+		rule_set_free(set);
+	}
+
 	return ret;
 }
 
-int parse_config(struct belayd_opts * const opts)
+/*
+ * Exit every cause and effect in set that still owns its private data, and
+ * free the rule set.  Causes and effects that were carried over by a reload
+ * are left alone.
+ */
+void rule_set_free(struct rule_set * const set)
 {
-	FILE *config_fd = NULL;
-	long config_size = 0;
-	size_t chars_read;
-	char *buf = NULL;
-	int ret;
+	struct effect *eff;
+	struct cause *cse;
+	int i;
 
-	config_fd = fopen(opts->config, "r");
-	if (!config_fd) {
-		belayd_err("Failed to fopen %s\n", opts->config);
-		ret = -errno;
-		goto out;
+	/*
+	 * every cause and effect in the arrays was successfully initialized,
+	 * including those of a rule that later failed to parse
+	 */
+	for (i = 0; i < set->cause_cnt; i++) {
+		cse = &set->causes[i];
+		/* a shared instance outlives its duplicates in later rules */
+		if (cse->shared || cse->moved)
+			continue;
+
+		belayd_dbg("Cleaning up cause %s\n", cse->name);
+		if (cse->fns->exit)
+			(*cse->fns->exit)(cse);
+		arena_put(cse->home);
 	}
 
-	ret = get_file_size(config_fd, &config_size);
-	if (ret)
-		goto out;
+	for (i = 0; i < set->effect_cnt; i++) {
+		eff = &set->effects[i];
+		if (eff->moved)
+			continue;
 
-	buf = malloc(sizeof(char) * (config_size + 1));
-	if (!buf) {
-		ret = -ENOMEM;
-		goto out;
+		belayd_dbg("Cleaning up effect %s\n", eff->name);
+		if (eff->fns->exit)
+			(*eff->fns->exit)(eff);
+		arena_put(eff->home);
 	}
 
-	chars_read = fread(buf, sizeof(char), config_size, config_fd);
-	if (chars_read != config_size) {
-		belayd_err("Expected to read %d bytes but read %d bytes\n",
-			   config_size, chars_read);
-		ret = -EIO;
-		goto out;
+	if (set->data)
+		arena_put(set->data);
+
+	free(set->metrics);
+
+	/* this frees the rule set itself along with all of its contents */
+	arena_free(&set->arena);
+	memset(set, 0, sizeof(struct rule_set));
+}
+
+int parse_config(struct belayd_opts * const opts)
+{
+	struct config_stream s;
+	uint64_t start;
+	int ret;
+
+	trace(config__start, opts->config);
+	start = trace_enabled(config__done) ? clock_real_ns() : 0;
+
+	/* prefer the compiled image, unless it is being compiled */
+	if (!opts->compile) {
+		ret = image_load(opts, &opts->set);
+		if (!ret)
+			goto out;
 	}
-	buf[config_size] = '\0';
 
-	ret = parse_json(opts, buf);
+	ret = stream_open(opts->config, &s, false);
 	if (ret)
 		goto out;
 
-out:
-	if (config_fd)
-		fclose(config_fd);
+	ret = parse_config_stream(opts, &s, &opts->set, NULL);
+	stream_close(&s);
 
-	if (buf)
-		free(buf);
+out:
+	trace(config__done, opts->config, ret, start ? clock_real_ns() - start : 0);
 
 	return ret;
 }
@@ -0,0 +1,215 @@
+// LICENSE TBD
+/**
+ * Worker thread pool for belayd
+ *
+ * The causes of the rules that are due in a tick can be evaluated by a
+ * pool of worker threads, so that a cause that blocks, e.g. on a busy
+ * cgroup, does not hold up every other rule.  The main thread hands the
+ * pool a batch of tasks and takes part in running it.  The batch is split
+ * into one contiguous range per thread.  Each thread works through its own
+ * range and then steals from the others' until every range is empty.  Both
+ * owners and thieves take the next task in a range with a single atomic
+ * increment, so no locks are taken while a batch runs.
+ *
+ * Each thread evaluates causes with its own copy of the tick's cause_ctx,
+ * because the lazily read samples in it are not shared between threads.
+ * pool_run() returns once every task of the batch has completed.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "belayd-internal.h"
+
+#define POOL_MAX_THREADS	1024
+#define POOL_CACHE_LINE		64
+
+/* the range of tasks that a thread starts with */
+struct pool_range {
+	unsigned int next;	/* taken with an atomic increment */
+	unsigned int end;
+
+	struct cause_ctx ctx;
+} __attribute__((aligned(POOL_CACHE_LINE)));
+
+static struct {
+	/* every thread that runs tasks, including the main thread at index 0 */
+	int thread_cnt;
+	pthread_t *threads;
+	struct pool_range *ranges;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+
+	/* the current batch, protected by lock */
+	unsigned int gen;
+	int busy;		/* workers that have not finished the batch */
+	bool exiting;
+
+	pool_fn fn;
+	void *data;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static void pool_work(int self)
+{
+	struct cause_ctx *ctx = &pool.ranges[self].ctx;
+	struct pool_range *range;
+	unsigned int task;
+	int i;
+
+	/* start with our own range, then steal from the others' */
+	for (i = 0; i < pool.thread_cnt; i++) {
+		range = &pool.ranges[(self + i) % pool.thread_cnt];
+
+		while (1) {
+			task = __atomic_fetch_add(&range->next, 1, __ATOMIC_RELAXED);
+			if (task >= range->end)
+				break;
+
+			(*pool.fn)(task, ctx, pool.data);
+		}
+	}
+}
+
+static void *pool_thread(void *arg)
+{
+	int self = (int)(intptr_t)arg;
+	unsigned int gen = 0;
+
+	pthread_mutex_lock(&pool.lock);
+
+	while (1) {
+		while (pool.gen == gen && !pool.exiting)
+			pthread_cond_wait(&pool.start, &pool.lock);
+
+		if (pool.exiting)
+			break;
+
+		gen = pool.gen;
+		pthread_mutex_unlock(&pool.lock);
+
+		pool_work(self);
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.busy == 0)
+			pthread_cond_signal(&pool.done);
+	}
+
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+/*
+ * Run fn once for each task in [0, task_cnt).  ctx is the tick's snapshot,
+ * of which each thread gets a copy.
+ */
+void pool_run(int task_cnt, pool_fn fn, void *data, struct cause_ctx * const ctx)
+{
+	int i;
+
+	/* waking the workers is not worth it for a single task */
+	if (pool.thread_cnt <= 1 || task_cnt <= 1) {
+		for (i = 0; i < task_cnt; i++)
+			(*fn)(i, ctx, data);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+
+	pool.fn = fn;
+	pool.data = data;
+
+	for (i = 0; i < pool.thread_cnt; i++) {
+		pool.ranges[i].next = (unsigned int)((long)task_cnt * i / pool.thread_cnt);
+		pool.ranges[i].end = (unsigned int)((long)task_cnt * (i + 1) / pool.thread_cnt);
+		memcpy(&pool.ranges[i].ctx, ctx, sizeof(struct cause_ctx));
+	}
+
+	pool.busy = pool.thread_cnt - 1;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	pool_work(0);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.busy)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * Start the pool with thread_cnt threads in total, i.e. thread_cnt - 1
+ * workers alongside the main thread.  0 means one thread per online CPU.
+ * Signals must already be blocked, so that the workers inherit the mask.
+ */
+int pool_init(int thread_cnt)
+{
+	int ret, i;
+
+	if (thread_cnt == 0)
+		thread_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+	if (thread_cnt < 1)
+		thread_cnt = 1;
+	if (thread_cnt > POOL_MAX_THREADS)
+		thread_cnt = POOL_MAX_THREADS;
+
+	if (thread_cnt == 1)
+		return 0;
+
+	pool.ranges = aligned_alloc(POOL_CACHE_LINE, sizeof(struct pool_range) * thread_cnt);
+	pool.threads = calloc(thread_cnt, sizeof(pthread_t));
+	if (!pool.ranges || !pool.threads)
+		return -ENOMEM;
+
+	memset(pool.ranges, 0, sizeof(struct pool_range) * thread_cnt);
+	pool.exiting = false;
+	pool.thread_cnt = 1;
+
+	for (i = 1; i < thread_cnt; i++) {
+		ret = pthread_create(&pool.threads[i], NULL, pool_thread, (void *)(intptr_t)i);
+		if (ret) {
+			belayd_err("Failed to start worker thread %d: %d\n", i, ret);
+			return -ret;
+		}
+
+		pool.thread_cnt++;
+	}
+
+	belayd_info("Evaluating causes on %d threads\n", pool.thread_cnt);
+
+	return 0;
+}
+
+void pool_exit(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.exiting = true;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 1; i < pool.thread_cnt; i++)
+		pthread_join(pool.threads[i], NULL);
+
+	free(pool.threads);
+	free(pool.ranges);
+
+	pool.threads = NULL;
+	pool.ranges = NULL;
+	pool.thread_cnt = 0;
+}
@@ -0,0 +1,248 @@
+// LICENSE TBD
+/**
+ * Configuration reload for belayd
+ *
+ * belayd reloads its config file on SIGHUP, and whenever the file is
+ * written or replaced, which it learns about via inotify on the file's
+ * directory.  The file is read and its rules are parsed into JSON by a
+ * separate thread, so that a large config does not delay the rules'
+ * ticks.  The new rule set is then built and diffed against the running
+ * one on the main loop's thread, between ticks, because the plugins'
+ * init() and exit() hooks are not thread safe.  Unchanged causes and
+ * effects keep their private data, and unchanged rules keep their
+ * schedule; see parse_config_stream() and loop_switch().  If the new
+ * config is invalid, the running one is kept.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "belayd-internal.h"
+#include "defines.h"
+
+#define RELOAD_EVENT_BUF_SIZE (16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+static struct {
+	struct belayd_opts *opts;
+
+	/* the watched directory and the config's name within it */
+	char dir[FILENAME_MAX];
+	const char *file;
+
+	int inotify_fd;
+	int done_fd;		/* eventfd, signalled by the thread when it is done */
+
+	pthread_t thread;
+	bool running;
+	bool pending;		/* another reload was requested while running */
+
+	/* results of the thread, only valid once done_fd is signalled */
+	struct config_stream stream;
+	int ret;
+} reload = {
+	.inotify_fd = -1,
+	.done_fd = -1,
+};
+
+static void *reload_thread(void *arg)
+{
+	uint64_t done = 1;
+
+	reload.ret = stream_open(reload.opts->config, &reload.stream, true);
+	if (!reload.ret) {
+		reload.ret = stream_read_all(&reload.stream);
+		if (reload.ret)
+			stream_close(&reload.stream);
+	}
+
+	if (write(reload.done_fd, &done, sizeof(done)) != sizeof(done))
+		belayd_err("Failed to signal the end of the reload: %d\n", errno);
+
+	return NULL;
+}
+
+int reload_request(void)
+{
+	int ret;
+
+	if (reload.running) {
+		/* parse the file again once the current reload has finished */
+		reload.pending = true;
+		return 0;
+	}
+
+	ret = pthread_create(&reload.thread, NULL, reload_thread, NULL);
+	if (ret) {
+		belayd_err("Failed to start the reload of %s: %d\n", reload.opts->config, ret);
+		return 0;
+	}
+
+	reload.running = true;
+
+	return 0;
+}
+
+static int reload_done(int fd, uint32_t events, void *data)
+{
+	struct belayd_opts *opts = (struct belayd_opts *)data;
+	struct rule_set set;
+	uint64_t done;
+	int ret;
+
+	if (read(fd, &done, sizeof(done)) != sizeof(done))
+		return errno == EAGAIN ? 0 : -errno;
+
+	pthread_join(reload.thread, NULL);
+	reload.running = false;
+
+	if (reload.pending) {
+		/* the file changed again while it was being parsed */
+		reload.pending = false;
+		stream_close(&reload.stream);
+
+		return reload_request();
+	}
+
+	if (reload.ret) {
+		belayd_err("Failed to reload %s, keeping the running config\n", opts->config);
+		return 0;
+	}
+
+	ret = parse_config_stream(opts, &reload.stream, &set, &opts->set);
+	stream_close(&reload.stream);
+
+	if (ret) {
+		belayd_err("Invalid config in %s, keeping the running config: %d\n",
+			   opts->config, ret);
+		return 0;
+	}
+
+	return loop_switch(opts, &set);
+}
+
+static int reload_inotify(int fd, uint32_t events, void *data)
+{
+	char buf[RELOAD_EVENT_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool changed = false;
+	ssize_t bytes;
+	char *pos;
+
+	while (1) {
+		bytes = read(fd, buf, sizeof(buf));
+		if (bytes <= 0)
+			break;
+
+		for (pos = buf; pos < buf + bytes; pos += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)pos;
+
+			if (ev->mask & IN_Q_OVERFLOW)
+				changed = true;
+			else if (ev->len && strcmp(ev->name, reload.file) == 0)
+				changed = true;
+		}
+	}
+
+	if (bytes < 0 && errno != EAGAIN) {
+		belayd_err("Failed to read the config watch: %d\n", errno);
+		return -errno;
+	}
+
+	if (!changed)
+		return 0;
+
+	belayd_info("%s changed, reloading it\n", reload.opts->config);
+
+	return reload_request();
+}
+
+/*
+ * Watch the directory rather than the file itself, so that a config that
+ * is replaced by rename(), as most editors and config managers do, is seen
+ */
+static int reload_watch(const char * const config)
+{
+	char *slash;
+	int wd;
+
+	if (strlen(config) >= sizeof(reload.dir))
+		return -ENAMETOOLONG;
+
+	strcpy(reload.dir, config);
+
+	slash = strrchr(reload.dir, '/');
+	if (slash) {
+		reload.file = config + (slash - reload.dir) + 1;
+		if (slash == reload.dir)
+			slash[1] = '\0';
+		else
+			slash[0] = '\0';
+	} else {
+		reload.file = config;
+		strcpy(reload.dir, ".");
+	}
+
+	reload.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (reload.inotify_fd < 0) {
+		belayd_err("Failed to create the config watch: %d\n", errno);
+		return -errno;
+	}
+
+	wd = inotify_add_watch(reload.inotify_fd, reload.dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd < 0) {
+		belayd_err("Failed to watch %s: %d\n", reload.dir, errno);
+		return -errno;
+	}
+
+	return belayd_event_add(reload.inotify_fd, EPOLLIN, reload_inotify, NULL);
+}
+
+int reload_init(struct belayd_opts * const opts)
+{
+	int ret;
+
+	reload.opts = opts;
+
+	reload.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reload.done_fd < 0) {
+		belayd_err("Failed to create the reload eventfd: %d\n", errno);
+		return -errno;
+	}
+
+	ret = belayd_event_add(reload.done_fd, EPOLLIN, reload_done, opts);
+	if (ret)
+		return ret;
+
+	return reload_watch(opts->config);
+}
+
+void reload_exit(void)
+{
+	if (reload.running) {
+		pthread_join(reload.thread, NULL);
+		reload.running = false;
+	}
+
+	stream_close(&reload.stream);
+
+	/* the event sources themselves are freed by loop_exit() */
+	if (reload.inotify_fd >= 0)
+		close(reload.inotify_fd);
+	if (reload.done_fd >= 0)
+		close(reload.done_fd);
+
+	reload.inotify_fd = -1;
+	reload.done_fd = -1;
+}
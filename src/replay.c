@@ -0,0 +1,470 @@
+// LICENSE TBD
+/**
+ * Replay mode for belayd
+ *
+ * With --replay, belayd does not look at the system it runs on.  It reads
+ * recorded samples from a file instead, and runs the rules against them
+ * on a virtual clock (see clock.h) as fast as it can.  The effects of the
+ * rules that trip are not run.  A line is written to stdout for each of
+ * them instead, e.g.
+ *
+ *	{"time": 1688212805.000, "rule": "Low memory", "effect": "cgroup_setting"}
+ *
+ * The file has one JSON object per line, in increasing order of time:
+ *
+ *	{"time": 1688212800, "files": {"/proc/meminfo": "MemAvailable: 1024 kB\n"},
+ *	 "events": ["/proc/pressure/memory"]}
+ *
+ * - time is the wall-clock time of the sample, in seconds since the epoch.
+ *   The replay starts at the time of the first sample, and ends once the
+ *   rules that are due at the time of the last sample have run.
+ * - files holds the contents of the files that the causes read, e.g.
+ *   /proc/meminfo or a cgroup's memory.stat.  A file keeps its contents
+ *   until a later sample records it again, so only the files that changed
+ *   need to be recorded.
+ * - events lists the files whose PSI trigger fired at that time.
+ *
+ * time_of_day and days_of_the_week only need the time, so a file with two
+ * samples replays a whole week of them.  A sample is applied before the
+ * rules that are due at the same time are run.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <json-c/json.h>
+#include <sys/epoll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "belayd-internal.h"
+
+/* a file that the causes read, see replay_read() */
+struct replay_file {
+	char *path;
+	char *data;		/* the most recently recorded contents, or NULL */
+	size_t len;
+
+	struct replay_file *next;
+};
+
+/* a cause that waits for the events of a file, see replay_event_add() */
+struct replay_event {
+	const char *path;
+	event_fn fn;
+	void *data;
+
+	struct replay_event *next;
+};
+
+static struct {
+	bool enabled;
+	const char *path;
+	FILE *in;
+	int line;
+	char *buf;
+	size_t buf_size;
+
+	/* the next sample to apply, or NULL once the file has been read */
+	struct json_object *next;
+	uint64_t next_ms;
+	uint64_t last_ms;	/* the time of the last sample, once it has been read */
+
+	struct replay_file *files;
+	struct replay_event *events;
+} replay;
+
+bool replay_enabled(void)
+{
+	return replay.enabled;
+}
+
+/* read the next sample from the file into replay.next */
+static int replay_next(void)
+{
+	struct json_object *time_obj;
+	ssize_t len;
+	double secs;
+	uint64_t ms;
+
+	replay.next = NULL;
+
+	while (1) {
+		len = getline(&replay.buf, &replay.buf_size, replay.in);
+		if (len < 0) {
+			if (ferror(replay.in)) {
+				belayd_err("Failed to read %s: %d\n", replay.path, errno);
+				return -EIO;
+			}
+
+			return 0;
+		}
+
+		replay.line++;
+
+		/* skip blank lines */
+		if (strspn(replay.buf, " \t\r\n") != len)
+			break;
+	}
+
+	replay.next = json_tokener_parse(replay.buf);
+	if (!replay.next || !json_object_is_type(replay.next, json_type_object)) {
+		belayd_err("%s:%d: Invalid sample\n", replay.path, replay.line);
+		goto err;
+	}
+
+	if (!json_object_object_get_ex(replay.next, "time", &time_obj) ||
+	    (!json_object_is_type(time_obj, json_type_int) &&
+	     !json_object_is_type(time_obj, json_type_double))) {
+		belayd_err("%s:%d: The sample has no time\n", replay.path, replay.line);
+		goto err;
+	}
+
+	secs = json_object_get_double(time_obj);
+	if (secs < 0) {
+		belayd_err("%s:%d: Invalid time: %f\n", replay.path, replay.line, secs);
+		goto err;
+	}
+
+	ms = (uint64_t)(secs * 1000 + 0.5);
+	if (ms < replay.next_ms) {
+		belayd_err("%s:%d: The sample is older than the one before it\n", replay.path,
+			   replay.line);
+		goto err;
+	}
+
+	replay.next_ms = ms;
+
+	return 0;
+
+err:
+	if (replay.next)
+		json_object_put(replay.next);
+	replay.next = NULL;
+
+	return -EINVAL;
+}
+
+static struct replay_file *replay_file_find(const char * const path)
+{
+	struct replay_file *rf;
+
+	for (rf = replay.files; rf; rf = rf->next) {
+		if (strcmp(rf->path, path) == 0)
+			return rf;
+	}
+
+	return NULL;
+}
+
+static int replay_file_set(const char * const path, struct json_object * const obj)
+{
+	struct replay_file *rf;
+	size_t len;
+	char *data;
+
+	if (!json_object_is_type(obj, json_type_string)) {
+		belayd_err("%s:%d: The contents of %s are not a string\n", replay.path,
+			   replay.line, path);
+		return -EINVAL;
+	}
+
+	rf = replay_file_find(path);
+	if (!rf) {
+		rf = calloc(1, sizeof(struct replay_file));
+		if (!rf)
+			return -ENOMEM;
+
+		rf->path = strdup(path);
+		if (!rf->path) {
+			free(rf);
+			return -ENOMEM;
+		}
+
+		rf->next = replay.files;
+		replay.files = rf;
+	}
+
+	len = json_object_get_string_len(obj);
+	data = malloc(len + 1);
+	if (!data)
+		return -ENOMEM;
+
+	memcpy(data, json_object_get_string(obj), len + 1);
+
+	free(rf->data);
+	rf->data = data;
+	rf->len = len;
+
+	return 0;
+}
+
+/* fire the events of every cause that waits for the file */
+static int replay_fire(const char * const path)
+{
+	struct replay_event *ev, *ev_next;
+	int ret;
+
+	/* the handler may remove its own registration */
+	for (ev = replay.events; ev; ev = ev_next) {
+		ev_next = ev->next;
+
+		if (strcmp(ev->path, path) != 0)
+			continue;
+
+		ret = (*ev->fn)(-1, EPOLLPRI, ev->data);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* apply replay.next, and read the sample after it */
+static int replay_apply(void)
+{
+	struct json_object_iterator it, end;
+	struct json_object *obj, *ev_obj;
+	int ret = 0, i, cnt;
+
+	if (json_object_object_get_ex(replay.next, "files", &obj)) {
+		if (!json_object_is_type(obj, json_type_object)) {
+			belayd_err("%s:%d: files is not an object\n", replay.path, replay.line);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		it = json_object_iter_begin(obj);
+		end = json_object_iter_end(obj);
+		while (!json_object_iter_equal(&it, &end)) {
+			ret = replay_file_set(json_object_iter_peek_name(&it),
+					      json_object_iter_peek_value(&it));
+			if (ret)
+				goto out;
+
+			json_object_iter_next(&it);
+		}
+	}
+
+	if (json_object_object_get_ex(replay.next, "events", &obj)) {
+		if (!json_object_is_type(obj, json_type_array)) {
+			belayd_err("%s:%d: events is not an array\n", replay.path, replay.line);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		cnt = json_object_array_length(obj);
+		for (i = 0; i < cnt; i++) {
+			ev_obj = json_object_array_get_idx(obj, i);
+			if (!json_object_is_type(ev_obj, json_type_string)) {
+				belayd_err("%s:%d: Invalid event\n", replay.path, replay.line);
+				ret = -EINVAL;
+				goto out;
+			}
+
+			ret = replay_fire(json_object_get_string(ev_obj));
+			if (ret)
+				goto out;
+		}
+	}
+
+	replay.last_ms = replay.next_ms;
+	json_object_put(replay.next);
+	ret = replay_next();
+
+out:
+	return ret;
+}
+
+/*
+ * Read the recorded contents of a file, like pread() at offset 0.  Returns
+ * -1 with errno set to ENOENT if no sample so far has recorded the file.
+ */
+ssize_t replay_read(const char * const path, char * const buf, size_t size)
+{
+	struct replay_file *rf;
+	size_t len;
+
+	rf = replay_file_find(path);
+	if (!rf || !rf->data) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	len = rf->len < size ? rf->len : size;
+	memcpy(buf, rf->data, len);
+
+	return len;
+}
+
+/* Call fn(-1, EPOLLPRI, data) whenever a sample lists path in its events */
+int replay_event_add(const char * const path, event_fn fn, void *data)
+{
+	struct replay_event *ev;
+
+	ev = malloc(sizeof(struct replay_event));
+	if (!ev)
+		return -ENOMEM;
+
+	ev->path = path;
+	ev->fn = fn;
+	ev->data = data;
+	ev->next = replay.events;
+	replay.events = ev;
+
+	return 0;
+}
+
+void replay_event_del(const void * const data)
+{
+	struct replay_event *ev, **prev;
+
+	for (prev = &replay.events; *prev; prev = &(*prev)->next) {
+		ev = *prev;
+		if (ev->data == data) {
+			*prev = ev->next;
+			free(ev);
+			return;
+		}
+	}
+}
+
+static void replay_print_str(const char *str)
+{
+	putc_unlocked('"', stdout);
+
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\') {
+			putc_unlocked('\\', stdout);
+			putc_unlocked(*str, stdout);
+		} else if ((unsigned char)*str < 0x20) {
+			printf("\\u%04x", *str);
+		} else {
+			putc_unlocked(*str, stdout);
+		}
+	}
+
+	putc_unlocked('"', stdout);
+}
+
+/* record an effect that would have run at the current time */
+void replay_effect(const struct rule * const rule, const struct effect * const eff)
+{
+	uint64_t now = clock_wall_ms();
+
+	/* the log may be written to stdout as well */
+	flockfile(stdout);
+
+	printf("{\"time\": %llu.%03llu, \"rule\": ", (unsigned long long)(now / 1000),
+	       (unsigned long long)(now % 1000));
+	replay_print_str(rule->name);
+	printf(", \"effect\": ");
+	replay_print_str(eff->name);
+	printf("}\n");
+
+	funlockfile(stdout);
+}
+
+/*
+ * Open the samples and start the virtual clock at the time of the first
+ * one.  This must be called before the config is parsed, so that the causes
+ * know not to open their files.
+ */
+int replay_init(struct belayd_opts * const opts)
+{
+	int ret;
+
+	replay.path = opts->replay;
+	replay.in = fopen(replay.path, "r");
+	if (!replay.in) {
+		belayd_err("Failed to open %s: %d\n", replay.path, errno);
+		return -errno;
+	}
+
+	ret = replay_next();
+	if (ret)
+		return ret;
+
+	if (!replay.next) {
+		belayd_err("%s has no samples\n", replay.path);
+		return -EINVAL;
+	}
+
+	clock_set(replay.next_ms);
+	replay.enabled = true;
+
+	belayd_info("Replaying %s\n", replay.path);
+
+	return 0;
+}
+
+/*
+ * Run the rules against the samples.  The clock jumps straight from one
+ * sample or rule deadline to the next, whichever comes first.
+ */
+int replay_run(struct belayd_opts * const opts)
+{
+	uint64_t next;
+	int ret;
+
+	ret = loop_start(opts, clock_mono_ms());
+	if (ret)
+		return ret;
+
+	while (1) {
+		next = loop_next();
+
+		if (replay.next && replay.next_ms <= next) {
+			clock_set(replay.next_ms);
+
+			ret = replay_apply();
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		/* the rules have run at the time of the last sample */
+		if (!replay.next && next > replay.last_ms)
+			break;
+
+		clock_set(next);
+
+		ret = loop_tick(opts, next);
+		if (ret)
+			return ret;
+	}
+
+	belayd_info("Replayed %d lines of %s\n", replay.line, replay.path);
+
+	return 0;
+}
+
+void replay_exit(void)
+{
+	struct replay_event *ev, *ev_next;
+	struct replay_file *rf, *rf_next;
+
+	for (rf = replay.files; rf; rf = rf_next) {
+		rf_next = rf->next;
+		free(rf->path);
+		free(rf->data);
+		free(rf);
+	}
+
+	for (ev = replay.events; ev; ev = ev_next) {
+		ev_next = ev->next;
+		free(ev);
+	}
+
+	if (replay.next)
+		json_object_put(replay.next);
+	if (replay.in)
+		fclose(replay.in);
+	free(replay.buf);
+
+	memset(&replay, 0, sizeof(replay));
+	fflush(stdout);
+}
@@ -0,0 +1,558 @@
+// LICENSE TBD
+/**
+ * Streaming config loader for belayd
+ *
+ * The config file is mmap'd rather than copied into a buffer, and is never
+ * parsed into a single JSON document.  stream_open() first makes one pass
+ * over the file, without allocating, that checks its layout, finds the
+ * "rules" array and counts the rules, causes and effects so that the rule
+ * set can be allocated up front.  stream_next() then hands json-c one rule
+ * at a time, and the caller compiles and frees each rule's JSON before the
+ * next one is parsed.  The pages of the file that have been consumed are
+ * dropped as the passes go, so even a config of several hundred megabytes
+ * is never resident all at once.
+ *
+ * A reload reads the file into a buffer instead.  The file may be
+ * truncated or rewritten in place while belayd is running, and touching
+ * a page of a mapping past the new end of the file raises SIGBUS, which
+ * would kill belayd rather than fail the reload.  The reload thread holds
+ * the JSON of every rule at once anyway, so the copy costs little more.
+ * At startup nothing is running yet, so the mapping is kept there.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <json-c/json.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "belayd-internal.h"
+
+/* deeper than json-c's own default limit, which applies to each rule */
+#define STREAM_MAX_DEPTH	64
+
+/* consumed pages are dropped in chunks of this size */
+#define STREAM_RELEASE_SIZE	(1024 * 1024)
+
+typedef const char *(*member_fn)(struct config_stream * const s, const char * const key,
+				 size_t len, const char *p, const char * const end);
+
+static size_t page_mask;
+
+static inline const char *skip_ws(const char *p, const char * const end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		p++;
+
+	return p;
+}
+
+static inline bool key_is(const char * const key, size_t len, const char * const name)
+{
+	return len == strlen(name) && memcmp(key, name, len) == 0;
+}
+
+/* return the end of the string that starts at p, or NULL if it is not terminated */
+static const char *skip_string(const char *p, const char * const end)
+{
+	for (p++; p < end; p++) {
+		if (*p == '\\')
+			p++;
+		else if (*p == '"')
+			return p + 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Return the end of the value that starts at p, or NULL if its brackets do
+ * not match.  The contents are validated by json-c when the value is
+ * parsed.  If the value is an array and cnt is not NULL, the number of
+ * elements in the array is added to *cnt.
+ */
+static const char *skip_value(const char *p, const char * const end, int * const cnt)
+{
+	char stack[STREAM_MAX_DEPTH];
+	int depth = 0, commas = 0;
+	bool empty = true;
+
+	if (p == end)
+		return NULL;
+
+	if (*p == '"')
+		return skip_string(p, end);
+
+	if (*p != '{' && *p != '[') {
+		/* a number, true, false or null */
+		while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' &&
+		       *p != '\t' && *p != '\n' && *p != '\r')
+			p++;
+
+		return p;
+	}
+
+	for (; p < end; p++) {
+		switch (*p) {
+		case '"':
+			p = skip_string(p, end);
+			if (!p)
+				return NULL;
+			/* the loop steps over the closing quote */
+			p--;
+			empty = false;
+			break;
+		case '{':
+		case '[':
+			if (depth == STREAM_MAX_DEPTH)
+				return NULL;
+
+			if (depth)
+				empty = false;
+			stack[depth++] = *p == '{' ? '}' : ']';
+			break;
+		case '}':
+		case ']':
+			if (stack[--depth] != *p)
+				return NULL;
+
+			if (depth == 0) {
+				if (cnt && *p == ']' && !empty)
+					*cnt += commas + 1;
+				return p + 1;
+			}
+			break;
+		case ',':
+			if (depth == 1)
+				commas++;
+			break;
+		case ' ':
+		case '\t':
+		case '\n':
+		case '\r':
+			break;
+		default:
+			empty = false;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Call fn for every member of the object that starts at p, and return the
+ * end of the object
+ */
+static const char *scan_object(struct config_stream * const s, const char *p,
+			       const char * const end, member_fn fn)
+{
+	const char *key;
+	size_t len;
+
+	p = skip_ws(p + 1, end);
+	if (p < end && *p == '}')
+		return p + 1;
+
+	while (p < end) {
+		if (*p != '"')
+			return NULL;
+
+		key = p + 1;
+		p = skip_string(p, end);
+		if (!p)
+			return NULL;
+		len = p - 1 - key;
+
+		p = skip_ws(p, end);
+		if (p == end || *p != ':')
+			return NULL;
+
+		p = fn(s, key, len, skip_ws(p + 1, end), end);
+		if (!p)
+			return NULL;
+
+		p = skip_ws(p, end);
+		if (p == end)
+			return NULL;
+		if (*p == '}')
+			return p + 1;
+		if (*p != ',')
+			return NULL;
+
+		p = skip_ws(p + 1, end);
+	}
+
+	return NULL;
+}
+
+/* drop the consumed pages of the file, which are read again from the page cache if needed */
+static void stream_release(struct config_stream * const s, const char * const p, bool all)
+{
+	size_t off = all ? s->size : (size_t)(p - s->map) & page_mask;
+
+	if (s->copied)
+		return;
+
+	if (off <= s->released || (!all && off - s->released < STREAM_RELEASE_SIZE))
+		return;
+
+	madvise((void *)(s->map + s->released), off - s->released, MADV_DONTNEED);
+	s->released = off;
+}
+
+static const char *rule_member(struct config_stream * const s, const char * const key,
+			       size_t len, const char *p, const char * const end)
+{
+	if (key_is(key, len, "causes"))
+		return skip_value(p, end, &s->cause_cnt);
+	if (key_is(key, len, "effects"))
+		return skip_value(p, end, &s->effect_cnt);
+
+	return skip_value(p, end, NULL);
+}
+
+static const char *scan_rules(struct config_stream * const s, const char *p,
+			      const char * const end)
+{
+	if (p == end || *p != '[') {
+		s->err = "\"rules\" is not an array";
+		return NULL;
+	}
+
+	s->pos = p + 1;
+
+	p = skip_ws(p + 1, end);
+	if (p < end && *p == ']')
+		return p + 1;
+
+	while (p < end) {
+		if (*p == '{')
+			p = scan_object(s, p, end, rule_member);
+		else
+			/* reported by stream_next() */
+			p = skip_value(p, end, NULL);
+		if (!p)
+			return NULL;
+
+		s->rule_cnt++;
+		stream_release(s, p, false);
+
+		p = skip_ws(p, end);
+		if (p == end)
+			return NULL;
+		if (*p == ']')
+			return p + 1;
+		if (*p != ',')
+			return NULL;
+
+		p = skip_ws(p + 1, end);
+	}
+
+	return NULL;
+}
+
+static const char *top_member(struct config_stream * const s, const char * const key,
+			      size_t len, const char *p, const char * const end)
+{
+	if (!key_is(key, len, "rules"))
+		return skip_value(p, end, NULL);
+
+	if (s->pos) {
+		s->err = "more than one \"rules\" array";
+		return NULL;
+	}
+
+	return scan_rules(s, p, end);
+}
+
+/* find out what is wrong with a file that the layout scan rejected */
+static void stream_diagnose(struct config_stream * const s)
+{
+	enum json_tokener_error err = json_tokener_success;
+	struct json_object *obj = NULL;
+
+	if (!s->err && s->size <= INT_MAX) {
+		obj = json_tokener_parse_ex(s->tok, s->map, s->size);
+		err = json_tokener_get_error(s->tok);
+		json_tokener_reset(s->tok);
+	}
+
+	if (s->err) {
+		belayd_err("Failed to parse %s: %s\n", s->path, s->err);
+	} else if (!obj && err == json_tokener_continue) {
+		belayd_err("Failed to parse %s: unexpected end of file\n", s->path);
+	} else if (!obj && err != json_tokener_success) {
+		belayd_err("Failed to parse %s: %s\n", s->path, json_tokener_error_desc(err));
+	} else {
+		belayd_err("Failed to parse %s: malformed config\n", s->path);
+	}
+
+	if (obj)
+		json_object_put(obj);
+}
+
+/* read the file into a buffer, which is shorter than size if the file shrank */
+static int stream_copy(struct config_stream * const s, int fd, size_t size)
+{
+	ssize_t bytes;
+	size_t len = 0;
+	char *buf;
+	int ret;
+
+	buf = malloc(size);
+	if (!buf)
+		return -ENOMEM;
+
+	while (len < size) {
+		bytes = read(fd, buf + len, size - len);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+
+		if (bytes < 0) {
+			ret = -errno;
+			belayd_err("Failed to read %s: %d\n", s->path, errno);
+			free(buf);
+			return ret;
+		}
+
+		if (bytes == 0)
+			break;
+
+		len += bytes;
+	}
+
+	s->map = buf;
+	s->size = len;
+	s->copied = true;
+
+	return 0;
+}
+
+/*
+ * Open the config at path, and check its layout.  If copy is set, the file
+ * is read into a buffer rather than mmap'd, see the comment at the top.
+ */
+int stream_open(const char * const path, struct config_stream * const s, bool copy)
+{
+	const char *p, *end;
+	struct stat st;
+	void *map;
+	int ret = 0;
+	int fd;
+
+	memset(s, 0, sizeof(struct config_stream));
+	s->path = path;
+
+	if (!page_mask)
+		page_mask = ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		belayd_err("Failed to open %s: %d\n", path, errno);
+		return -errno;
+	}
+
+	ret = fstat(fd, &st);
+	if (ret) {
+		ret = -errno;
+		goto error;
+	}
+
+	if (st.st_size == 0) {
+		belayd_err("%s is empty\n", path);
+		ret = -EINVAL;
+		goto error;
+	}
+
+	if (copy) {
+		ret = stream_copy(s, fd, st.st_size);
+		if (ret)
+			goto error;
+	} else {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			belayd_err("Failed to mmap %s: %d\n", path, errno);
+			ret = -errno;
+			goto error;
+		}
+
+		s->map = map;
+		s->size = st.st_size;
+		madvise(map, s->size, MADV_SEQUENTIAL);
+	}
+
+	close(fd);
+	fd = -1;
+
+	s->tok = json_tokener_new();
+	if (!s->tok) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	end = s->map + s->size;
+	p = skip_ws(s->map, end);
+
+	if (p < end && *p == '{') {
+		p = scan_object(s, p, end, top_member);
+	} else {
+		s->err = "the config is not an object";
+		p = NULL;
+	}
+
+	if (p && skip_ws(p, end) != end) {
+		s->err = "unexpected data after the config";
+		p = NULL;
+	}
+
+	if (!p) {
+		stream_diagnose(s);
+		ret = -EINVAL;
+		goto error;
+	}
+
+	if (!s->pos) {
+		belayd_err("Failed to get \"rules\" object\n");
+		ret = -EINVAL;
+		goto error;
+	}
+
+	/* the rules are read again by stream_next() */
+	stream_release(s, NULL, true);
+	s->released = (size_t)(s->pos - s->map) & page_mask;
+
+	return 0;
+
+error:
+	if (fd >= 0)
+		close(fd);
+	stream_close(s);
+
+	return ret;
+}
+
+/*
+ * Parse the next rule.  *obj is NULL once every rule has been returned,
+ * and otherwise must be freed by the caller with json_object_put()
+ */
+int stream_next(struct config_stream * const s, struct json_object ** const obj)
+{
+	const char *start, *p, *end = s->map + s->size;
+	enum json_tokener_error err;
+
+	*obj = NULL;
+
+	if (s->rule_idx == s->rule_cnt)
+		return 0;
+
+	if (s->rules) {
+		/* stream_read_all() has already parsed it */
+		*obj = s->rules[s->rule_idx];
+		s->rules[s->rule_idx++] = NULL;
+		return 0;
+	}
+
+	/* stream_open() has already checked the layout */
+	start = skip_ws(s->pos, end);
+	p = skip_value(start, end, NULL);
+
+	if (*start != '{') {
+		belayd_err("Rule #%d in %s is not an object\n", s->rule_idx, s->path);
+		return -EINVAL;
+	}
+
+	if (p - start > INT_MAX) {
+		belayd_err("Rule #%d in %s is too large\n", s->rule_idx, s->path);
+		return -E2BIG;
+	}
+
+	json_tokener_reset(s->tok);
+	*obj = json_tokener_parse_ex(s->tok, start, p - start);
+	err = json_tokener_get_error(s->tok);
+	if (!*obj || err != json_tokener_success) {
+		belayd_err("Failed to parse rule #%d in %s: %s\n", s->rule_idx, s->path,
+			   json_tokener_error_desc(err));
+		if (*obj)
+			json_object_put(*obj);
+		*obj = NULL;
+		return -EINVAL;
+	}
+
+	p = skip_ws(p, end);
+	if (*p == ',')
+		p++;
+
+	s->pos = p;
+	s->rule_idx++;
+	stream_release(s, p, false);
+
+	return 0;
+}
+
+/*
+ * Parse every rule now, e.g. on another thread, so that stream_next() only
+ * has to hand them out.  This holds the JSON of every rule at once.
+ */
+int stream_read_all(struct config_stream * const s)
+{
+	struct json_object **rules;
+	int ret, i;
+
+	rules = calloc(s->rule_cnt ? s->rule_cnt : 1, sizeof(struct json_object *));
+	if (!rules)
+		return -ENOMEM;
+
+	for (i = 0; i < s->rule_cnt; i++) {
+		ret = stream_next(s, &rules[i]);
+		if (ret)
+			goto error;
+	}
+
+	stream_release(s, NULL, true);
+
+	s->rules = rules;
+	s->rule_idx = 0;
+
+	return 0;
+
+error:
+	for (i = 0; i < s->rule_cnt; i++) {
+		if (rules[i])
+			json_object_put(rules[i]);
+	}
+	free(rules);
+
+	return ret;
+}
+
+void stream_close(struct config_stream * const s)
+{
+	int i;
+
+	if (s->rules) {
+		for (i = s->rule_idx; i < s->rule_cnt; i++) {
+			if (s->rules[i])
+				json_object_put(s->rules[i]);
+		}
+		free(s->rules);
+	}
+
+	if (s->tok)
+		json_tokener_free(s->tok);
+
+	if (s->copied)
+		free((void *)s->map);
+	else if (s->map)
+		munmap((void *)s->map, s->size);
+
+	memset(s, 0, sizeof(struct config_stream));
+}
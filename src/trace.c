@@ -0,0 +1,19 @@
+// LICENSE TBD
+/**
+ * Tracepoints for belayd, see trace.h
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <stdint.h>
+
+#include "trace.h"
+
+#ifdef HAVE_SYS_SDT_H
+/* the tracer increments a probe's semaphore while it is attached */
+#define TRACE_DEFINE(name) \
+	volatile unsigned short TRACE_SEMAPHORE(name) __attribute__((section(".probes")));
+
+BELAYD_PROBES(TRACE_DEFINE)
+#endif
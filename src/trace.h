@@ -0,0 +1,75 @@
+// LICENSE TBD
+/**
+ * belayd tracepoints header file
+ *
+ * When belayd is built against <sys/sdt.h>, it contains USDT probes that
+ * perf, bpftrace or SystemTap can attach to, e.g.
+ *
+ *	bpftrace -e 'usdt:/usr/sbin/belayd:belayd:cause__done
+ *		{ @ns[str(arg1)] = hist(arg3); }'
+ *
+ * A probe costs a single nop while no tracer is attached to it.  The
+ * elapsed time that the *__done probes carry is only measured while one
+ * is, which trace_enabled() tells by the probe's semaphore.  Otherwise
+ * the probes compile to nothing.
+ *
+ *	rule__start	rule name
+ *	rule__done	rule name, result of its causes, ns spent on them
+ *	cause__start	rule name, cause name
+ *	cause__done	rule name, cause name, result, ns
+ *	effect__start	rule name, effect name
+ *	effect__done	rule name, effect name, return value, ns
+ *	config__start	config path
+ *	config__done	config path, return value, ns
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#ifndef __BELAYD_TRACE_H
+#define __BELAYD_TRACE_H
+
+#ifdef HAVE_CONFIG_H
+#include "configure.h"
+#endif
+
+#include <stdint.h>
+
+#define BELAYD_PROBES(probe) \
+	probe(rule__start) \
+	probe(rule__done) \
+	probe(cause__start) \
+	probe(cause__done) \
+	probe(effect__start) \
+	probe(effect__done) \
+	probe(config__start) \
+	probe(config__done)
+
+#ifdef HAVE_SYS_SDT_H
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TRACE_SEMAPHORE(name) belayd_##name##_semaphore
+#define TRACE_DECLARE(name) extern volatile unsigned short TRACE_SEMAPHORE(name);
+
+BELAYD_PROBES(TRACE_DECLARE)
+
+/* a tracer is attached to the probe */
+#define trace_enabled(name) __builtin_expect(TRACE_SEMAPHORE(name) != 0, 0)
+
+#define trace(name, ...) STAP_PROBEV(belayd, name, __VA_ARGS__)
+
+#else
+
+/* keeps the arguments referenced, so that they do not warn as unused */
+static inline void trace_args(int unused, ...)
+{
+}
+
+#define trace_enabled(name) 0
+#define trace(name, ...) do { if (0) trace_args(0, __VA_ARGS__); } while (0)
+
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /* __BELAYD_TRACE_H */
@@ -0,0 +1,289 @@
+// LICENSE TBD
+/**
+ * belayd timer wheel
+ *
+ * A timer that expires at time E is stored in the lowest level n for which
+ * E and wheel->now share the same level n + 1 slot.  Within that level, E
+ * always maps to a slot after the current one, so no slot ever holds timers
+ * from two different revolutions.  When wheel->now reaches the start of an
+ * occupied slot on level n > 0, the timers in that slot are redistributed
+ * into the lower levels.
+ *
+ * A bitmap of the occupied slots on each level lets wheel_next() find the
+ * next interesting time without walking empty slots, so an idle wheel can
+ * jump straight over hours of inactivity.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <string.h>
+
+#include "wheel.h"
+
+#define WHEEL_LEVEL_SHIFT(level)	((level) * WHEEL_BITS)
+#define WHEEL_TOTAL_BITS		(WHEEL_LEVELS * WHEEL_BITS)
+
+#define WHEEL_OVERFLOW_LEVEL		(-1)
+
+static inline int wheel_idx(uint64_t time, int level)
+{
+	return (time >> WHEEL_LEVEL_SHIFT(level)) & WHEEL_MASK;
+}
+
+static void list_add(struct wheel_timer **head, struct wheel_timer * const timer)
+{
+	timer->next = *head;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+
+	timer->pprev = head;
+	*head = timer;
+}
+
+static void list_del(struct wheel_timer * const timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+static void wheel_insert(struct wheel * const wheel, struct wheel_timer * const timer)
+{
+	uint64_t expires = timer->expires;
+	int level;
+
+	/* a timer in the past expires the next time the wheel is advanced */
+	if (expires < wheel->now)
+		expires = wheel->now;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		if ((expires >> WHEEL_LEVEL_SHIFT(level + 1)) ==
+		    (wheel->now >> WHEEL_LEVEL_SHIFT(level + 1)))
+			break;
+	}
+
+	if (level == WHEEL_LEVELS) {
+		timer->level = WHEEL_OVERFLOW_LEVEL;
+		timer->slot = 0;
+		list_add(&wheel->overflow, timer);
+		return;
+	}
+
+	timer->level = level;
+	timer->slot = wheel_idx(expires, level);
+	list_add(&wheel->slots[level][timer->slot], timer);
+	wheel->occupied[level] |= 1ULL << timer->slot;
+}
+
+void wheel_init(struct wheel * const wheel, uint64_t now)
+{
+	memset(wheel, 0, sizeof(struct wheel));
+	wheel->now = now;
+}
+
+bool wheel_pending(const struct wheel_timer * const timer)
+{
+	return timer->pprev != NULL;
+}
+
+void wheel_add(struct wheel * const wheel, struct wheel_timer * const timer)
+{
+	if (wheel_pending(timer))
+		wheel_del(wheel, timer);
+
+	wheel_insert(wheel, timer);
+}
+
+void wheel_del(struct wheel * const wheel, struct wheel_timer * const timer)
+{
+	if (!wheel_pending(timer))
+		return;
+
+	list_del(timer);
+
+	if (timer->level != WHEEL_OVERFLOW_LEVEL &&
+	    !wheel->slots[timer->level][timer->slot])
+		wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+}
+
+void wheel_mod(struct wheel * const wheel, struct wheel_timer * const timer,
+	       uint64_t expires)
+{
+	wheel_del(wheel, timer);
+	timer->expires = expires;
+	wheel_insert(wheel, timer);
+}
+
+/*
+ * Return the next time at which the wheel has work to do - either a timer
+ * expires or a slot must be cascaded.  Returns WHEEL_NEVER if the wheel is
+ * empty.
+ */
+uint64_t wheel_next(const struct wheel * const wheel)
+{
+	uint64_t next = WHEEL_NEVER, mask, base, candidate;
+	int level, idx, shift;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		shift = WHEEL_LEVEL_SHIFT(level);
+		idx = wheel_idx(wheel->now, level);
+
+		/*
+		 * Slots before idx have already been run or cascaded.  On the
+		 * upper levels the current slot can only be occupied if wheel->now
+		 * just reached its start and it has not been cascaded yet.
+		 */
+		mask = wheel->occupied[level] & (~0ULL << idx);
+
+		if (!mask)
+			continue;
+
+		base = (wheel->now >> (shift + WHEEL_BITS)) << (shift + WHEEL_BITS);
+		candidate = base | ((uint64_t)__builtin_ctzll(mask) << shift);
+
+		if (candidate < next)
+			next = candidate;
+	}
+
+	if (wheel->overflow) {
+		/* the overflow list is cascaded at the start of each top level revolution */
+		candidate = ((wheel->now + (1ULL << WHEEL_TOTAL_BITS) - 1) >> WHEEL_TOTAL_BITS)
+			    << WHEEL_TOTAL_BITS;
+
+		if (candidate < next)
+			next = candidate;
+	}
+
+	return next;
+}
+
+/*
+ * Return the expiration time of the earliest pending timer, or WHEEL_NEVER
+ * if the wheel is empty.  Unlike wheel_next(), this ignores cascades so that
+ * the caller does not have to wake up just to shuffle timers between levels.
+ */
+uint64_t wheel_next_expiry(const struct wheel * const wheel)
+{
+	const struct wheel_timer *timer, *list;
+	uint64_t next = WHEEL_NEVER, mask;
+	int level, idx;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		idx = wheel_idx(wheel->now, level);
+		mask = wheel->occupied[level] & (~0ULL << idx);
+
+		if (mask) {
+			list = wheel->slots[level][__builtin_ctzll(mask)];
+			break;
+		}
+	}
+
+	/*
+	 * Every timer on a lower level expires before every timer on a higher
+	 * level, so only the first occupied slot needs to be searched
+	 */
+	if (level == WHEEL_LEVELS)
+		list = wheel->overflow;
+
+	for (timer = list; timer; timer = timer->next) {
+		if (timer->expires < next)
+			next = timer->expires;
+	}
+
+	if (next != WHEEL_NEVER && next < wheel->now)
+		next = wheel->now;
+
+	return next;
+}
+
+static void wheel_cascade(struct wheel * const wheel, struct wheel_timer **head)
+{
+	struct wheel_timer *timer, *list;
+
+	list = *head;
+	if (list)
+		list->pprev = &list;
+	*head = NULL;
+
+	while (list) {
+		timer = list;
+		list_del(timer);
+		wheel_insert(wheel, timer);
+	}
+}
+
+static int wheel_process(struct wheel * const wheel, uint64_t time)
+{
+	struct wheel_timer *timer, *list;
+	int level, idx, ret = 0;
+	uint64_t mask;
+
+	wheel->now = time;
+
+	if ((time & ((1ULL << WHEEL_TOTAL_BITS) - 1)) == 0)
+		wheel_cascade(wheel, &wheel->overflow);
+
+	for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+		mask = (1ULL << WHEEL_LEVEL_SHIFT(level)) - 1;
+		idx = wheel_idx(time, level);
+
+		if ((time & mask) != 0 || !(wheel->occupied[level] & (1ULL << idx)))
+			continue;
+
+		wheel->occupied[level] &= ~(1ULL << idx);
+		wheel_cascade(wheel, &wheel->slots[level][idx]);
+	}
+
+	idx = wheel_idx(time, 0);
+	list = wheel->slots[0][idx];
+	if (list)
+		list->pprev = &list;
+	wheel->slots[0][idx] = NULL;
+	wheel->occupied[0] &= ~(1ULL << idx);
+
+	/* timers re-added by their callbacks must not land in this slot again */
+	wheel->now = time + 1;
+
+	while (list) {
+		timer = list;
+		list_del(timer);
+
+		if (ret) {
+			/* an earlier callback failed.  requeue the rest */
+			wheel_insert(wheel, timer);
+			continue;
+		}
+
+		ret = (*timer->fn)(timer, timer->data);
+	}
+
+	return ret;
+}
+
+/*
+ * Run every timer that expires at or before now
+ */
+int wheel_advance(struct wheel * const wheel, uint64_t now)
+{
+	uint64_t next;
+	int ret;
+
+	while (1) {
+		next = wheel_next(wheel);
+		if (next > now)
+			break;
+
+		ret = wheel_process(wheel, next);
+		if (ret)
+			return ret;
+	}
+
+	if (now >= wheel->now)
+		wheel->now = now + 1;
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+// LICENSE TBD
+/**
+ * belayd timer wheel header file
+ *
+ * A hierarchical timer wheel with millisecond granularity.  Each level
+ * has WHEEL_SIZE slots, and each slot of level n covers WHEEL_SIZE^n
+ * milliseconds.  Timers are placed in the lowest level that can hold
+ * them and are cascaded down to the lower levels as time advances.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#ifndef __BELAYD_WHEEL_H
+#define __BELAYD_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+
+#define WHEEL_NEVER	UINT64_MAX
+
+struct wheel_timer;
+
+/*
+ * Invoked when a timer expires.  The timer has already been removed from
+ * the wheel and may be re-added from within the callback.  A nonzero
+ * return value stops wheel_advance() and is passed back to its caller.
+ */
+typedef int (*wheel_fn)(struct wheel_timer * const timer, void *data);
+
+struct wheel_timer {
+	uint64_t expires;	/* absolute time in milliseconds */
+	wheel_fn fn;
+	void *data;
+
+	/* populated by the wheel */
+	int level;
+	int slot;
+	struct wheel_timer *next;
+	struct wheel_timer **pprev;
+};
+
+struct wheel {
+	/* all timers that expire before now have been run */
+	uint64_t now;
+
+	uint64_t occupied[WHEEL_LEVELS];
+	struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+
+	/* timers that are beyond the reach of the highest level */
+	struct wheel_timer *overflow;
+};
+
+void wheel_init(struct wheel * const wheel, uint64_t now);
+void wheel_add(struct wheel * const wheel, struct wheel_timer * const timer);
+void wheel_del(struct wheel * const wheel, struct wheel_timer * const timer);
+void wheel_mod(struct wheel * const wheel, struct wheel_timer * const timer,
+	       uint64_t expires);
+bool wheel_pending(const struct wheel_timer * const timer);
+uint64_t wheel_next(const struct wheel * const wheel);
+uint64_t wheel_next_expiry(const struct wheel * const wheel);
+int wheel_advance(struct wheel * const wheel, uint64_t now);
+
+#endif /* __BELAYD_WHEEL_H */
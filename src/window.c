@@ -0,0 +1,395 @@
+// LICENSE TBD
+/**
+ * Sliding windows for numeric causes, see window.h
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "belayd-internal.h"
+#include "defines.h"
+#include "window.h"
+
+#define WINDOW_MASK		(WINDOW_SLOTS - 1)
+#define WINDOW_LINEAR		(2 << (WINDOW_SUB_BITS))
+
+static_assert((WINDOW_SLOTS & WINDOW_MASK) == 0, "WINDOW_SLOTS must be a power of two");
+static_assert(WINDOW_SLOTS <= UINT16_MAX, "WINDOW_SLOTS must fit the deque");
+static_assert(WINDOW_BUCKETS <= UINT16_MAX, "WINDOW_BUCKETS must fit a slot's buckets");
+
+static const char * const window_agg_names[] = {
+	"avg",
+	"min",
+	"max",
+	"rate",
+	"p",
+};
+static_assert(ARRAY_SIZE(window_agg_names) == WINDOW_AGG_CNT,
+	      "window_agg_names[] must be same length as WINDOW_AGG_CNT");
+
+/* a window in a compiled rule image */
+struct window_image {
+	uint32_t span;
+	uint32_t agg;
+	uint32_t quantile;
+	uint32_t reserved;
+};
+
+static int window_bucket(unsigned long long value)
+{
+	int exp;
+
+	if (value < WINDOW_LINEAR)
+		return value;
+
+	exp = 63 - __builtin_clzll(value);
+
+	return WINDOW_LINEAR + ((exp - WINDOW_SUB_BITS - 1) << WINDOW_SUB_BITS) +
+	       ((value >> (exp - WINDOW_SUB_BITS)) & ((1 << WINDOW_SUB_BITS) - 1));
+}
+
+/* the smallest value in a bucket, and the width of the bucket */
+static unsigned long long window_bucket_min(int bucket, unsigned long long * const width)
+{
+	int exp, sub;
+
+	if (bucket < WINDOW_LINEAR) {
+		*width = 1;
+		return bucket;
+	}
+
+	bucket -= WINDOW_LINEAR;
+	exp = (bucket >> WINDOW_SUB_BITS) + WINDOW_SUB_BITS + 1;
+	sub = bucket & ((1 << WINDOW_SUB_BITS) - 1);
+
+	*width = 1ULL << (exp - WINDOW_SUB_BITS);
+
+	return (1ULL << exp) + sub * *width;
+}
+
+static size_t window_size(enum window_agg_enum agg)
+{
+	size_t size = sizeof(struct window);
+
+	if (agg == WINDOW_QUANTILE)
+		size += sizeof(uint32_t) * WINDOW_BUCKETS +
+			sizeof(struct window_slot_bucket) * WINDOW_SLOTS * WINDOW_SLOT_BUCKETS;
+
+	return size;
+}
+
+/* the buckets that the readings of slot idx went to */
+static struct window_slot_bucket *window_slot_buckets(struct window * const win,
+						      unsigned int idx)
+{
+	struct window_slot_bucket *buckets;
+
+	buckets = (struct window_slot_bucket *)&win->counts[WINDOW_BUCKETS];
+
+	return &buckets[idx * WINDOW_SLOT_BUCKETS];
+}
+
+static int window_alloc(struct arena * const arena, int span, enum window_agg_enum agg,
+			int quantile, struct window ** const win)
+{
+	*win = arena_alloc(arena, window_size(agg));
+	if (!*win)
+		return -ENOMEM;
+
+	(*win)->span = span;
+	(*win)->width = (span + WINDOW_SLOTS - 2) / (WINDOW_SLOTS - 1);
+	(*win)->agg = agg;
+	(*win)->quantile = quantile;
+
+	if (agg == WINDOW_QUANTILE)
+		snprintf((*win)->name, sizeof((*win)->name), "p%d over %d ms", quantile, span);
+	else
+		snprintf((*win)->name, sizeof((*win)->name), "%s over %d ms",
+			 window_agg_names[agg], span);
+
+	return 0;
+}
+
+int window_parse(struct json_object * const args_obj, struct arena * const arena,
+		 struct window ** const win)
+{
+	const char *span_str, *agg_str = window_agg_names[WINDOW_AVG];
+	enum window_agg_enum agg;
+	int span, quantile = 0;
+	json_bool exists;
+	char *end;
+	int ret;
+
+	*win = NULL;
+
+	exists = json_object_object_get_ex(args_obj, "window", NULL);
+	if (!exists) {
+		if (json_object_object_get_ex(args_obj, "aggregate", NULL)) {
+			belayd_err("An aggregate requires a window\n");
+			return -EINVAL;
+		}
+
+		return 0;
+	}
+
+	ret = parse_string(args_obj, "window", &span_str);
+	if (ret)
+		return ret;
+
+	ret = parse_duration_str(span_str, &span);
+	if (ret) {
+		belayd_err("Invalid window: %s\n", span_str);
+		return ret;
+	}
+
+	if (json_object_object_get_ex(args_obj, "aggregate", NULL)) {
+		ret = parse_string(args_obj, "aggregate", &agg_str);
+		if (ret)
+			return ret;
+	}
+
+	for (agg = 0; agg < WINDOW_QUANTILE; agg++) {
+		if (strcmp(agg_str, window_agg_names[agg]) == 0)
+			break;
+	}
+
+	if (agg == WINDOW_QUANTILE) {
+		/* pNN, where NN is a percentile from 1 to 99 */
+		errno = 0;
+		quantile = agg_str[0] == 'p' ? strtol(agg_str + 1, &end, 10) : 0;
+		if (errno || agg_str[0] != 'p' || end == agg_str + 1 || *end != '\0' ||
+		    quantile < 1 || quantile > 99) {
+			belayd_err("Invalid aggregate: %s\n", agg_str);
+			return -EINVAL;
+		}
+	}
+
+	return window_alloc(arena, span, agg, quantile, win);
+}
+
+/* drop the oldest slot */
+static void window_drop(struct window * const win)
+{
+	struct window_slot *slot = &win->slots[win->head];
+	struct window_slot_bucket *buckets;
+	int i;
+
+	switch (win->agg) {
+		case WINDOW_AVG:
+			win->sum -= slot->sum;
+			break;
+		case WINDOW_MIN:
+		case WINDOW_MAX:
+			if (win->dq_cnt && win->deque[win->dq_head] == win->head) {
+				win->dq_head = (win->dq_head + 1) & WINDOW_MASK;
+				win->dq_cnt--;
+			}
+			break;
+		case WINDOW_QUANTILE:
+			buckets = window_slot_buckets(win, win->head);
+			for (i = 0; i < WINDOW_SLOT_BUCKETS && buckets[i].cnt; i++)
+				win->counts[buckets[i].bucket] -= buckets[i].cnt;
+			break;
+		default:
+			break;
+	}
+
+	win->cnt -= slot->cnt;
+	win->head = (win->head + 1) & WINDOW_MASK;
+	win->slot_cnt--;
+}
+
+/*
+ * Push the newest slot onto the deque, after dropping those that it
+ * outdoes.  The newest slot is always at the back of the deque, so it is
+ * pushed again whenever a reading changes its extreme.
+ */
+static void window_push(struct window * const win, unsigned int idx)
+{
+	unsigned long long value = win->slots[idx].extreme, back;
+	unsigned int tail;
+
+	while (win->dq_cnt) {
+		tail = (win->dq_head + win->dq_cnt - 1) & WINDOW_MASK;
+		back = win->slots[win->deque[tail]].extreme;
+
+		if (win->agg == WINDOW_MIN ? back < value : back > value)
+			break;
+
+		win->dq_cnt--;
+	}
+
+	win->deque[(win->dq_head + win->dq_cnt) & WINDOW_MASK] = idx;
+	win->dq_cnt++;
+}
+
+/* count a reading of slot idx in bucket, or in the nearest one that the slot has */
+static void window_count(struct window * const win, unsigned int idx, int bucket)
+{
+	struct window_slot_bucket *buckets = window_slot_buckets(win, idx);
+	int i, nearest = 0;
+
+	for (i = 0; i < WINDOW_SLOT_BUCKETS && buckets[i].cnt; i++) {
+		if (buckets[i].bucket == bucket)
+			break;
+
+		if (abs(buckets[i].bucket - bucket) < abs(buckets[nearest].bucket - bucket))
+			nearest = i;
+	}
+
+	if (i == WINDOW_SLOT_BUCKETS)
+		i = nearest;
+	else if (!buckets[i].cnt)
+		buckets[i].bucket = bucket;
+
+	buckets[i].cnt++;
+	win->counts[buckets[i].bucket]++;
+}
+
+static unsigned long long window_quantile(const struct window * const win)
+{
+	unsigned long long min, width, rank, seen = 0;
+	int bucket;
+
+	/* the rank of the quantile among the readings, from 1 to cnt */
+	rank = (win->cnt * win->quantile + 99) / 100;
+	if (rank == 0)
+		rank = 1;
+
+	for (bucket = 0; bucket < WINDOW_BUCKETS; bucket++) {
+		if (seen + win->counts[bucket] >= rank)
+			break;
+
+		seen += win->counts[bucket];
+	}
+
+	/* assume that the readings are spread evenly across the bucket */
+	min = window_bucket_min(bucket, &width);
+
+	return min + (width * (2 * (rank - seen) - 1)) / (2 * win->counts[bucket]);
+}
+
+bool window_add(struct window * const win, uint64_t now, unsigned long long value,
+		unsigned long long * const aggregate)
+{
+	struct window_slot *oldest, *slot = NULL;
+	unsigned int idx = 0;
+	bool fresh;
+
+	while (win->slot_cnt && win->slots[win->head].time + win->span <= now)
+		window_drop(win);
+
+	if (win->slot_cnt) {
+		idx = (win->head + win->slot_cnt - 1) & WINDOW_MASK;
+		slot = &win->slots[idx];
+	}
+
+	/* the counter was reset, so the rate starts over */
+	if (win->agg == WINDOW_RATE && slot && value < slot->last) {
+		while (win->slot_cnt)
+			window_drop(win);
+		slot = NULL;
+	}
+
+	fresh = !slot || slot->idx != now / win->width;
+	if (fresh) {
+		if (win->slot_cnt == WINDOW_SLOTS)
+			window_drop(win);
+
+		idx = (win->head + win->slot_cnt) & WINDOW_MASK;
+		slot = &win->slots[idx];
+		memset(slot, 0, sizeof(*slot));
+		slot->idx = now / win->width;
+		win->slot_cnt++;
+
+		if (win->agg == WINDOW_QUANTILE)
+			memset(window_slot_buckets(win, idx), 0,
+			       sizeof(struct window_slot_bucket) * WINDOW_SLOT_BUCKETS);
+	}
+
+	slot->time = now;
+	slot->cnt++;
+	win->cnt++;
+
+	switch (win->agg) {
+		case WINDOW_AVG:
+			slot->sum += value;
+			win->sum += value;
+			win->value = win->sum / win->cnt;
+			break;
+		case WINDOW_MIN:
+		case WINDOW_MAX:
+			if (fresh || (win->agg == WINDOW_MIN ? value < slot->extreme :
+						value > slot->extreme)) {
+				slot->extreme = value;
+
+				/* the newest slot is at the back of the deque */
+				if (!fresh)
+					win->dq_cnt--;
+				window_push(win, idx);
+			}
+			win->value = win->slots[win->deque[win->dq_head]].extreme;
+			break;
+		case WINDOW_RATE:
+			if (fresh) {
+				slot->first_time = now;
+				slot->first = value;
+			}
+			slot->last = value;
+
+			oldest = &win->slots[win->head];
+
+			/* a rate needs two readings */
+			if (now == oldest->first_time) {
+				win->ready = false;
+				return false;
+			}
+
+			win->value = (value - oldest->first) * 1000 / (now - oldest->first_time);
+			break;
+		case WINDOW_QUANTILE:
+			window_count(win, idx, window_bucket(value));
+			win->value = window_quantile(win);
+			break;
+		default:
+			break;
+	}
+
+	win->ready = true;
+	*aggregate = win->value;
+
+	return true;
+}
+
+int window_pack(const struct window * const win, struct image_buf * const ib)
+{
+	struct window_image img = {
+		.span = win->span,
+		.agg = win->agg,
+		.quantile = win->quantile,
+	};
+
+	return image_buf_append(ib, &img, sizeof(img));
+}
+
+int window_unpack(const void * const data, size_t len, size_t * const off,
+		  struct arena * const arena, struct window ** const win)
+{
+	struct window_image img;
+
+	if (len < *off + sizeof(img))
+		return -EINVAL;
+
+	memcpy(&img, (const char *)data + *off, sizeof(img));
+	*off += sizeof(img);
+
+	if (img.agg >= WINDOW_AGG_CNT || img.span < 1 || img.span > INT32_MAX)
+		return -EINVAL;
+
+	return window_alloc(arena, img.span, img.agg, img.quantile, win);
+}
@@ -0,0 +1,150 @@
+// LICENSE TBD
+/**
+ * belayd sliding window header file
+ *
+ * A window aggregates the readings that a numeric cause took during the
+ * last span milliseconds, so that the cause can compare e.g. the average
+ * over 30s or the 95th percentile over 5m, rather than a single reading
+ * that a brief spike may have pushed over the threshold.  A cause that
+ * supports windows takes two optional arguments:
+ *
+ *	"window": "30s"		the span, in the format of an interval
+ *	"aggregate": "avg"	avg, min, max, rate (per second) or pNN, e.g.
+ *				p95.  The default is avg.
+ *
+ * The readings are kept in a ring of WINDOW_SLOTS time slots, each
+ * span / (WINDOW_SLOTS - 1) wide, which is allocated with the cause, so a
+ * window never grows after the config has been parsed, however often the
+ * cause is evaluated.  A slot aggregates the readings that were taken
+ * during it, and is dropped once the last of them has left the window, so
+ * the window may hold on to readings up to one slot older than the span.
+ * Adding a reading and reading the aggregate take constant time: avg
+ * keeps a running sum, min and max keep a monotonic deque of the slots
+ * that may still hold the extreme, rate compares the first reading of the
+ * oldest slot with the last one of the newest, and pNN keeps a histogram
+ * of log-linear buckets, as in an HDR histogram, and interpolates within
+ * the bucket that holds the quantile.  Each slot remembers how many of its
+ * readings went to up to WINDOW_SLOT_BUCKETS buckets, so that they can be
+ * taken out of the histogram again.  A reading that would need another
+ * bucket is counted in the nearest one the slot has.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ * Author: Tom Hromatka <tom.hromatka@oracle.com>
+ */
+
+#ifndef __BELAYD_WINDOW_H
+#define __BELAYD_WINDOW_H
+
+#include <json-c/json.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "arena.h"
+#include "image.h"
+
+/* must be a power of two */
+#define WINDOW_SLOTS		256
+#define WINDOW_SLOT_BUCKETS	8
+
+/*
+ * Values below 2^(WINDOW_SUB_BITS + 1) have a bucket each.  Every higher
+ * power of two is split into 2^WINDOW_SUB_BITS buckets, so a quantile is
+ * off by at most 1/2^(WINDOW_SUB_BITS + 1) of its value.
+ */
+#define WINDOW_SUB_BITS		3
+#define WINDOW_BUCKETS \
+	((2 << (WINDOW_SUB_BITS)) + ((63 - (WINDOW_SUB_BITS)) << (WINDOW_SUB_BITS)))
+
+enum window_agg_enum {
+	WINDOW_AVG = 0,
+	WINDOW_MIN,
+	WINDOW_MAX,
+	WINDOW_RATE,
+	WINDOW_QUANTILE,
+
+	WINDOW_AGG_CNT
+};
+
+/* the readings that a window took during one slot */
+struct window_slot {
+	uint64_t idx;		/* the time of the slot, divided by its width */
+	uint64_t time;		/* of the last reading, in milliseconds */
+	unsigned int cnt;
+
+	union {
+		/* WINDOW_AVG */
+		unsigned __int128 sum;
+
+		/* WINDOW_MIN and WINDOW_MAX */
+		unsigned long long extreme;
+
+		/* WINDOW_RATE */
+		struct {
+			uint64_t first_time;
+			unsigned long long first;
+			unsigned long long last;
+		};
+	};
+};
+
+/* WINDOW_QUANTILE: the number of readings of a slot in a bucket */
+struct window_slot_bucket {
+	uint16_t bucket;
+	uint32_t cnt;
+};
+
+struct window {
+	int span;		/* milliseconds */
+	int width;		/* of a slot, in milliseconds */
+	enum window_agg_enum agg;
+	int quantile;		/* percent, for WINDOW_QUANTILE */
+	char name[32];		/* e.g. "p95 over 300000 ms", for the logs */
+
+	/* the most recent aggregate, if ready */
+	bool ready;
+	unsigned long long value;
+
+	/* the slots that hold readings, oldest first */
+	struct window_slot slots[WINDOW_SLOTS];
+	unsigned int head;
+	unsigned int slot_cnt;
+
+	/* the number of readings in the window */
+	unsigned long long cnt;
+
+	/* WINDOW_AVG */
+	unsigned __int128 sum;
+
+	/* WINDOW_MIN and WINDOW_MAX: indices into slots[], extreme first */
+	uint16_t deque[WINDOW_SLOTS];
+	unsigned int dq_head;
+	unsigned int dq_cnt;
+
+	/*
+	 * WINDOW_QUANTILE: the number of readings in each bucket, followed
+	 * by WINDOW_SLOT_BUCKETS struct window_slot_bucket for each slot
+	 */
+	uint32_t counts[];
+};
+
+/*
+ * Parse the window arguments of a cause.  *win is set to NULL if args_obj
+ * has no window.
+ */
+int window_parse(struct json_object * const args_obj, struct arena * const arena,
+		 struct window ** const win);
+
+/*
+ * Add a reading taken at now, and drop those that have left the window.
+ * Returns true and sets *value to the aggregate, or returns false if there
+ * are not enough readings yet, e.g. a single one for a rate.
+ */
+bool window_add(struct window * const win, uint64_t now, unsigned long long value,
+		unsigned long long * const aggregate);
+
+int window_pack(const struct window * const win, struct image_buf * const ib);
+int window_unpack(const void * const data, size_t len, size_t * const off,
+		  struct arena * const arena, struct window ** const win);
+
+#endif /* __BELAYD_WINDOW_H */
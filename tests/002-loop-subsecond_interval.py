@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test that belayd honors sub-second polling intervals
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import belayd
+import consts
+import time
+
+CONFIG = '002-loop-subsecond_interval.json.token'
+INTERVAL = '100ms'
+MAX_LOOPS = 50
+EXPECTED_RET = 42
+
+# the cause trips within two seconds.  give belayd some slack, but
+# fail if the loop did not run at the requested rate
+MAX_RUN_TIME = 4.0
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    pass
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    start = time.time()
+    belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                  expected_ret=EXPECTED_RET)
+    run_time = time.time() - start
+
+    if run_time > MAX_RUN_TIME:
+        result = consts.TEST_FAILED
+        cause = 'belayd took {:.2f}s, expected less than {:.2f}s'.format(
+                run_time, MAX_RUN_TIME)
+
+    return result, cause
+
+
+def teardown(config):
+    pass
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test the PSI cause
+#
+# A FIFO stands in for the kernel's pressure file.  belayd writes its
+# trigger to the FIFO and then waits for an event, which this test
+# simulates by writing to the FIFO.  The polling interval is far longer
+# than the test, so belayd must react to the event rather than poll.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import threading
+import belayd
+import consts
+import time
+import os
+
+CONFIG = '006-cause-psi.json'
+FIFO = '006-cause-psi.fifo'
+INTERVAL = 10
+MAX_LOOPS = 3
+EXPECTED_RET = 42
+
+EVENT_DELAY = 1.0
+MAX_RUN_TIME = 4.0
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    if os.path.exists(FIFO):
+        os.remove(FIFO)
+
+    os.mkfifo(FIFO)
+
+
+def fire_trigger():
+    # opening the FIFO blocks until belayd has opened it
+    with open(FIFO, 'w') as fifo:
+        time.sleep(EVENT_DELAY)
+        fifo.write('event')
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    trigger = threading.Thread(target=fire_trigger, daemon=True)
+    trigger.start()
+
+    start = time.time()
+    belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                  expected_ret=EXPECTED_RET)
+    run_time = time.time() - start
+
+    trigger.join(timeout=1)
+
+    if run_time < EVENT_DELAY or run_time > MAX_RUN_TIME:
+        result = consts.TEST_FAILED
+        cause = 'belayd took {:.2f}s, expected {:.2f}s to {:.2f}s'.format(
+                run_time, EVENT_DELAY, MAX_RUN_TIME)
+
+    return result, cause
+
+
+def teardown(config):
+    if os.path.exists(FIFO):
+        os.remove(FIFO)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
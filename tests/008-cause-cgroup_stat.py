@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test the cgroup_stat cause
+#
+# A directory stands in for the cgroup.  The value, flat keyed and nested
+# keyed files are static, while cpu.stat's usage_usec counter advances by
+# about one CPU second per second.  The rule can only trip once belayd has
+# two samples of the counter and can compute its rate.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import threading
+import belayd
+import consts
+import shutil
+import time
+import os
+
+CONFIG = '008-cause-cgroup_stat.json'
+CGROUP = '008-cause-cgroup_stat.cgroup'
+INTERVAL = 5
+MAX_LOOPS = 10
+EXPECTED_RET = 42
+
+MAX_RUN_TIME = 3.0
+
+FILES = {
+    'memory.current': '1000\n',
+    'memory.stat': 'file 100\nanon 5000\nanon_thp 0\n',
+    # the devices have not discarded anything, so neither lists dios
+    'io.stat': '8:0 rbytes=100 wbytes=1 rios=2 wios=3 dbytes=0\n'
+               '8:16 rbytes=200 wbytes=1 rios=2 wios=3\n',
+}
+
+done = threading.Event()
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    teardown(config)
+    os.mkdir(CGROUP)
+
+    for name, contents in FILES.items():
+        with open(os.path.join(CGROUP, name), 'w') as f:
+            f.write(contents)
+
+    write_usage(os.open(os.path.join(CGROUP, 'cpu.stat'), os.O_WRONLY | os.O_CREAT), 0)
+
+
+def write_usage(fd, usage):
+    # fixed width, so that belayd never sees a partially rewritten file
+    os.pwrite(fd, 'usage_usec {:016d}\nuser_usec 0\n'.format(usage).encode(), 0)
+
+
+def advance_usage():
+    fd = os.open(os.path.join(CGROUP, 'cpu.stat'), os.O_WRONLY)
+    start = time.time()
+
+    while not done.wait(0.05):
+        write_usage(fd, int((time.time() - start) * 1000000))
+
+    os.close(fd)
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    done.clear()
+    usage = threading.Thread(target=advance_usage, daemon=True)
+    usage.start()
+
+    start = time.time()
+    try:
+        belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                      expected_ret=EXPECTED_RET)
+    finally:
+        done.set()
+        usage.join()
+    run_time = time.time() - start
+
+    if run_time > MAX_RUN_TIME:
+        result = consts.TEST_FAILED
+        cause = 'belayd took {:.2f}s, expected less than {:.2f}s'.format(
+                run_time, MAX_RUN_TIME)
+
+    return result, cause
+
+
+def teardown(config):
+    shutil.rmtree(CGROUP, ignore_errors=True)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
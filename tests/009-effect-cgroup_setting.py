@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test the cgroup_setting effect
+#
+# A directory stands in for the cgroup.  The rule trips on every tick, but
+# belayd should only write cpu.weight the first time.  Once the value has
+# been written, this test changes the file behind belayd's back and checks
+# that the later, identical writes were skipped.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import threading
+import belayd
+import consts
+import shutil
+import time
+import os
+
+CONFIG = '009-effect-cgroup_setting.json'
+CGROUP = '009-effect-cgroup_setting.cgroup'
+KNOB = os.path.join(CGROUP, 'cpu.weight')
+INTERVAL = '100ms'
+MAX_LOOPS = 10
+# belayd exits with ETIME once it has run MAX_LOOPS loops
+EXPECTED_RET = 62
+
+MARKER = 'xx'
+
+first_write_seen = threading.Event()
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    teardown(config)
+    os.mkdir(CGROUP)
+
+    # cgroupfs ignores the file offset, but a regular file does not.  Start
+    # empty so that belayd's write is the whole file
+    open(KNOB, 'w').close()
+
+
+def overwrite_knob():
+    # wait for belayd's first write, then change the value behind its back
+    for i in range(50):
+        with open(KNOB) as f:
+            if f.read() == '50':
+                first_write_seen.set()
+                break
+        time.sleep(0.02)
+
+    with open(KNOB, 'w') as f:
+        f.write(MARKER)
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    overwrite = threading.Thread(target=overwrite_knob, daemon=True)
+    overwrite.start()
+
+    belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                  expected_ret=EXPECTED_RET)
+    overwrite.join()
+
+    with open(KNOB) as f:
+        value = f.read()
+
+    if not first_write_seen.is_set():
+        result = consts.TEST_FAILED
+        cause = 'belayd never wrote cpu.weight'
+    elif value != MARKER:
+        result = consts.TEST_FAILED
+        cause = 'cpu.weight was rewritten.  Expected {}, found {}'.format(
+                MARKER, value)
+
+    return result, cause
+
+
+def teardown(config):
+    shutil.rmtree(CGROUP, ignore_errors=True)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test reloading the config while belayd is running
+#
+# The first rule needs both a PSI event and a meminfo cause that cannot
+# trip.  This test fires the PSI event, and then replaces the config file
+# with one in which the meminfo cause always trips.  belayd must notice the
+# new file, and must carry the unchanged PSI cause, and the event it has
+# already seen, over to the new config.  If the PSI cause were initialized
+# again, the first rule would never trip and belayd would run out of loops.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import threading
+import belayd
+import consts
+import shutil
+import json
+import time
+import os
+
+TEMPLATE = '010-loop-reload.json'
+CONFIG = '010-loop-reload.running.json'
+FIFO = '010-loop-reload.fifo'
+INTERVAL = '100ms'
+MAX_LOOPS = 40
+EXPECTED_RET = 42
+
+EVENT_DELAY = 0.5
+RELOAD_DELAY = 1.0
+MAX_RUN_TIME = 3.0
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    if os.path.exists(FIFO):
+        os.remove(FIFO)
+
+    os.mkfifo(FIFO)
+    shutil.copyfile(TEMPLATE, CONFIG)
+
+
+def change_config():
+    # opening the FIFO blocks until belayd has opened it
+    with open(FIFO, 'w') as fifo:
+        time.sleep(EVENT_DELAY)
+        fifo.write('event')
+        fifo.flush()
+
+        time.sleep(RELOAD_DELAY - EVENT_DELAY)
+
+        with open(TEMPLATE) as template:
+            cfg = json.load(template)
+
+        cfg['rules'][0]['causes'][1]['args']['operator'] = 'greaterthan'
+
+        # replace the file the way most editors and config managers do
+        with open(CONFIG + '.tmp', 'w') as tmp:
+            json.dump(cfg, tmp, indent=4)
+        os.rename(CONFIG + '.tmp', CONFIG)
+
+        # keep the FIFO open until belayd exits
+        time.sleep(MAX_RUN_TIME)
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    changer = threading.Thread(target=change_config, daemon=True)
+    changer.start()
+
+    start = time.time()
+    belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                  expected_ret=EXPECTED_RET)
+    run_time = time.time() - start
+
+    if run_time < RELOAD_DELAY or run_time > MAX_RUN_TIME:
+        result = consts.TEST_FAILED
+        cause = 'belayd took {:.2f}s, expected {:.2f}s to {:.2f}s'.format(
+                run_time, RELOAD_DELAY, MAX_RUN_TIME)
+
+    return result, cause
+
+
+def teardown(config):
+    for path in [FIFO, CONFIG, CONFIG + '.tmp']:
+        if os.path.exists(path):
+            os.remove(path)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
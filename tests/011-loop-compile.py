@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test the compiled config image
+#
+# The config is compiled, and belayd must then run the rules from the
+# image.  The effect's return value is then changed in the config without
+# changing its size or mtime, so belayd must keep using the image and
+# return the old value.  Once the image is corrupted, or the config's mtime
+# changes, belayd must ignore the image and load the JSON config.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import belayd
+import consts
+import shutil
+import os
+
+TEMPLATE = '011-loop-compile.json'
+CONFIG = '011-loop-compile.running.json'
+IMAGE = CONFIG + '.img'
+CGROUP = '011-loop-compile.cgroup'
+INTERVAL = '100ms'
+MAX_LOOPS = 3
+COMPILED_RET = 42
+CHANGED_RET = 43
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    shutil.copyfile(TEMPLATE, CONFIG)
+
+    os.makedirs(CGROUP, exist_ok=True)
+    with open(os.path.join(CGROUP, 'memory.current'), 'w') as f:
+        f.write('1000\n')
+
+
+def change_config():
+    st = os.stat(CONFIG)
+
+    with open(CONFIG) as f:
+        cfg = f.read()
+
+    # the same size, in place, so that only the mtime tells them apart
+    with open(CONFIG, 'w') as f:
+        f.write(cfg.replace('"{}"'.format(COMPILED_RET), '"{}"'.format(CHANGED_RET)))
+
+    os.utime(CONFIG, ns=(st.st_atime_ns, st.st_mtime_ns))
+
+
+def corrupt_image():
+    with open(IMAGE, 'r+b') as f:
+        f.seek(-1, os.SEEK_END)
+        byte = f.read(1)
+        f.seek(-1, os.SEEK_END)
+        f.write(bytes([byte[0] ^ 0xff]))
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    belayd.belayd(config=CONFIG, compile=True)
+
+    if not os.path.exists(IMAGE):
+        result = consts.TEST_FAILED
+        cause = 'belayd did not write {}'.format(IMAGE)
+        return result, cause
+
+    belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                  expected_ret=COMPILED_RET)
+
+    change_config()
+    belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                  expected_ret=COMPILED_RET)
+
+    shutil.copyfile(IMAGE, IMAGE + '.orig')
+    corrupt_image()
+    belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                  expected_ret=CHANGED_RET)
+
+    os.rename(IMAGE + '.orig', IMAGE)
+    os.utime(CONFIG)
+    belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                  expected_ret=CHANGED_RET)
+
+    return result, cause
+
+
+def teardown(config):
+    for path in [CONFIG, IMAGE, IMAGE + '.orig', IMAGE + '.tmp']:
+        if os.path.exists(path):
+            os.remove(path)
+
+    shutil.rmtree(CGROUP, ignore_errors=True)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test evaluating the causes on a pool of worker threads
+#
+# The rules share meminfo causes and cgroup files, so the workers must
+# share their samples.  Two rules trip in the same tick.  Whichever
+# worker evaluates them, their effects must run in config order, so
+# belayd must always return the first rule's value.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import belayd
+import consts
+import shutil
+import os
+
+CONFIG = '012-loop-workers.json'
+CGROUPS = ['012-loop-workers.cgroup0', '012-loop-workers.cgroup1']
+INTERVAL = '100ms'
+MAX_LOOPS = 3
+WORKERS = 4
+RUNS = 5
+EXPECTED_RET = 42
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    for cgroup in CGROUPS:
+        os.makedirs(cgroup, exist_ok=True)
+
+        with open(os.path.join(cgroup, 'memory.current'), 'w') as f:
+            f.write('1000\n')
+
+        with open(os.path.join(cgroup, 'memory.stat'), 'w') as f:
+            f.write('anon 8192\nfile 4096\n')
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    for run in range(RUNS):
+        belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                      workers=WORKERS, expected_ret=EXPECTED_RET)
+
+    return result, cause
+
+
+def teardown(config):
+    for cgroup in CGROUPS:
+        shutil.rmtree(cgroup, ignore_errors=True)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
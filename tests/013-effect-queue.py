@@ -0,0 +1,171 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test the effect executor's queue
+#
+# Both rules trip in the first tick.  The first rule's cgroup write and
+# print effect, and the second rule's validate effect, are queued in
+# config order, so the write must have run by the time validate ends
+# belayd.  The print effect reads the causes, so it is queued along with
+# a snapshot of them.
+#
+# The queue is then limited to a single effect, and the first rule of
+# another config keeps the executor busy for several ticks with a large
+# write.  The other two rules dwell for a few ticks, so that the write has
+# started by the time their effects are queued.  The second rule's effect
+# then waits in the queue, so it is coalesced when its rule trips again,
+# and it is dropped once it runs, because it waited past its 1ms timeout.
+# The third rule's effect finds the queue full, so its rule is deferred,
+# but its write must still run.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import belayd
+import consts
+import shutil
+import errno
+import json
+import os
+import re
+
+CONFIG = '013-effect-queue.json'
+CGROUP = '013-effect-queue.cgroup'
+KNOB = os.path.join(CGROUP, 'cpu.weight')
+INTERVAL = '100ms'
+MAX_LOOPS = 3
+QUEUE_DEPTH = 3
+EXPECTED_RET = 42
+EXPECTED_VALUE = '200'
+
+BUSY_CONFIG = '013-effect-queue.busy.json'
+BUSY_INTERVAL = '1ms'
+BUSY_MAX_LOOPS = 1000
+BUSY_QUEUE_DEPTH = 1
+BUSY_LOG_LEVEL = 7
+BIG_VALUE_SIZE = 32 << 20
+BUSY_KNOBS = ['big', 'late', 'deferred']
+DWELL = '3ms'
+DEFERRED_KNOB = os.path.join(CGROUP, 'deferred')
+DROPPED_MSG = 'Dropping effect cgroup_setting of rule Late'
+FULL_MSG = 'The effect queue is full, deferring effect cgroup_setting of rule Deferred'
+
+EVERY_DAY = {
+    'name': 'days_of_the_week',
+    'args': {'days': [{'day': day} for day in ['sunday', 'monday', 'tuesday', 'wednesday',
+                                              'thursday', 'friday', 'saturday']]}
+}
+
+
+def busy_rule(name, knob, value, **limits):
+    effect = {'name': 'cgroup_setting',
+              'args': {'cgroup': './' + CGROUP, 'setting': knob, 'value': value}}
+    effect.update(limits)
+
+    return {'name': name, 'causes': [EVERY_DAY], 'effects': [effect]}
+
+
+BUSY_RULES = {'rules': [
+    busy_rule('Busy', 'big', 'x' * BIG_VALUE_SIZE, cooldown='1h'),
+    busy_rule('Late', 'late', '1', dwell=DWELL, timeout='1ms'),
+    busy_rule('Deferred', 'deferred', '1', dwell=DWELL),
+]}
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    teardown(config)
+    os.mkdir(CGROUP)
+
+    for knob in [KNOB] + [os.path.join(CGROUP, knob) for knob in BUSY_KNOBS]:
+        open(knob, 'w').close()
+
+    with open(BUSY_CONFIG, 'w') as f:
+        json.dump(BUSY_RULES, f)
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                  queue_depth=QUEUE_DEPTH, expected_ret=EXPECTED_RET)
+
+    with open(KNOB) as f:
+        value = f.read()
+
+    if value != EXPECTED_VALUE:
+        result = consts.TEST_FAILED
+        cause = 'cpu.weight is "{}", expected "{}"'.format(value, EXPECTED_VALUE)
+        return result, cause
+
+    # no rule ends belayd, so it stops once it has run BUSY_MAX_LOOPS loops
+    out = belayd.belayd(config=BUSY_CONFIG, interval=BUSY_INTERVAL,
+                        max_loops=BUSY_MAX_LOOPS, queue_depth=BUSY_QUEUE_DEPTH,
+                        log_location='stdout', log_level=BUSY_LOG_LEVEL,
+                        expected_ret=errno.ETIME)
+
+    stats = re.search(r'coalesced: (\d+), deferred: (\d+), expired: (\d+)', out)
+    if not stats:
+        result = consts.TEST_FAILED
+        cause = 'The executor did not log its statistics'
+        return result, cause
+
+    for name, cnt in zip(['coalesced', 'deferred', 'expired'], stats.groups()):
+        if int(cnt) == 0:
+            result = consts.TEST_FAILED
+            cause = 'No effect was {}'.format(name)
+            return result, cause
+
+    for msg in [DROPPED_MSG, FULL_MSG]:
+        if msg not in out:
+            result = consts.TEST_FAILED
+            cause = 'Missing "{}" in the log'.format(msg)
+            return result, cause
+
+    # a deferred rule trips again, so its effect is delayed rather than lost
+    with open(DEFERRED_KNOB) as f:
+        value = f.read()
+
+    if value != '1':
+        result = consts.TEST_FAILED
+        cause = 'The deferred effect wrote "{}", expected "1"'.format(value)
+
+    return result, cause
+
+
+def teardown(config):
+    shutil.rmtree(CGROUP, ignore_errors=True)
+
+    if os.path.exists(BUSY_CONFIG):
+        os.remove(BUSY_CONFIG)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
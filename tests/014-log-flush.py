@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test the log flusher
+#
+# The rule is evaluated, and logs, in every loop.  Every message must
+# reach stdout whole and in order, including the ones logged while belayd
+# exits, after which the flusher has stopped.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import belayd
+import consts
+import errno
+import os
+
+CONFIG = '014-log-flush.json'
+INTERVAL = '100ms'
+MAX_LOOPS = 5
+LOG_LEVEL = 7
+# the rule never trips, so belayd stops once it has run MAX_LOOPS loops
+EXPECTED_RET = errno.ETIME
+RULE_MSG = 'Debug: Running rule Log test.  Logs every tick but should never trip'
+LAST_MSG = 'Debug: Cleaning up effect validate'
+PREFIXES = ('Error: ', 'Warning: ', 'Info: ', 'Debug: ')
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    pass
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    out = belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                        log_location='stdout', log_level=LOG_LEVEL,
+                        expected_ret=EXPECTED_RET)
+    lines = out.splitlines()
+
+    for line in lines:
+        if not line.startswith(PREFIXES):
+            result = consts.TEST_FAILED
+            cause = 'Malformed log line "{}"'.format(line)
+            return result, cause
+
+    # the rule runs once when belayd starts, and once per loop
+    runs = lines.count(RULE_MSG)
+    if runs != MAX_LOOPS + 1:
+        result = consts.TEST_FAILED
+        cause = 'The rule logged {} runs, expected {}'.format(runs, MAX_LOOPS + 1)
+        return result, cause
+
+    if lines[-1] != LAST_MSG:
+        result = consts.TEST_FAILED
+        cause = 'The last log line is "{}", expected "{}"'.format(lines[-1], LAST_MSG)
+
+    return result, cause
+
+
+def teardown(config):
+    pass
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test the metrics that belayd writes to a file
+#
+# The rule runs once when belayd starts, and once per loop.  Its first
+# cause trips every time and its second cause never does, so the rule
+# never trips and its effect never runs.  The final metrics are written
+# when belayd exits.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import belayd
+import consts
+import errno
+import os
+
+CONFIG = '015-metrics-file.json'
+METRICS_FILE = '015-metrics-file.prom'
+INTERVAL = '100ms'
+MAX_LOOPS = 5
+RUNS = MAX_LOOPS + 1
+# the rule never trips, so belayd stops once it has run MAX_LOOPS loops
+EXPECTED_RET = errno.ETIME
+
+RULE = 'rule="Metrics test.  Should never trip"'
+EXPECTED = {
+    'belayd_rule_evaluations_total{{{}}}'.format(RULE): RUNS,
+    'belayd_rule_trips_total{{{}}}'.format(RULE): 0,
+    'belayd_rule_errors_total{{{}}}'.format(RULE): 0,
+    'belayd_rule_duration_seconds_count{{{}}}'.format(RULE): RUNS,
+    'belayd_rule_duration_seconds_bucket{{{},le="+Inf"}}'.format(RULE): RUNS,
+    'belayd_cause_evaluations_total{{{},cause="meminfo",index="0"}}'.format(RULE): RUNS,
+    'belayd_cause_trips_total{{{},cause="meminfo",index="0"}}'.format(RULE): RUNS,
+    'belayd_cause_evaluations_total{{{},cause="meminfo",index="1"}}'.format(RULE): RUNS,
+    'belayd_cause_trips_total{{{},cause="meminfo",index="1"}}'.format(RULE): 0,
+    'belayd_cause_duration_seconds_count{{{},cause="meminfo",index="1"}}'.format(RULE): RUNS,
+    'belayd_effect_runs_total{{{},effect="validate",index="0"}}'.format(RULE): 0,
+}
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    teardown(config)
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                  metrics_file=METRICS_FILE, expected_ret=EXPECTED_RET)
+
+    metrics = dict()
+    with open(METRICS_FILE) as f:
+        for line in f:
+            if line.startswith('#'):
+                continue
+            name, value = line.rsplit(' ', 1)
+            metrics[name] = float(value)
+
+    for name, value in EXPECTED.items():
+        if metrics.get(name) != value:
+            result = consts.TEST_FAILED
+            cause = '{} is {}, expected {}'.format(name, metrics.get(name), value)
+            break
+
+    return result, cause
+
+
+def teardown(config):
+    if os.path.exists(METRICS_FILE):
+        os.remove(METRICS_FILE)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test the replay of recorded samples
+#
+# The samples cover 40 seconds of a Monday around noon, UTC.  Memory runs
+# low for ten seconds, the cgroup grows, and a PSI trigger fires once.
+# belayd runs the rules every 5 seconds of the recorded time, and prints
+# the effects that would have run rather than running them, so the
+# validate effects do not stop it, and the cgroup_setting effect does not
+# need its cgroup to exist.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import belayd
+import consts
+import json
+import os
+
+CONFIG = '016-loop-replay.json'
+SAMPLES = '016-loop-replay.samples'
+
+# Monday, July 3rd 2023, 11:59:50 UTC
+START = 1688385590
+MEMINFO = '/proc/meminfo'
+CGROUP = '/sys/fs/cgroup/test.slice/memory.current'
+PSI = '/proc/pressure/memory'
+
+SAMPLE_DATA = [
+    {'time': START, 'files': {MEMINFO: 'MemTotal: 8000000 kB\nMemAvailable: 500000 kB\n',
+                              CGROUP: '500\n'}},
+    {'time': START + 10, 'files': {MEMINFO: 'MemTotal: 8000000 kB\nMemAvailable: 50000 kB\n'}},
+    {'time': START + 20, 'files': {MEMINFO: 'MemTotal: 8000000 kB\nMemAvailable: 500000 kB\n',
+                                   CGROUP: '5000\n'},
+     'events': [PSI]},
+    {'time': START + 30},
+]
+
+# The time_of_day cause cannot trip before 12:00:01, so its rule sleeps
+# until then and runs every 5 seconds from there
+EXPECTED = [
+    (START + 10, 'Low memory', 'validate'),
+    (START + 11, 'Monday afternoon', 'print'),
+    (START + 15, 'Low memory', 'validate'),
+    (START + 16, 'Monday afternoon', 'print'),
+    (START + 20, 'Big cgroup', 'cgroup_setting'),
+    (START + 20, 'Big cgroup', 'validate'),
+    (START + 20, 'Memory pressure', 'validate'),
+    (START + 21, 'Monday afternoon', 'print'),
+    (START + 25, 'Big cgroup', 'cgroup_setting'),
+    (START + 25, 'Big cgroup', 'validate'),
+    (START + 26, 'Monday afternoon', 'print'),
+    (START + 30, 'Big cgroup', 'cgroup_setting'),
+    (START + 30, 'Big cgroup', 'validate'),
+]
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    teardown(config)
+
+    with open(SAMPLES, 'w') as f:
+        for sample in SAMPLE_DATA:
+            f.write(json.dumps(sample) + '\n')
+
+    # the time causes use local time
+    os.environ['TZ'] = 'UTC'
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    out = belayd.belayd(config=CONFIG, replay=SAMPLES)
+
+    effects = list()
+    for line in out.splitlines():
+        record = json.loads(line)
+        effects.append((record['time'], record['rule'], record['effect']))
+
+    if effects != EXPECTED:
+        result = consts.TEST_FAILED
+        cause = 'Expected effects {}, got {}'.format(EXPECTED, effects)
+
+    return result, cause
+
+
+def teardown(config):
+    if os.path.exists(SAMPLES):
+        os.remove(SAMPLES)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test causes that aggregate their readings over a sliding window
+#
+# MemAvailable dips once for a single sample, and later stays low for
+# four samples in a row.  The cgroup's CPU usage speeds up for fifteen
+# seconds.  The samples are replayed, and the rules run every 5 seconds
+# of the recorded time, once each sample has been applied.  Sustained
+# runs every 100ms instead, so that its 30s window holds more readings
+# than it has slots.  Gated only evaluates its windowed cause after an
+# instant one, which short-circuits it whenever memory is plentiful.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import belayd
+import consts
+import json
+import os
+
+CONFIG = '017-cause-window.json'
+SAMPLES = '017-cause-window.samples'
+
+START = 1688385590
+MEMINFO = '/proc/meminfo'
+CPU_STAT = '/sys/fs/cgroup/test.slice/cpu.stat'
+
+HIGH = 500000
+LOW = 10000
+LOW_TIMES = [10, 25, 30, 35, 40]
+
+
+def usage_usec(secs):
+    # 200ms of CPU per second, then a full CPU between 30 and 45 seconds
+    if secs <= 30:
+        return secs * 200000
+    return 6000000 + (min(secs, 45) - 30) * 1000000
+
+
+SAMPLE_DATA = [
+    {'time': START + secs,
+     'files': {MEMINFO: 'MemTotal: 8000000 kB\nMemAvailable: {} kB\n'.format(
+                   LOW if secs in LOW_TIMES else HIGH),
+               CPU_STAT: 'usage_usec {}\nuser_usec 0\n'.format(usage_usec(secs))}}
+    for secs in range(0, 65, 5)
+]
+
+EXPECTED_TIMES = {
+    # every low reading
+    'Instant': LOW_TIMES,
+    # only once the 20s window holds nothing but low readings
+    'Average': [40],
+    # once at least half of the 20s window is low
+    'Median': [25, 30, 35, 40, 45, 50],
+    # while the 15s window holds no low reading
+    'Plenty': [0, 5, 55, 60],
+    # while the 10s window spans the faster usage
+    'Busy': [35, 40, 45],
+    # once low readings make up more than 0.61 of the 30s window.  it
+    # then cools down for the rest of the replay
+    'Sustained': [38],
+    # as Average.  the window is sampled even when the first cause did
+    # not trip
+    'Gated': [40],
+}
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    teardown(config)
+
+    with open(SAMPLES, 'w') as f:
+        for sample in SAMPLE_DATA:
+            f.write(json.dumps(sample) + '\n')
+
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    out = belayd.belayd(config=CONFIG, replay=SAMPLES)
+
+    times = {rule: list() for rule in EXPECTED_TIMES}
+    for line in out.splitlines():
+        record = json.loads(line)
+        times[record['rule']].append(round(record['time'] - START))
+
+    if times != EXPECTED_TIMES:
+        result = consts.TEST_FAILED
+        cause = 'Expected rules to trip at {}, got {}'.format(EXPECTED_TIMES, times)
+
+    return result, cause
+
+
+def teardown(config):
+    if os.path.exists(SAMPLES):
+        os.remove(SAMPLES)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
@@ -0,0 +1,198 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test the cooldown, dwell and max_rate of effects
+#
+# MemAvailable stays low for a minute, except for the sample at 30
+# seconds.  The samples are replayed, and the rules run every 5 seconds of
+# the recorded time.  Each rule's effect limits how often it runs in a
+# different way.
+#
+# The effects are then run live, where an effect that is still waiting in
+# the executor's queue is not queued again when its rule trips.  Such a
+# coalesced submission must not count against the effect's limits.  The
+# first rule's large write keeps the executor busy for several ticks, so
+# the second rule's effect, which may run twice per hour, is coalesced in
+# the meantime, and must still run a second time once it is dequeued.
+#
+# Finally, a max_rate without a period or without a count is rejected.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import belayd
+import consts
+import shutil
+import errno
+import json
+import os
+import re
+
+CONFIG = '018-effect-limits.json'
+SAMPLES = '018-effect-limits.samples'
+
+START = 1688385590
+MEMINFO = '/proc/meminfo'
+
+HIGH_TIMES = [30]
+
+QUEUE_CONFIG = '018-effect-limits.queue.json'
+QUEUE_CGROUP = '018-effect-limits.cgroup'
+QUEUE_INTERVAL = '1ms'
+QUEUE_MAX_LOOPS = 200
+QUEUE_LOG_LEVEL = 7
+BIG_VALUE_SIZE = 16 << 20
+SMALL_KNOB = os.path.join(QUEUE_CGROUP, 'small')
+EXPECTED_SMALL_RUNS = 2
+
+INVALID_CONFIG = '018-effect-limits.invalid.json'
+INVALID_RATES = ['3/', '/1h', '0/1h']
+
+SAMPLE_DATA = [
+    {'time': START + secs,
+     'files': {MEMINFO: 'MemTotal: 8000000 kB\nMemAvailable: {} kB\n'.format(
+                   500000 if secs in HIGH_TIMES else 10000)}}
+    for secs in range(0, 65, 5)
+]
+
+EVERY_DAY = {
+    'name': 'days_of_the_week',
+    'args': {'days': [{'day': day} for day in ['sunday', 'monday', 'tuesday', 'wednesday',
+                                              'thursday', 'friday', 'saturday']]}
+}
+
+QUEUE_RULES = {'rules': [
+    {'name': 'Busy', 'causes': [EVERY_DAY],
+     'effects': [{'name': 'cgroup_setting', 'cooldown': '1h',
+                  'args': {'cgroup': './' + QUEUE_CGROUP, 'setting': 'big',
+                           'value': 'x' * BIG_VALUE_SIZE}}]},
+    {'name': 'Coalesced', 'causes': [EVERY_DAY],
+     'effects': [{'name': 'cgroup_setting', 'max_rate': '2/1h',
+                  'args': {'cgroup': './' + QUEUE_CGROUP, 'setting': 'small',
+                           'value': '1'}}]},
+]}
+
+
+
+def invalid_rules(rate):
+    return {'rules': [
+        {'name': 'Invalid', 'causes': [EVERY_DAY],
+         'effects': [{'name': 'validate', 'max_rate': rate,
+                      'args': {'return_value': '1'}}]},
+    ]}
+
+
+EXPECTED_TIMES = {
+    # whenever the rule trips
+    'Unlimited': [0, 5, 10, 15, 20, 25, 35, 40, 45, 50, 55, 60],
+    # at least 12 seconds apart
+    'Cooldown': [0, 15, 35, 50],
+    # once the rule has held for 10 seconds, which starts over at 35
+    'Dwell': [10, 15, 20, 25, 45, 50, 55, 60],
+    # a burst of two, then one every 15 seconds
+    'Rate': [0, 5, 15, 35, 45, 60],
+}
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    teardown(config)
+
+    with open(SAMPLES, 'w') as f:
+        for sample in SAMPLE_DATA:
+            f.write(json.dumps(sample) + '\n')
+
+    os.mkdir(QUEUE_CGROUP)
+    for knob in ('big', 'small'):
+        open(os.path.join(QUEUE_CGROUP, knob), 'w').close()
+
+    with open(QUEUE_CONFIG, 'w') as f:
+        json.dump(QUEUE_RULES, f)
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    out = belayd.belayd(config=CONFIG, replay=SAMPLES)
+
+    times = {rule: list() for rule in EXPECTED_TIMES}
+    for line in out.splitlines():
+        record = json.loads(line)
+        times[record['rule']].append(round(record['time'] - START))
+
+    if times != EXPECTED_TIMES:
+        result = consts.TEST_FAILED
+        cause = 'Expected rules to trip at {}, got {}'.format(EXPECTED_TIMES, times)
+        return result, cause
+
+    # neither rule ends belayd, so it stops once it has run QUEUE_MAX_LOOPS loops
+    out = belayd.belayd(config=QUEUE_CONFIG, interval=QUEUE_INTERVAL,
+                        max_loops=QUEUE_MAX_LOOPS, log_location='stdout',
+                        log_level=QUEUE_LOG_LEVEL, expected_ret=errno.ETIME)
+
+    coalesced = re.search(r'coalesced: (\d+)', out)
+    if not coalesced or int(coalesced.group(1)) == 0:
+        result = consts.TEST_FAILED
+        cause = 'No effect was coalesced in the executor\'s queue'
+        return result, cause
+
+    # the first run writes the knob, and the second finds it already set
+    runs = len([line for line in out.splitlines() if SMALL_KNOB in line])
+    if runs != EXPECTED_SMALL_RUNS:
+        result = consts.TEST_FAILED
+        cause = 'The coalesced effect ran {} times, expected {}'.format(
+                runs, EXPECTED_SMALL_RUNS)
+        return result, cause
+
+    # belayd would run the rule once if it accepted the config
+    for rate in INVALID_RATES:
+        with open(INVALID_CONFIG, 'w') as f:
+            json.dump(invalid_rules(rate), f)
+
+        belayd.belayd(config=INVALID_CONFIG, max_loops=1, expected_ret=errno.EINVAL)
+
+    return result, cause
+
+
+def teardown(config):
+    if os.path.exists(SAMPLES):
+        os.remove(SAMPLES)
+
+    if os.path.exists(QUEUE_CONFIG):
+        os.remove(QUEUE_CONFIG)
+
+    if os.path.exists(INVALID_CONFIG):
+        os.remove(INVALID_CONFIG)
+
+    shutil.rmtree(QUEUE_CGROUP, ignore_errors=True)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test rules with a when expression
+#
+# MemAvailable runs low twice, the cgroup grows in between, and a PSI
+# trigger fires once, on a Monday.  The samples are replayed, and the rules
+# run every 5 seconds of the recorded time.  Each rule combines the causes
+# with and, or and not.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import belayd
+import consts
+import json
+import os
+
+CONFIG = '019-rule-when.json'
+SAMPLES = '019-rule-when.samples'
+
+# Monday, July 3rd 2023, 11:59:50 UTC
+START = 1688385590
+MEMINFO = '/proc/meminfo'
+CGROUP = '/sys/fs/cgroup/test.slice/memory.current'
+PSI = '/proc/pressure/memory'
+
+LOW_TIMES = [10, 15, 30, 35]
+BIG_TIMES = [20, 25, 30, 35]
+PSI_TIMES = [20]
+
+SAMPLE_DATA = [
+    {'time': START + secs,
+     'files': {MEMINFO: 'MemTotal: 8000000 kB\nMemAvailable: {} kB\n'.format(
+                   10000 if secs in LOW_TIMES else 500000),
+               CGROUP: '{}\n'.format(5000 if secs in BIG_TIMES else 500)},
+     'events': [PSI] if secs in PSI_TIMES else []}
+    for secs in range(0, 45, 5)
+]
+
+EXPECTED_TIMES = {
+    'Either': [10, 15, 20, 25, 30, 35],
+    'Low but small': [10, 15],
+    'Quiet': [0, 5, 40],
+    'Either way': [10, 15, 30, 35],
+    'Nested': [20, 30, 35],
+}
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    teardown(config)
+
+    with open(SAMPLES, 'w') as f:
+        for sample in SAMPLE_DATA:
+            f.write(json.dumps(sample) + '\n')
+
+    # the days_of_the_week cause uses local time
+    os.environ['TZ'] = 'UTC'
+
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    out = belayd.belayd(config=CONFIG, replay=SAMPLES)
+
+    times = {rule: list() for rule in EXPECTED_TIMES}
+    for line in out.splitlines():
+        record = json.loads(line)
+        times[record['rule']].append(round(record['time'] - START))
+
+    if times != EXPECTED_TIMES:
+        result = consts.TEST_FAILED
+        cause = 'Expected rules to trip at {}, got {}'.format(EXPECTED_TIMES, times)
+
+    return result, cause
+
+
+def teardown(config):
+    if os.path.exists(SAMPLES):
+        os.remove(SAMPLES)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test the reordering of a rule's causes
+#
+# Both rules start with a meminfo cause that never trips, which reads
+# /proc/meminfo, and so stops the evaluation before their time_of_day
+# cause, which cannot trip either, is ever run.  Once the first rule has
+# run REORDER_PERIOD times, it must start with the time_of_day cause
+# instead, which has not been measured yet.  The second rule sets
+# "reorder" to false, so it must keep evaluating its causes in config
+# order.  The causes differ in their args, so they are not shared.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import belayd
+import consts
+import errno
+import os
+
+CONFIG = '020-loop-reorder.json'
+INTERVAL = '10ms'
+# stay below the second reordering, which depends on the measured costs
+MAX_LOOPS = 47
+LOG_LEVEL = 7
+# neither rule trips, so belayd stops once it has run MAX_LOOPS loops
+EXPECTED_RET = errno.ETIME
+
+# see loop.c
+REORDER_PERIOD = 32
+
+RULE_PREFIX = 'Debug: Running rule '
+NOT_TRIPPED_SUFFIX = ' did not trip'
+ORDER_MSG = 'Debug: Rule Reorder evaluation order:'
+EXPECTED_FIRST = ['time_of_day', 'meminfo']
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    pass
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    out = belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                        log_location='stdout', log_level=LOG_LEVEL,
+                        expected_ret=EXPECTED_RET)
+    lines = out.splitlines()
+
+    # the cause that stopped each run of each rule, i.e. the first one run
+    first = {'Reorder': list(), 'No reorder': list()}
+    rule = None
+    for line in lines:
+        if line.startswith(RULE_PREFIX):
+            rule = line[len(RULE_PREFIX):]
+        elif line.startswith('Debug: ') and line.endswith(NOT_TRIPPED_SUFFIX):
+            first[rule].append(line[len('Debug: '):-len(NOT_TRIPPED_SUFFIX)])
+
+    runs = len(first['Reorder'])
+    if runs <= REORDER_PERIOD:
+        result = consts.TEST_FAILED
+        cause = 'The rule ran {} times, expected more than {}'.format(runs, REORDER_PERIOD)
+        return result, cause
+
+    expected = ['meminfo'] * REORDER_PERIOD + ['time_of_day'] * (runs - REORDER_PERIOD)
+    if first['Reorder'] != expected:
+        result = consts.TEST_FAILED
+        cause = 'Expected the reordered rule to start with {}, got {}'.format(
+                expected, first['Reorder'])
+        return result, cause
+
+    expected = ['meminfo'] * len(first['No reorder'])
+    if not expected or first['No reorder'] != expected:
+        result = consts.TEST_FAILED
+        cause = 'Expected the rule that is not reordered to start with {}, got {}'.format(
+                expected, first['No reorder'])
+        return result, cause
+
+    # the new order is logged along with the statistics of each cause
+    if ORDER_MSG not in lines:
+        result = consts.TEST_FAILED
+        cause = 'The new evaluation order was not logged'
+        return result, cause
+
+    idx = lines.index(ORDER_MSG) + 1
+    order = [line.split(':')[1].strip() for line in lines[idx:idx + len(EXPECTED_FIRST)]]
+    if order != EXPECTED_FIRST:
+        result = consts.TEST_FAILED
+        cause = 'The logged evaluation order is {}, expected {}'.format(order, EXPECTED_FIRST)
+
+    return result, cause
+
+
+def teardown(config):
+    pass
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+#### LICENSE TBD
+#
+# Test the sharing of identical causes between rules
+#
+# The first three rules contain the same meminfo cause, which never
+# trips, but with its keys in a different order and with different
+# whitespace.  They must share a single instance, whose main() runs once
+# per tick, while the other two rules reuse its result.  The cause of the
+# fourth rule differs only in its args, so it must not be shared.
+#
+# Copyright (c) 2023 Oracle and/or its affiliates.
+# Author: Tom Hromatka <tom.hromatka@oracle.com>
+#
+
+import belayd
+import consts
+import errno
+import os
+
+CONFIG = '021-cause-sharing.json'
+INTERVAL = '100ms'
+MAX_LOOPS = 5
+LOG_LEVEL = 7
+# no rule trips, so belayd stops once it has run MAX_LOOPS loops
+EXPECTED_RET = errno.ETIME
+
+SHARED_RULES = ['Shared 1', 'Shared 2', 'Shared 3']
+UNSHARED_RULE = 'Not shared'
+
+RULE_PREFIX = 'Debug: Running rule '
+SHARING_MSG = 'Debug: Sharing cause meminfo with an identical cause'
+REUSED_MSG = 'Debug: meminfo already ran this tick, reusing result 0'
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    return result, cause
+
+
+def setup(config):
+    pass
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    out = belayd.belayd(config=CONFIG, interval=INTERVAL, max_loops=MAX_LOOPS,
+                        log_location='stdout', log_level=LOG_LEVEL,
+                        expected_ret=EXPECTED_RET)
+    lines = out.splitlines()
+
+    # the second and third rules share the cause of the first one
+    shares = lines.count(SHARING_MSG)
+    if shares != len(SHARED_RULES) - 1:
+        result = consts.TEST_FAILED
+        cause = 'The cause was shared {} times, expected {}'.format(
+                shares, len(SHARED_RULES) - 1)
+        return result, cause
+
+    # whether each run of each rule reused the result of another rule
+    reused = {rule: list() for rule in SHARED_RULES + [UNSHARED_RULE]}
+    rule = None
+    for line in lines:
+        if line.startswith(RULE_PREFIX):
+            rule = line[len(RULE_PREFIX):]
+            reused[rule].append(False)
+        elif line == REUSED_MSG:
+            reused[rule][-1] = True
+
+    # the rules run once when belayd starts, and once per loop
+    ticks = len(reused[UNSHARED_RULE])
+    if ticks != MAX_LOOPS + 1:
+        result = consts.TEST_FAILED
+        cause = 'The unshared rule ran {} times, expected {}'.format(ticks, MAX_LOOPS + 1)
+        return result, cause
+
+    if True in reused[UNSHARED_RULE]:
+        result = consts.TEST_FAILED
+        cause = 'The cause that differs in its args was shared'
+        return result, cause
+
+    # in every tick, exactly one of the rules that share the cause runs it
+    for tick in range(ticks):
+        runs = [rule for rule in SHARED_RULES
+                if len(reused[rule]) > tick and not reused[rule][tick]]
+        if len(runs) != 1:
+            result = consts.TEST_FAILED
+            cause = 'The shared cause ran in {} during tick {}, expected one rule'.format(
+                    runs, tick)
+            return result, cause
+
+    return result, cause
+
+
+def teardown(config):
+    pass
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
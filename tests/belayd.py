@@ -14,7 +14,9 @@ import os
 
 
 def belayd(config=None, bhelp=False, interval=None, log_location=None,
-           log_level=None, max_loops=None, expected_ret=None):
+           log_level=None, max_loops=None, compile=False, image=None,
+           workers=None, queue_depth=None, metrics_file=None,
+           replay=None, expected_ret=None):
     """run the belayd daemon
     """
     cmd = list()
@@ -34,6 +36,13 @@ def belayd(config=None, bhelp=False, interval=None, log_location=None,
     if bhelp:
         cmd.append('-h')
 
+    if compile:
+        cmd.append('-C')
+
+    if image:
+        cmd.append('-I')
+        cmd.append(image)
+
     if interval:
         cmd.append('-i')
         cmd.append(str(interval))
@@ -46,17 +55,37 @@ def belayd(config=None, bhelp=False, interval=None, log_location=None,
         cmd.append('-l')
         cmd.append(str(log_level))
 
+    if metrics_file:
+        cmd.append('-F')
+        cmd.append(metrics_file)
+
     if max_loops:
         cmd.append('-m')
         cmd.append(str(max_loops))
 
+    if queue_depth:
+        cmd.append('-q')
+        cmd.append(str(queue_depth))
+
+    if replay:
+        cmd.append('-R')
+        cmd.append(replay)
+
+    if workers is not None:
+        cmd.append('-w')
+        cmd.append(str(workers))
+
+    out = None
+
     try:
-        Run.run(cmd)
+        out = Run.run(cmd)
     except RunError as re:
         if re.ret == expected_ret:
-            pass
+            out = re.stdout
         else:
             raise re
     finally:
         if tmp_config != config:
             os.remove(tmp_config)
+
+    return out